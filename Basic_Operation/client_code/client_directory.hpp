@@ -0,0 +1,299 @@
+#ifndef CLIENT_DIRECTORY
+#define CLIENT_DIRECTORY
+
+#include "filesystem_client.hpp"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+
+static FileAttributes to_attributes(const afs_operation::GetAttrResponse& response); // filesystem_client.cpp
+
+// Streaming directory listings (list_dir)
+// Only the page being handed over is held, so listing a directory of millions of entries takes as much memory as
+// listing one of a thousand. FUSE reads a directory in buffer sized pieces, each resuming at the offset of the last
+// entry it kept; as long as that is where the stream stands the same stream goes on, without a new RPC.
+
+std::unique_ptr<FileSystemClient::DirectoryStream> FileSystemClient::open_directory(const std::string& directory, bool with_attributes, uint32_t page_size) {
+    return std::unique_ptr<DirectoryStream>(new DirectoryStream(this, resolve_server_path(directory), with_attributes, page_size));
+}
+
+FileSystemClient::DirectoryStream::DirectoryStream(FileSystemClient* client, std::string resolved_path, bool with_attributes, uint32_t page_size)
+    : client(client), resolved_path(std::move(resolved_path)), with_attributes(with_attributes), page_size(page_size) {}
+
+FileSystemClient::DirectoryStream::~DirectoryStream() {
+    cancel();
+}
+
+bool FileSystemClient::DirectoryStream::read(uint64_t cursor, const std::function<bool(const afs_operation::DirEntry&)>& fn) {
+    if (cursor != position || (!reader && !ended)) restart(cursor);
+    while (true) {
+        for (; next < page.entries_size(); next++) {
+            const afs_operation::DirEntry& entry = page.entries(next);
+            if (!fn(entry)) return true; // still the next one, for the read() that resumes at position
+            position = entry.cookie();
+        }
+        if (ended) return true;
+        if (!next_page()) return false;
+    }
+}
+
+void FileSystemClient::DirectoryStream::restart(uint64_t cursor) {
+    cancel();
+    context = std::make_unique<grpc::ClientContext>();
+    afs_operation::ListDirRequest request;
+    request.set_directory(resolved_path);
+    request.set_cursor(cursor);
+    request.set_page_size(page_size);
+    request.set_with_attributes(with_attributes);
+    if (cursor == 0 && client->options.listing_cache_entries > 0) request.set_client_id(client->client_id);
+    reader = client->stub_->list_dir(context.get(), request);
+    page.Clear();
+    next = 0;
+    position = cursor;
+    ended = false;
+    not_found = false;
+    collected.clear();
+    collecting = cursor == 0 && client->options.listing_cache_entries > 0;
+    if (collecting) {
+        std::lock_guard<std::mutex> lock(client->cache_mutex);
+        generation = client->listing_generation;
+    }
+}
+
+void FileSystemClient::DirectoryStream::cancel() {
+    if (!reader) return;
+    context->TryCancel();
+    afs_operation::DirPage rest;
+    while (reader->Read(&rest)) {}
+    reader->Finish();
+    reader.reset();
+    context.reset();
+}
+
+// replaces the page that was handed over with the next one, or notes the end of the directory
+bool FileSystemClient::DirectoryStream::next_page() {
+    page.Clear();
+    next = 0;
+    if (reader->Read(&page)) {
+        if (collecting) {
+            for (const afs_operation::DirEntry& entry : page.entries()) {
+                // every entry with its type as the server sent it, without "." and ".."
+                if (entry.name() != "." && entry.name() != "..") collected[entry.name()] = static_cast<unsigned char>(entry.type());
+            }
+            if (collected.size() > client->options.listing_cache_entries) {
+                collecting = false;
+                collected.clear();
+            }
+        }
+        if (!with_attributes) return true;
+        std::string prefix = resolved_path + (resolved_path.back() == '/' ? "" : "/");
+        std::lock_guard<std::mutex> lock(client->cache_mutex);
+        for (const afs_operation::DirEntry& entry : page.entries()) {
+            if (!entry.has_attr()) continue; // "." and ".."
+            // an entry already there is either just as fresh (notifications drop stale ones) or carries local writes
+            client->cached_attr.emplace(prefix + entry.name(), to_attributes(entry.attr()));
+        }
+        return true;
+    }
+    grpc::Status status = reader->Finish();
+    reader.reset();
+    context.reset();
+    if (!status.ok()) {
+        std::cerr << "Failed to list " << resolved_path << ": " << status.error_message() << std::endl;
+        not_found = status.error_code() == grpc::StatusCode::NOT_FOUND;
+        return false;
+    }
+    ended = true;
+    if (collecting) client->keep_listing(resolved_path, std::move(collected), generation);
+    collecting = false;
+    return true;
+}
+
+// Directory listing cache
+// A listing read in full from the server is kept until the server breaks the callback it took on the directory
+// (NOTIFY_DIRECTORY), the lease on it runs out, or this client changes the directory itself: the server doesn't tell
+// a client about its own changes. A readdir of a directory that didn't change then costs no round trip at all.
+// Names getattr found missing (negative entries) live under the same callback and go with the listing.
+
+std::string FileSystemClient::listing_key(const std::string& directory) {
+    std::string key = directory;
+    while (key.size() > 1 && key.back() == '/') key.pop_back();
+    return key;
+}
+
+std::optional<DirectoryListing> FileSystemClient::cached_listing(const std::string& directory) {
+    std::string key = listing_key(resolve_server_path(directory));
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = listings.find(key);
+    if (it == listings.end()) return std::nullopt;
+    return it->second;
+}
+
+void FileSystemClient::keep_listing(const std::string& directory, DirectoryListing entries, uint64_t generation) {
+    if (entries.size() > options.listing_cache_entries) return;
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::string key = listing_key(directory);
+    if (dropped_since(key, generation)) return; // it may have changed while it was read
+    listings[key] = std::move(entries);
+}
+
+void FileSystemClient::note_drop(const std::string& path, bool below) {
+    listing_generation++;
+    recent_drops.emplace_back(path, below);
+    if (recent_drops.size() > 1024) recent_drops.pop_front();
+}
+
+bool FileSystemClient::dropped_since(const std::string& key, uint64_t generation) {
+    uint64_t drops = listing_generation - generation;
+    if (drops == 0) return false;
+    if (drops > recent_drops.size()) return true; // too long ago to tell
+    std::string under = key + "/";
+    for (auto it = recent_drops.end() - static_cast<std::ptrdiff_t>(drops); it != recent_drops.end(); ++it) {
+        if (it->first == key) return true;
+        if (it->second && under.compare(0, it->first.size(), it->first) == 0) return true;
+    }
+    return false;
+}
+
+void FileSystemClient::forget_directory(const std::string& directory, bool below) {
+    std::string key = listing_key(directory);
+    note_drop(below ? key + (key.back() == '/' ? "" : "/") : key, below);
+    listings.erase(key);
+    auto missing = negative_entries.find(key);
+    if (missing != negative_entries.end()) {
+        negative_count -= missing->second.size();
+        negative_entries.erase(missing);
+    }
+    if (!below) return;
+    std::string prefix = key + (key.back() == '/' ? "" : "/");
+    for (auto it = listings.lower_bound(prefix); it != listings.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+        it = listings.erase(it);
+    }
+    for (auto it = negative_entries.lower_bound(prefix); it != negative_entries.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+        negative_count -= it->second.size();
+        it = negative_entries.erase(it);
+    }
+}
+
+std::vector<std::string> FileSystemClient::held_directories() {
+    std::vector<std::string> directories;
+    for (const auto& [directory, entries] : listings) directories.push_back(directory);
+    for (const auto& [directory, names] : negative_entries) {
+        if (!listings.count(directory)) directories.push_back(directory);
+    }
+    return directories;
+}
+
+// Subtree walks (walk)
+// find or du over a mounted tree costs a readdir and a getattr per entry, each a round trip unless cached. walk
+// brings the whole tree in one stream instead, and leaves it in the caches under the same directory callbacks ls
+// takes, so the tool that follows hardly talks to the server at all. FUSE gets no notice that a walk is coming;
+// setting the user.afs.prefetch attribute on a directory asks for one.
+
+bool FileSystemClient::walk_subtree(const std::string& directory, uint32_t max_depth,
+                                    const std::function<void(const std::string&, const FileAttributes&)>& fn) {
+    std::string resolved_path = resolve_server_path(directory);
+    std::string root = listing_key(resolved_path);
+    grpc::ClientContext context;
+    afs_operation::WalkRequest request;
+    request.set_directory(resolved_path);
+    request.set_max_depth(max_depth);
+    bool caching = options.listing_cache_entries > 0;
+    uint64_t generation = 0;
+    if (caching) { // the listings are going to be cached, the server has to tell us when they change
+        request.set_client_id(client_id);
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        generation = listing_generation;
+    }
+
+    std::unique_ptr<grpc::ClientReader<afs_operation::WalkBatch>> reader = stub_->walk(&context, request);
+    afs_operation::WalkBatch batch;
+    std::map<std::string, DirectoryListing> partial; // directories split across batches
+    uint64_t directories = 0, entries = 0;
+    while (reader->Read(&batch)) {
+        std::vector<std::pair<std::string, FileAttributes>> seen;
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            for (const afs_operation::WalkDirectory& part : batch.directories()) {
+                std::string prefix = part.directory() + (part.directory().back() == '/' ? "" : "/");
+                DirectoryListing& listing = partial[part.directory()];
+                for (const afs_operation::DirectoryEntryPlus& entry : part.entries()) {
+                    listing[entry.name()] = static_cast<unsigned char>(IFTODT(entry.attr().mode()));
+                    // as in ls_plus_contents, an entry already there is just as fresh or carries local writes
+                    FileAttributes attrs = to_attributes(entry.attr());
+                    cached_attr.emplace(prefix + entry.name(), attrs);
+                    if (fn) {
+                        std::string relative = (prefix + entry.name()).substr(root.size() + (root.back() == '/' ? 0 : 1));
+                        seen.emplace_back(std::move(relative), std::move(attrs));
+                    }
+                }
+                entries += part.entries_size();
+                if (!part.complete()) continue;
+                directories++;
+                auto done = partial.find(part.directory());
+                if (caching && done->second.size() <= options.listing_cache_entries && !dropped_since(part.directory(), generation)) {
+                    listings[part.directory()] = std::move(done->second);
+                }
+                partial.erase(done);
+            }
+        }
+        for (const auto& [path, attrs] : seen) fn(path, attrs);
+    }
+    grpc::Status status = reader->Finish();
+    if (!status.ok()) {
+        std::cerr << "Failed to walk " << resolved_path << ": " << status.error_message() << std::endl;
+        return false;
+    }
+    std::cout << "Walked " << resolved_path << ": " << directories << " directories, " << entries << " entries" << std::endl;
+    return true;
+}
+
+// Finding names (find)
+// The server keeps every name under its root in an index, so a search costs one round trip however big the tree
+// is. Without the index (turned off, still being built, an older server) the subtree is walked and matched here.
+
+std::optional<std::vector<std::string>> FileSystemClient::find_paths(const std::string& directory, const std::string& pattern,
+                                                                     bool substring, uint32_t limit) {
+    grpc::ClientContext context;
+    afs_operation::FindRequest request;
+    afs_operation::FindResponse response;
+    request.set_directory(resolve_server_path(directory));
+    request.set_pattern(pattern);
+    request.set_substring(substring);
+    request.set_limit(limit);
+    grpc::Status status = stub_->find(&context, request, &response);
+    if (status.ok()) {
+        if (response.truncated()) std::cerr << "More than " << response.paths_size() << " paths match " << pattern << std::endl;
+        return std::vector<std::string>(response.paths().begin(), response.paths().end());
+    }
+    if (status.error_code() != grpc::StatusCode::UNAVAILABLE && status.error_code() != grpc::StatusCode::UNIMPLEMENTED) {
+        std::cerr << "Find failed: " << status.error_message() << std::endl;
+        return std::nullopt;
+    }
+
+    std::cout << "No name index on the server (" << status.error_message() << "), walking " << directory << std::endl;
+    std::string base = "/" + std::filesystem::path(directory).relative_path().generic_string();
+    while (base.size() > 1 && base.back() == '/') base.pop_back();
+    bool by_path = !substring && pattern.find('/') != std::string::npos;
+    std::string name_pattern = by_path ? pattern.substr(pattern.rfind('/') + 1) : pattern;
+    size_t most = limit == 0 ? 10000 : limit;
+    std::vector<std::string> paths;
+    bool truncated = false;
+    bool walked = walk_subtree(directory, 0, [&](const std::string& relative, const FileAttributes&) {
+        std::string name = relative.substr(relative.rfind('/') + 1);
+        bool match = substring ? name.find(pattern) != std::string::npos
+                   : by_path ? fnmatch(pattern.c_str(), relative.c_str(), FNM_PATHNAME) == 0
+                             : fnmatch(name_pattern.c_str(), name.c_str(), 0) == 0;
+        if (!match) return;
+        if (paths.size() >= most) {
+            truncated = true;
+            return;
+        }
+        paths.push_back(base + (base.back() == '/' ? "" : "/") + relative);
+    });
+    if (!walked) return std::nullopt;
+    if (truncated) std::cerr << "More than " << paths.size() << " paths match " << pattern << std::endl;
+    return paths;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef CLIENT_LEASES
+#define CLIENT_LEASES
+
+#include "filesystem_client.hpp"
+
+// Keeps the server's callback leases alive on everything still in the cache
+// Every quarter lease the cached paths are renewed in batches. A path the server reports as expired may have changed
+// without us hearing about it, so its copy is marked stale and revalidated on the next open, which takes a new lease.
+// If renewals keep failing for half a lease the server may have let all of them lapse, and the whole cache is
+// marked stale instead.
+void FileSystemClient::RunLeaseRenewal() {
+    if (lease_seconds <= 0) return; // the server keeps registrations until we disconnect
+    const size_t batch_size = 1024;
+    auto interval = std::chrono::milliseconds(static_cast<int64_t>(lease_seconds) * 250);
+    auto last_renewed = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(subscriber_mutex_);
+    while (!subscriber_cv_.wait_for(lock, interval, [this]{ return subscriber_stopping_; })) {
+        lock.unlock();
+        std::vector<std::string> paths;
+        cache_mutex.lock();
+        for (const auto& [location, info] : cache){
+            paths.push_back(server_path_of(location));
+        }
+        for (const std::string& directory : held_directories()){
+            paths.push_back(directory);
+        }
+        cache_mutex.unlock();
+
+        bool renewed = true;
+        std::vector<std::string> expired;
+        for (size_t at = 0; at < paths.size(); at += batch_size){
+            afs_operation::RenewLeasesRequest request;
+            request.set_client_id(client_id);
+            for (size_t i = at; i < std::min(paths.size(), at + batch_size); i++) request.add_paths(paths[i]);
+            afs_operation::RenewLeasesResponse response;
+            grpc::ClientContext context;
+            grpc::Status status = stub_->renew_leases(&context, request, &response);
+            if (!status.ok()){
+                std::cerr << "Lease renewal failed: " << status.error_message() << std::endl;
+                renewed = false;
+                break;
+            }
+            expired.insert(expired.end(), response.expired().begin(), response.expired().end());
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (renewed){
+            last_renewed = now;
+        }else if (now - last_renewed >= 2 * interval){
+            std::cout << "Leases not renewed for half a lease, revalidating the whole cache" << std::endl;
+            mark_stale_under("");
+            last_renewed = now;
+        }
+        if (!expired.empty()){
+            std::cout << expired.size() << " lease(s) expired on the server" << std::endl;
+            cache_mutex.lock();
+            for (const std::string& path : expired){
+                auto it = cache.find(std::string(cache_directory) + (path.front() == '/'? "" : "/") + path);
+                if (it != cache.end()){
+                    it->second.stale = true;
+                    it->second.tail_from = -1;
+                }
+                cached_attr.erase(path);
+                if (listings.count(path) || negative_entries.count(path)) forget_directory(path);
+            }
+            cache_mutex.unlock();
+        }
+        lock.lock();
+    }
+}
+
+#endif
@@ -4,46 +4,132 @@
 
 #include "filesystem_client.hpp"
 
+// keeps a subscription open for as long as the client lives
+// When the stream breaks it subscribes again, with backoff, from the last sequence number it saw: the server replays
+// what was missed (or asks for a resync if it can't), so the cache stays warm across a network blip or a server restart
 void FileSystemClient::RunSubscriber() {
-    afs_operation::SubscribeRequest request;
-    request.set_client_id(client_id);
+    int backoff_ms = 100;
+    while (true) {
+        afs_operation::SubscribeRequest request;
+        request.set_client_id(client_id);
+        request.set_epoch(notify_epoch);
+        request.set_from_seq(notify_seq);
+        if (notify_epoch != 0){ // resuming, in case the server lost our registrations
+            cache_mutex.lock();
+            for (const auto& [location, info] : cache){
+                request.add_cached_paths(server_path_of(location));
+            }
+            for (const std::string& directory : held_directories()){
+                request.add_cached_paths(directory);
+            }
+            cache_mutex.unlock();
+        }
+        grpc::ClientContext* context;
+        {
+            std::lock_guard<std::mutex> lock(subscriber_mutex_);
+            if (subscriber_stopping_) break;
+            subscriber_context_ = std::make_unique<grpc::ClientContext>();
+            context = subscriber_context_.get();
+        }
+
+        std::unique_ptr<grpc::ClientReader<afs_operation::NotificationBatch>> reader(stub_->subscribe(context, request));
+        if (!reader) {
+            std::cerr << "ERROR: Failed to create subscription reader" << std::endl;
+            return;
+        }
 
-    std::unique_ptr<grpc::ClientReader<afs_operation::Notification>> reader(
-        stub_->subscribe(subscriber_context_.get(), request));
+        afs_operation::NotificationBatch batch;
+        while (reader->Read(&batch)) {          // execution blocks here and the while loop won't be executed until a notification arrives
+            backoff_ms = 100;
+            handle_notifications(batch);
+        }
 
-    if (!reader) {
-        std::cerr << "ERROR: Failed to create subscription reader" << std::endl;
-        return;
+        grpc::Status status = reader->Finish();
+        if (!status.ok()) {
+            std::cerr << "Subscriber stream failed: " << status.error_code()
+                << " - " << status.error_message() << std::endl;
+        }
+        // try again after a pause, unless the client is going away
+        std::unique_lock<std::mutex> lock(subscriber_mutex_);
+        if (subscriber_cv_.wait_for(lock, std::chrono::milliseconds(backoff_ms), [this]{ return subscriber_stopping_; })) break;
+        backoff_ms = std::min(backoff_ms * 2, 5000);
     }
+}
 
-    afs_operation::Notification note;
-    while (reader->Read(&note)) {          // execution blocks here and the while loop won't be executed until a notification arrives
-        std::cout << "NOTIFICATION RECEIVED: " << note.message() << " for " << note.directory() << std::endl;
+void FileSystemClient::handle_notifications(const afs_operation::NotificationBatch& batch) {
+    // the server folds repeats for one path into one, so each path shows up at most once between renames
+    for (const afs_operation::Notification& note : batch.notifications()) {
+        notify_seq = std::max(notify_seq, note.seq());
+        std::cout << "NOTIFICATION RECEIVED: " << afs_operation::NotificationType_Name(note.type()) << " for " << note.directory() << std::endl;
+
+        // the server's queue for us overflowed: whatever we cache under the prefix may be stale
+        if (note.type() == afs_operation::NOTIFY_RESYNC){
+            mark_stale_under(note.directory());
+            continue;
+        }
+
+        // an entry of a directory we listed changed: the listing goes, and so do the attributes it brought along for
+        // entries we don't cache (those hear about their own changes)
+        if (note.type() == afs_operation::NOTIFY_DIRECTORY){
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            forget_directory(note.directory());
+            std::string prefix = listing_key(note.directory());
+            if (prefix.back() != '/') prefix += '/';
+            for (auto it = cached_attr.lower_bound(prefix); it != cached_attr.end() && it->first.compare(0, prefix.size(), prefix) == 0;){
+                bool child = it->first.find('/', prefix.size()) == std::string::npos;
+                std::string location = std::string(cache_directory) + (it->first.front() == '/'? "" : "/") + it->first;
+                if (child && cache.find(location) == cache.end()) it = cached_attr.erase(it);
+                else ++it;
+            }
+            continue;
+        }
+        // a directory that was removed or moved takes the listings of everything below it along
+        if (note.type() == afs_operation::NOTIFY_DELETE || note.type() == afs_operation::NOTIFY_RENAME){
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            forget_directory(note.directory(), true);
+        }
 
         // note.directory() contains the FULL FILE PATH (not just directory)
         std::string path_on_server = note.directory();
         std::string path_on_client = std::string(cache_directory) + (path_on_server.front() == '/'? "" : "/") + path_on_server;
 
-            // we will erase the corresponding file in cache if we want to update
+            // An UPDATE (or APPEND) only marks the cached copy stale instead of erasing it: the next open revalidates it with
+            // compare() and only downloads if the server version really differs from the one we hold.
+            // Other notifications (DELETE, Rename) change the namespace, so the entry is dropped altogether
             // it is important to note that two clients can't open the same file at the same time
-            // otherwise, if one flushes its changes to the server and the other still has the file opened and the file in cache is removed
-            // It can lead to undefined behaviour
-
-            // check if file is opened
         cache_mutex.lock();
-        if (opened_files.find(path_on_client) != opened_files.end()){
-            std::cout << "Error: File currently open and updates from server failed for " << path_on_client << std::endl;
-            cache_mutex.unlock();
-            continue; // go to the top of the while loop and abort this update
-        }
         auto it = cache.find(path_on_client);
-        if (it != cache.end()){ // we can find the file in cache. Since we registered, it should always be in cache
-            cache.erase(it); // erase the cache
-        }else{ // not in cache
+        if (it == cache.end()){ // not in cache
             std::cout << "Inconsistent State: File: " << path_on_client << " is registered but not in cache"<< std::endl;
             cache_mutex.unlock();
             continue; 
         }
+        bool is_open = opened_files.find(path_on_client) != opened_files.end();
+        // An APPEND on top of exactly the version we hold means our copy is still a valid prefix: remember where
+        // it ends so the next open only fetches the new tail. Anything else is handled like a plain UPDATE.
+        // An empty copy is no use as a prefix, and a tail from offset 0 would read as no offset at all
+        bool tail_only = note.type() == afs_operation::NOTIFY_APPEND && !is_open && !it->second.locally_modified &&
+                         it->second.timestamp == note.base_timestamp() && note.old_size() > 0;
+        if (tail_only){
+            int64_t from = note.old_size();
+            if (it->second.tail_from >= 0) from = std::min(from, it->second.tail_from);
+            it->second.tail_from = from;
+            it->second.timestamp = note.timestamp();
+            it->second.stale = true;
+        }else if (note.type() == afs_operation::NOTIFY_UPDATE || note.type() == afs_operation::NOTIFY_APPEND){
+            it->second.tail_from = -1;
+            it->second.stale = true;
+            if (is_open){ // keep using the open copy, it gets revalidated on its next open
+                cache_mutex.unlock();
+                continue;
+            }
+        }else if (is_open){
+            std::cout << "Error: File currently open and updates from server failed for " << path_on_client << std::endl;
+            cache_mutex.unlock();
+            continue; // go on with the next notification and abort this update
+        }else{
+            cache.erase(it); // erase the cache
+        }
         auto its = cached_attr.find(path_on_server);
         if (its != cached_attr.end()){
             cached_attr.erase(its);
@@ -54,12 +140,39 @@ void FileSystemClient::RunSubscriber() {
         }
         cache_mutex.unlock();
     }
+    // the first batch of a stream: we are caught up to head_seq, of a log that may have started over
+    if (batch.epoch() != 0){
+        notify_seq = batch.epoch() == notify_epoch ? std::max(notify_seq, batch.head_seq()) : batch.head_seq();
+        notify_epoch = batch.epoch();
+    }
+}
 
-    grpc::Status status = reader->Finish();
-    if (!status.ok()) {
-        std::cerr << "Subscriber stream failed: " << status.error_code() 
-            << " - " << status.error_message() << std::endl;
+// the server path a cached copy at location stands for
+std::string FileSystemClient::server_path_of(const std::string& location) {
+    std::string path = location.substr(std::min(location.size(), cache_directory.size()));
+    if (!path.empty() && path.front() == '/' && !server_root_path_.empty() && server_root_path_.front() != '/') path.erase(0, 1);
+    return path;
+}
+
+// every cached copy of a server path starting with prefix ("" for all of them) gets revalidated on its next open
+void FileSystemClient::mark_stale_under(const std::string& prefix) {
+    std::string client_prefix = prefix.empty() ? std::string() :
+        std::string(cache_directory) + (prefix.front() == '/'? "" : "/") + prefix;
+    cache_mutex.lock();
+    for (auto& [location, info] : cache){
+        if (location.compare(0, client_prefix.size(), client_prefix) != 0) continue;
+        info.stale = true;
+        info.tail_from = -1;
+    }
+    for (auto it = cached_attr.begin(); it != cached_attr.end();){
+        if (it->first.compare(0, prefix.size(), prefix) == 0) it = cached_attr.erase(it);
+        else ++it;
+    }
+    note_drop(prefix, true); // listings in flight may be stale too
+    for (const std::string& directory : held_directories()){ // a directory's key has no trailing slash, the prefix may
+        if ((directory + "/").compare(0, prefix.size(), prefix) == 0) forget_directory(directory);
     }
+    cache_mutex.unlock();
 }
 
 #endif
@@ -1,18 +1,86 @@
 #include "filesystem_client.hpp"
 #include "client_subscriber.hpp"
+#include "client_leases.hpp"
+#include "client_directory.hpp"
 #include <iostream>
 #include <sstream> 
 #include <chrono>
 #include <thread>
 #include <filesystem>
 #include <vector> 
+#include <algorithm>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "delta_sync.hpp"
+#include "chunk_codec.hpp"
+
+// The cache file's mtime mirrors the server version it holds, so a copy left behind by an earlier run of
+// the client can still be revalidated with compare() instead of being downloaded again
+static void stamp_cache_file(const std::string& file_location, int64_t timestamp){
+    struct timespec times[2];
+    times[0].tv_sec = timestamp / 1000000000LL;
+    times[0].tv_nsec = timestamp % 1000000000LL;
+    times[1] = times[0];
+    if (utimensat(AT_FDCWD, file_location.c_str(), times, 0) != 0){
+        std::cerr << "Could not stamp the cached file " << file_location << std::endl;
+    }
+}
+
+// records [offset, offset + len) as written, merging it with the ranges it overlaps or touches
+static void add_dirty_extent(std::map<int64_t, int64_t>& extents, int64_t offset, int64_t len){
+    if (len <= 0) return;
+    int64_t end = offset + len;
+    auto it = extents.upper_bound(offset);
+    if (it != extents.begin() && std::prev(it)->second >= offset){
+        --it;
+        offset = it->first;
+        end = std::max(end, it->second);
+        it = extents.erase(it);
+    }
+    while (it != extents.end() && it->first <= end){
+        end = std::max(end, it->second);
+        it = extents.erase(it);
+    }
+    extents[offset] = end;
+}
+
+// bytes past size no longer exist, so whatever was written there does not need uploading
+static void clip_dirty_extents(std::map<int64_t, int64_t>& extents, int64_t size){
+    auto it = extents.lower_bound(size);
+    extents.erase(it, extents.end());
+    if (!extents.empty() && extents.rbegin()->second > size){
+        extents.rbegin()->second = size;
+    }
+}
+
+// marks the blocks of [offset, offset + len) as holding real bytes, growing the bitmap for blocks past its end
+static void mark_blocks_present(std::vector<bool>& present, int64_t block_size, int64_t offset, int64_t len){
+    if (len <= 0) return;
+    int64_t first = offset / block_size;
+    int64_t last = (offset + len + block_size - 1) / block_size;
+    if (static_cast<int64_t>(present.size()) < last) present.resize(static_cast<size_t>(last), true);
+    for (int64_t i = first; i < last; i++) present[static_cast<size_t>(i)] = true;
+}
+
+// the server version a cache file was stamped with, 0 if there is no such file
+static int64_t cache_file_timestamp(const std::string& file_location){
+    struct stat s;
+    if (stat(file_location.c_str(), &s) != 0 || !S_ISREG(s.st_mode)) return 0;
+    #ifdef __APPLE__
+        return static_cast<int64_t>(s.st_mtimespec.tv_sec) * 1000000000LL + s.st_mtimespec.tv_nsec;
+    #else
+        return static_cast<int64_t>(s.st_mtim.tv_sec) * 1000000000LL + s.st_mtim.tv_nsec;
+    #endif
+}
 
 
 
  
-FileSystemClient::FileSystemClient(std::shared_ptr<grpc::Channel> channel, std::string cache_path) : stub_(afs_operation::operators::NewStub(channel)), cache_directory(cache_path){
+FileSystemClient::FileSystemClient(std::shared_ptr<grpc::Channel> channel, std::string cache_path, ClientOptions options) : stub_(afs_operation::operators::NewStub(channel)), cache_directory(cache_path), options(options){
     // Generate a universally unique identifier for client ID
     boost::uuids::random_generator gen;
     boost::uuids::uuid id = gen();
@@ -22,6 +90,9 @@ FileSystemClient::FileSystemClient(std::shared_ptr<grpc::Channel> channel, std::
     afs_operation::InitialiseRequest request;
     request.set_code_to_initialise("I want input/output directory");
     request.set_client_id(client_id);
+    if (options.compression){
+        for (int32_t codec : chunk_codec::supported()) request.add_codecs(codec);
+    }
     afs_operation::InitialiseResponse response;
     grpc::ClientContext context;
     grpc::Status status = stub_ -> request_dir(&context, request, &response);
@@ -32,27 +103,51 @@ FileSystemClient::FileSystemClient(std::shared_ptr<grpc::Channel> channel, std::
     }else{
         // Store the root path instead of just printing it
         this->server_root_path_ = response.root_path(); 
+        codec = response.codec();
+        lease_seconds = response.lease_seconds();
+        std::cout << "Chunk compression: " << chunk_codec::name(codec) << std::endl;
         std::cerr << "Client initialized. Server root directory: " << this->server_root_path_ << std::endl; 
     }
 
-    subscriber_context_ = std::make_unique<grpc::ClientContext>();
-
     // set up the subscribe channel to the server
     // non static member function needs the object to call it on. So we need this
     // also we pass the pointer to the member function to the thread
     subscriber_thread = std::thread(&FileSystemClient::RunSubscriber, this);
+    lease_thread = std::thread(&FileSystemClient::RunLeaseRenewal, this);
 }
 
 
 FileSystemClient::~FileSystemClient(){
-    // stop the thread using subscriber_context
-    if (subscriber_context_){
-        subscriber_context_ -> TryCancel();
+    // cancel the downloads still in flight and wait for their threads
+    cache_mutex.lock();
+    std::map<std::string, std::shared_ptr<Download>> running;
+    running.swap(downloads);
+    cache_mutex.unlock();
+    for (auto& [location, download] : running){
+        {
+            std::lock_guard<std::mutex> lock(download->mu);
+            download->cancelled = true;
+            if (download->context) download->context->TryCancel();
+        }
+        if (download->worker.joinable()) download->worker.join();
     }
+
+    // stop the thread using subscriber_context, and keep it from subscribing again
+    {
+        std::lock_guard<std::mutex> lock(subscriber_mutex_);
+        subscriber_stopping_ = true;
+        if (subscriber_context_){
+            subscriber_context_ -> TryCancel();
+        }
+    }
+    subscriber_cv_.notify_all();
     // join the thread before the object is destroyed
     if (subscriber_thread.joinable()){
         subscriber_thread.join();
     }
+    if (lease_thread.joinable()){
+        lease_thread.join();
+    }
 }
 
 
@@ -71,6 +166,21 @@ std::string FileSystemClient::resolve_server_path(const std::string& user_path)
     return full_path.generic_string(); // Use generic_string for consistent '/' separators
 }
 
+// the attributes the server sent, as this machine's FUSE layer reports them
+static FileAttributes to_attributes(const afs_operation::GetAttrResponse& response) {
+    FileAttributes attrs;
+    attrs.size = response.size();
+    attrs.atime = response.atime();
+    attrs.mtime = response.mtime();
+    attrs.ctime = response.ctime();
+    attrs.mode = response.mode();
+    attrs.nlink = response.nlink();
+    attrs.uid = getuid();
+    attrs.gid = getgid(); // have to change the uid and gid to my local machine's to access them freely
+                          // This approach assumes the client is authentic
+    return attrs;
+}
+
 std::optional<FileAttributes> FileSystemClient::get_attributes(const std::string& filename, const std::string& path) {
     // Note: resolve_server_path is still correct, as it gives the gRPC
     // server the "directory" string it expects (e.g., /path/to/root/test_dir)
@@ -81,13 +191,24 @@ std::optional<FileAttributes> FileSystemClient::get_attributes(const std::string
     request.set_directory(resolved_path); // Pass the server-resolved path 
     
     std::string file_loca_server = resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
+    std::string directory_key = listing_key(resolved_path);
+    uint64_t generation = 0;
     cache_mutex.lock();
     auto it = cached_attr.find(file_loca_server);
     if (it != cached_attr.end()){   // this means file_loca_server exists in the cached_attr already
         cache_mutex.unlock();
         return it -> second;
     }
+    // known to be missing, and the server hasn't said the directory changed since
+    auto missing = negative_entries.find(directory_key);
+    if (missing != negative_entries.end() && missing->second.count(filename)){
+        cache_mutex.unlock();
+        negative_hits++;
+        return std::nullopt;
+    }
+    generation = listing_generation;
     cache_mutex.unlock();
+    if (options.negative_cache_entries > 0) request.set_client_id(client_id);
 
     afs_operation::GetAttrResponse response;
     grpc::ClientContext context;
@@ -101,20 +222,22 @@ std::optional<FileAttributes> FileSystemClient::get_attributes(const std::string
         // as FUSE will check for non-existent files all the time.
         if (status.error_code() != grpc::StatusCode::NOT_FOUND) {
             std::cerr << "GetAttributes RPC failed: " << status.error_message() << std::endl;
+        } else if (options.negative_cache_entries > 0) {
+            // the server holds a callback on the directory now; unless the directory changed while we asked,
+            // the name stays missing until it says otherwise
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            if (!dropped_since(directory_key, generation)){
+                if (negative_count >= options.negative_cache_entries){ // full: start over rather than track ages
+                    negative_entries.clear();
+                    negative_count = 0;
+                }
+                if (negative_entries[directory_key].insert(filename).second) negative_count++;
+            }
         }
         return std::nullopt;
     }
 
-    FileAttributes attrs;
-    attrs.size = response.size();
-    attrs.atime = response.atime();
-    attrs.mtime = response.mtime();
-    attrs.ctime = response.ctime();
-    attrs.mode = response.mode();
-    attrs.nlink = response.nlink();
-    attrs.uid = getuid();
-    attrs.gid = getgid(); // have to change the uid and gid to my local machine's to access them freely
-                          // This approach assumes the client is authentic
+    FileAttributes attrs = to_attributes(response);
     cache_mutex.lock();
     cached_attr[file_loca_server] = attrs;
     cache_mutex.unlock();
@@ -130,7 +253,32 @@ bool FileSystemClient::open_file(std::string filename, std::string path){
     std::string cache_dir = std::string(cache_directory) + (resolved_path.front() == '/' ? "" : "/") +resolved_path; // Use resolved_path
     std::string file_location = cache_dir + (cache_dir.back() == '/' ? "" : "/") + filename;
     
+    // Case 0: we hold a copy but can't vouch for it, either a notification marked it stale or it was left
+    // on disk by an earlier run of the client. Revalidate it with compare() instead of downloading it again
+    cache_mutex.lock();
+    auto known_it = cache.find(file_location);
+    bool known = known_it != cache.end();
+    bool revalidate = known && known_it->second.stale && opened_files.find(file_location) == opened_files.end();
+    int64_t known_timestamp = known ? known_it->second.timestamp : 0;
+    int64_t tail_from = known ? known_it->second.tail_from : -1;
+    if (revalidate && !known_it->second.present_blocks.empty()){
+        // a partly fetched copy can't be revalidated, its missing blocks belong to the old version: start over
+        cache.erase(known_it);
+        revalidate = false;
+        std::error_code ec;
+        std::filesystem::remove(file_location, ec);
+    }
+    cache_mutex.unlock();
+    if (!known){
+        known_timestamp = cache_file_timestamp(file_location);
+        revalidate = known_timestamp != 0;
+    }
+    if (revalidate && !revalidate_cached_file(filename, resolved_path, file_location, known_timestamp, tail_from)){
+        return false;
+    }
+
     // Case 1: File is NOT in the local cache
+    wait_for_download(file_location, -1); // a download left over from a file deleted while it was open
     cache_mutex.lock();
     if (cache.find(file_location) == cache.end()){
         cache_mutex.unlock();
@@ -146,6 +294,10 @@ bool FileSystemClient::open_file(std::string filename, std::string path){
         request.set_filename(filename);
         request.set_directory(resolved_path);
         request.set_client_id(client_id);
+        // the largest message our channel accepts, the server sizes its chunks to fit under it
+        request.set_max_chunk_size(GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH);
+        request.set_lazy_threshold(options.lazy_threshold);
+        request.set_codec(codec);
         
         std::string file_path = file_location; // Use the full file_location path
         
@@ -154,9 +306,10 @@ bool FileSystemClient::open_file(std::string filename, std::string path){
         int num_of_retries = 0;
         grpc::Status status(grpc::StatusCode::UNKNOWN, "Initial state for retry loop");
         
+        bool progressive = false;
         while(num_of_retries < 3 && !status.ok()){
-            grpc::ClientContext context;
-            std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader(stub_->open(&context, request));
+            auto context = std::make_unique<grpc::ClientContext>();
+            std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader(stub_->open(context.get(), request));
 
             std::ofstream outfile(file_path, std::ios::binary);
             if (!outfile.is_open()){
@@ -165,26 +318,78 @@ bool FileSystemClient::open_file(std::string filename, std::string path){
             }
 
             int64_t last_timestamp = 0;
+            int64_t lazy_size = -1; // the server sent no content, only the size: a file above the lazy threshold
+            std::string scratch;
             while(reader->Read(&response_temp)){
                 last_timestamp = response_temp.timestamp();
+                if (response_temp.update_bit() == 3) lazy_size = response_temp.file_size();
+                const std::string* content = chunk_codec::plain_content(response_temp.codec(), response_temp.content(), response_temp.length(), scratch);
+                if (!content){
+                    std::cerr << "Received a chunk that could not be decompressed" << std::endl;
+                    outfile.close();
+                    return false;
+                }
                 if(response_temp.length() > 0)
-                    outfile.write(response_temp.content().data(), response_temp.content().size());
+                    outfile.write(content->data(), content->size());
                 
                 if (outfile.fail()){
                     std::cerr << "Can not write data to the local cache" << std::endl;
                     outfile.close();
                     return false;
                 }
+                // a file that fit in its first chunk has nothing left to stream, a background thread would only see the end
+                if (options.progressive_open && response_temp.length() > 0 && response_temp.file_size() > response_temp.length()){
+                    progressive = true;
+                    break;
+                }
             }
             outfile.close();
+
+            if (progressive) {
+                // the first chunk is in: hand the rest of the stream to a background thread and return right away,
+                // reads wait on its watermark only for bytes that have not arrived yet
+                struct FileInfo file_info{false, last_timestamp, filename};
+                auto download = std::make_shared<Download>();
+                int64_t first_bytes = response_temp.length();
+                download->received = first_bytes;
+                download->context = context.get();
+                cache_mutex.lock();
+                cache[file_location] = file_info;
+                downloads[file_location] = download;
+                download->worker = std::thread(&FileSystemClient::RunDownload, this, download, std::move(context), std::move(reader),
+                                               filename, resolved_path, file_location, last_timestamp);
+                cache_mutex.unlock();
+                std::cout << "File opened progressively, " << first_bytes << " bytes in so far" << std::endl;
+                status = grpc::Status::OK;
+                break;
+            }
             status = reader->Finish();
             
-            if (status.ok()) {
+            if (status.ok() && lazy_size >= 0) {
+                // a sparse file of the right size stands in for the copy, blocks are filled in as they are read.
+                // It is stamped 0 until complete so that a restarted client never mistakes it for a whole version
+                struct FileInfo file_info{false, last_timestamp, filename};
+                file_info.base_size = lazy_size;
+                file_info.present_blocks.assign(static_cast<size_t>((lazy_size + options.block_size - 1) / options.block_size), false);
+                std::error_code ec;
+                std::filesystem::resize_file(file_path, static_cast<uintmax_t>(lazy_size), ec);
+                if (ec) {
+                    std::cerr << "Failed to size the lazy copy at " << file_path << std::endl;
+                    return false;
+                }
+                cache_mutex.lock();
+                cache[file_location] = file_info;
+                cache_mutex.unlock();
+                stamp_cache_file(file_location, 0);
+                std::cout << "File opened lazily: " << lazy_size << " bytes, fetched in blocks of " << options.block_size << std::endl;
+            } else if (status.ok()) {
                 // Only add to cache on success
                 struct FileInfo file_info{false, last_timestamp, filename};
+                try { file_info.base_size = static_cast<int64_t>(std::filesystem::file_size(file_location)); } catch (...) {}
                 cache_mutex.lock();
                 cache[file_location] = file_info;
                 cache_mutex.unlock();
+                stamp_cache_file(file_location, last_timestamp);
                 std::cout << "File cached successfully" << std::endl;
             }
             // update cached_attr
@@ -239,7 +444,7 @@ bool FileSystemClient::open_file(std::string filename, std::string path){
         }
         cache_mutex.unlock();
         // File is in cache but not open - just open the streams
-        // No need to compare with server since subscriber invalidates cache when needed
+        // No need to compare with server: the subscriber marks the entry stale when needed and Case 0 revalidated it
         std::cout << "File: " << file_location << " found in cache, opening..." << std::endl;
 
         auto read_stream = std::make_unique<std::ifstream>(file_location, std::ios::binary);
@@ -260,122 +465,357 @@ bool FileSystemClient::open_file(std::string filename, std::string path){
         return true;
 
     }
-    
-    /*else { 
-        cache_mutex.unlock();
-        // Case 2: File IS in the local cache, check for updates
-        
-        // Check if file is already open by this client
-        cache_mutex.lock();
-        if (opened_files.find(file_location)!=opened_files.end()){
-            std::cerr<< "The file: " << file_location << "is already open, but it is okay if you try multiple times" << std::endl;
-            cache_mutex.unlock();
-            return true;
+}
+
+bool FileSystemClient::revalidate_cached_file(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t timestamp, int64_t tail_from){
+    if (tail_from >= 0){
+        // a copy shorter than the announced prefix can't be topped up, ask for a whole new version instead.
+        // So does an empty prefix: offset 0 is no offset on the wire, the server would take us for up to date
+        std::error_code ec;
+        auto local_size = std::filesystem::file_size(file_location, ec);
+        if (ec || tail_from == 0 || static_cast<int64_t>(local_size) < tail_from){
+            tail_from = -1;
+            timestamp = 0;
         }
-        int64_t timestamp = cache[file_location].timestamp;
-        cache_mutex.unlock();
-        afs_operation::FileRequest request;
-        request.set_filename(filename);
-        request.set_timestamp(timestamp);
-        request.set_directory(resolved_path); 
-        request.set_client_id(client_id);
+    }
+    afs_operation::FileRequest request;
+    request.set_filename(filename);
+    request.set_timestamp(timestamp);
+    request.set_directory(resolved_path);
+    request.set_client_id(client_id);
+    request.set_max_chunk_size(GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH);
+    if (tail_from >= 0) request.set_offset(tail_from); // we hold version `timestamp` up to here
+    request.set_codec(codec);
+
+    int num_of_retries = 0;
+    grpc::Status status(grpc::StatusCode::UNKNOWN, "Initial state for retry loop");
+    bool updated = false;
+    int64_t new_timestamp = 0;
+
+    while(num_of_retries < 3 && !status.ok() && status.error_code() != grpc::StatusCode::NOT_FOUND){
+        grpc::ClientContext context;
+        afs_operation::FileResponse response_chunk;
+        std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader(stub_->compare(&context, request));
+
+        // the local copy is only touched once the server says it changed
+        std::ofstream outfile;
+        std::string scratch;
+        updated = false;
+        new_timestamp = 0;
+        while(reader->Read(&response_chunk)){
+            new_timestamp = response_chunk.timestamp();
+            if (response_chunk.update_bit() == 0) continue;
+            if (!updated){
+                if (response_chunk.update_bit() == 2){
+                    // only the tail is coming: keep our prefix and write it after, anything past the prefix is dropped first
+                    std::error_code ec;
+                    std::filesystem::resize_file(file_location, static_cast<uintmax_t>(tail_from), ec);
+                    if (ec){
+                        // the tail would land wherever the copy ends: ask for the whole file on the next try instead
+                        std::cerr << "Could not cut " << file_location << " back to its prefix, fetching the whole file" << std::endl;
+                        tail_from = -1;
+                        request.clear_offset();
+                        request.set_timestamp(0);
+                        context.TryCancel();
+                        break;
+                    }
+                    outfile.open(file_location, std::ios::binary | std::ios::in | std::ios::out);
+                    if (outfile.is_open()) outfile.seekp(tail_from);
+                    std::cout << "Fetching the tail of " << file_location << " from byte " << tail_from << std::endl;
+                }else{
+                    outfile.open(file_location, std::ios::binary | std::ios::trunc);
+                }
+                if (!outfile.is_open() || outfile.fail()){
+                    std::cerr << "Error: Could not open the file at " << file_location << " to overwrite." << std::endl;
+                    context.TryCancel();
+                    break;
+                }
+                updated = true;
+            }
+            const std::string* content = chunk_codec::plain_content(response_chunk.codec(), response_chunk.content(), response_chunk.length(), scratch);
+            if (!content){
+                outfile.setstate(std::ios::failbit);
+                context.TryCancel();
+                break;
+            }
+            outfile.write(content->data(), content->size());
+        }
+        if (outfile.is_open()) outfile.close();
+        status = reader->Finish();
+        if (status.ok() && (new_timestamp == 0 || outfile.fail())){
+            status = grpc::Status(grpc::StatusCode::DATA_LOSS, "Incomplete compare response");
+        }
+        num_of_retries++;
+    }
 
-        int num_of_retries = 0;
-        grpc::Status status(grpc::StatusCode::UNKNOWN, "Initial state for retry loop");
-        
-        std::stringstream content_buffer(std::ios::binary | std::ios::in | std::ios::out);
-        int update_bit = 0;
-        int64_t new_timestamp = 0;
-        
-        while(num_of_retries < 3 && !status.ok()){
-            grpc::ClientContext context;
-            afs_operation::FileResponse response_chunk;
+    if (!status.ok()){
+        std::cerr << "RPC failed during compare: " << status.error_message() << std::endl;
+        // a half written or vanished copy must not be trusted by the next open
+        cache_mutex.lock();
+        cache.erase(file_location);
+        cached_attr.erase(resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename);
+        cache_mutex.unlock();
+        std::error_code ec;
+        std::filesystem::remove(file_location, ec);
+        return false;
+    }
 
-            content_buffer.str(""); // Clear the stringstream's content
-            content_buffer.clear(); // Clear its error flags
-            update_bit = 0;
-            new_timestamp = 0;
-            
-            std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader(stub_->compare(&context, request));
+    stamp_cache_file(file_location, new_timestamp);
+    cache_mutex.lock();
+    cache[file_location] = FileInfo{false, new_timestamp, filename};
+    try { cache[file_location].base_size = static_cast<int64_t>(std::filesystem::file_size(file_location)); } catch (...) {}
+    if (updated){
+        std::string server_key = resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
+        auto attr_it = cached_attr.find(server_key);
+        if (attr_it != cached_attr.end()) {
+            attr_it->second.mtime = new_timestamp;
+            attr_it->second.atime = new_timestamp;
+            attr_it->second.ctime = new_timestamp;
+            try {
+                attr_it->second.size = std::filesystem::file_size(file_location);
+            } catch (...) {}
+        }
+    }
+    cache_mutex.unlock();
+    std::cout << "File: " << file_location << (updated ? " was stale and has been updated." : " is still valid.") << std::endl;
+    return true;
+}
 
-            while(reader->Read(&response_chunk)){
-                update_bit = response_chunk.update_bit();
-                new_timestamp = response_chunk.timestamp();
-                
-                if(update_bit == 1) { 
-                    content_buffer.write(response_chunk.content().data(), response_chunk.content().size());
+void FileSystemClient::RunDownload(std::shared_ptr<Download> download, std::unique_ptr<grpc::ClientContext> context,
+                                   std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader,
+                                   std::string filename, std::string resolved_path, std::string file_location, int64_t timestamp){
+    int fd = ::open(file_location.c_str(), O_WRONLY);
+    int64_t received = 0;
+    {
+        std::lock_guard<std::mutex> lock(download->mu);
+        received = download->received;
+    }
+    grpc::Status status;
+    int num_of_retries = 0;
+    while (true){
+        afs_operation::FileResponse chunk;
+        std::string scratch;
+        bool written = fd >= 0;
+        while (written && reader->Read(&chunk)){
+            const std::string* content = chunk_codec::plain_content(chunk.codec(), chunk.content(), chunk.length(), scratch);
+            if (chunk.update_bit() == 1 || !content){ // a resumed stream found a different version, the bytes we served are gone
+                written = false;
+                break;
+            }
+            const char* data = content->data();
+            size_t len = content->size();
+            while (len > 0){
+                ssize_t n = pwrite(fd, data, len, received);
+                if (n <= 0){
+                    written = false;
+                    break;
                 }
+                data += n;
+                len -= static_cast<size_t>(n);
+                received += n;
             }
-            
-            status = reader->Finish();
-            num_of_retries++;
+            {
+                std::lock_guard<std::mutex> lock(download->mu);
+                download->received = received;
+            }
+            download->cv.notify_all();
         }
+        if (!written) context->TryCancel();
+        status = reader->Finish();
+        if (status.ok() && !written){
+            status = grpc::Status(grpc::StatusCode::DATA_LOSS, "Could not write the download to the local cache");
+        }
+        if (status.ok() || !written || num_of_retries >= 2 || status.error_code() == grpc::StatusCode::NOT_FOUND) break;
 
-        if (!status.ok()) {
-            std::cerr << "RPC failed during compare after 3 attempts: " << status.error_message() << std::endl;
-            return false; 
+        // resume where the stream broke off: a conditional open of the same version from `received` sends only the rest
+        num_of_retries++;
+        std::cerr << "Download of " << filename << " broke off at " << received << ", resuming: " << status.error_message() << std::endl;
+        afs_operation::FileRequest request;
+        request.set_filename(filename);
+        request.set_directory(resolved_path);
+        request.set_client_id(client_id);
+        request.set_timestamp(timestamp);
+        request.set_offset(received);
+        request.set_max_chunk_size(GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH);
+        request.set_codec(codec);
+        {
+            std::lock_guard<std::mutex> lock(download->mu);
+            if (download->cancelled) break;
+            auto next_context = std::make_unique<grpc::ClientContext>();
+            download->context = next_context.get();
+            reader = stub_->compare(next_context.get(), request);
+            context = std::move(next_context);
         }
+    }
+    if (fd >= 0) ::close(fd);
 
-        if (new_timestamp != 0) {
-            cache_mutex.lock();
-            cache[file_location].timestamp = new_timestamp;
-            cache[file_location].locally_modified = false;
-            cache_mutex.unlock();
+    if (status.ok()){
+        stamp_cache_file(file_location, timestamp);
+        std::string server_key = resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
+        cache_mutex.lock();
+        auto it = cache.find(file_location);
+        if (it != cache.end()) it->second.base_size = received;
+        auto attr_it = cached_attr.find(server_key);
+        if (attr_it != cached_attr.end()){
+            attr_it->second.mtime = timestamp;
+            attr_it->second.atime = timestamp;
+            attr_it->second.ctime = timestamp;
+            attr_it->second.size = received;
         }
+        cache_mutex.unlock();
+        std::cout << "Download of " << filename << " finished: " << received << " bytes" << std::endl;
+    }else{
+        std::cerr << "Download of " << filename << " failed: " << status.error_message() << std::endl;
+    }
+    {
+        std::lock_guard<std::mutex> lock(download->mu);
+        download->done = true;
+        download->failed = !status.ok();
+        download->context = nullptr;
+    }
+    download->cv.notify_all();
+}
 
-        if (update_bit == 1) {
-            std::cout << "Cache is stale. Overwriting local file..." << std::endl;
-            std::ofstream outfile(file_location, std::ios::binary | std::ios::trunc);
-            
-            if (!outfile.is_open()) {
-                std::cerr << "Error: Could not open the file at " << file_location << " to overwrite." << std::endl;
+bool FileSystemClient::wait_for_download(const std::string& file_location, int64_t upto){
+    cache_mutex.lock();
+    auto it = downloads.find(file_location);
+    if (it == downloads.end()){
+        cache_mutex.unlock();
+        return true;
+    }
+    std::shared_ptr<Download> download = it->second;
+    cache_mutex.unlock();
+
+    bool ok;
+    {
+        std::unique_lock<std::mutex> lock(download->mu);
+        download->cv.wait(lock, [&]{ return download->done || (upto >= 0 && download->received >= upto); });
+        ok = !download->failed || (upto >= 0 && download->received >= upto);
+        if (!download->done) return ok;
+    }
+    // the download is over: whoever takes it out of the table joins its thread
+    cache_mutex.lock();
+    auto fresh_it = downloads.find(file_location);
+    bool owner = fresh_it != downloads.end() && fresh_it->second == download;
+    if (owner) downloads.erase(fresh_it);
+    cache_mutex.unlock();
+    if (owner && download->worker.joinable()) download->worker.join();
+    return ok;
+}
+
+bool FileSystemClient::fetch_blocks(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t offset, int64_t length){
+    const int64_t block_size = options.block_size;
+    cache_mutex.lock();
+    auto it = cache.find(file_location);
+    if (it == cache.end() || it->second.present_blocks.empty() || length <= 0){
+        cache_mutex.unlock();
+        return true;
+    }
+    std::vector<bool> present = it->second.present_blocks;
+    int64_t version = it->second.timestamp;
+    int64_t remote_size = it->second.base_size;
+    cache_mutex.unlock();
+
+    int64_t first = std::max<int64_t>(0, offset / block_size);
+    int64_t last = std::min<int64_t>(static_cast<int64_t>(present.size()), (offset + length + block_size - 1) / block_size);
+    int fd = -1;
+    for (int64_t i = first; i < last; ){
+        if (present[static_cast<size_t>(i)]){
+            i++;
+            continue;
+        }
+        // consecutive missing blocks go out as one range
+        int64_t run_start = i;
+        while (i < last && !present[static_cast<size_t>(i)]) i++;
+        int64_t start = run_start * block_size;
+        int64_t end = std::min(i * block_size, remote_size);
+
+        if (start < end){
+            if (fd < 0) fd = ::open(file_location.c_str(), O_WRONLY);
+            if (fd < 0){
+                std::cerr << "Error: Could not open " << file_location << " to fill in blocks." << std::endl;
                 return false;
             }
-            outfile << content_buffer.rdbuf(); 
-            if (outfile.fail()) {
-                std::cerr << "Error: Failed to write new content to local file." << std::endl;
-                outfile.close();
-                return false;
+            afs_operation::FileRequest request;
+            request.set_filename(filename);
+            request.set_directory(resolved_path);
+            request.set_client_id(client_id);
+            request.set_timestamp(version);
+            request.set_offset(start);
+            request.set_length(end - start);
+            request.set_max_chunk_size(GRPC_DEFAULT_MAX_RECV_MESSAGE_LENGTH);
+            request.set_codec(codec);
+
+            int num_of_retries = 0;
+            grpc::Status status(grpc::StatusCode::UNKNOWN, "Initial state for retry loop");
+            int64_t cursor = start;
+            while (num_of_retries < 3 && !status.ok() && status.error_code() != grpc::StatusCode::FAILED_PRECONDITION &&
+                   status.error_code() != grpc::StatusCode::NOT_FOUND){
+                grpc::ClientContext context;
+                std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader(stub_->read_range(&context, request));
+                afs_operation::FileResponse chunk;
+                std::string scratch;
+                bool written = true;
+                cursor = start;
+                while (reader->Read(&chunk)){
+                    const std::string* content = chunk_codec::plain_content(chunk.codec(), chunk.content(), chunk.length(), scratch);
+                    if (!content) written = false;
+                    const char* data = written ? content->data() : nullptr;
+                    size_t len = written ? content->size() : 0;
+                    while (written && len > 0){
+                        ssize_t n = pwrite(fd, data, len, cursor);
+                        if (n <= 0){
+                            written = false;
+                            context.TryCancel();
+                            break;
+                        }
+                        data += n;
+                        len -= static_cast<size_t>(n);
+                        cursor += n;
+                    }
+                }
+                status = reader->Finish();
+                if (status.ok() && (!written || cursor != end)){
+                    status = grpc::Status(grpc::StatusCode::DATA_LOSS, "Incomplete range");
+                }
+                num_of_retries++;
             }
-            outfile.close();
-            std::string server_key = resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
-            cache_mutex.lock();
-            auto attr_it = cached_attr.find(server_key);
-            if (attr_it != cached_attr.end()) {
-                // Update timestamp to what the server just sent us
-                attr_it->second.mtime = new_timestamp; 
-                attr_it->second.atime = new_timestamp;
-                attr_it->second.ctime = new_timestamp;
-                // Update size from the actual file on disk
-                try {
-                    attr_it->second.size = std::filesystem::file_size(file_location);
-                } catch (...) {}
-                std::cout << "Synced cached_attr after update." << std::endl;
+            if (!status.ok()){
+                if (status.error_code() == grpc::StatusCode::FAILED_PRECONDITION){
+                    std::cerr << filename << " changed on the server since it was opened, reopen it to read the new version." << std::endl;
+                }else{
+                    std::cerr << "RPC failed during read_range: " << status.error_message() << std::endl;
+                }
+                ::close(fd);
+                return false;
             }
-            cache_mutex.unlock();
-            std::cout << "Successfully overwrote file: " << file_location << std::endl;
-        
-        } else {
-            std::cout << "File: "<< file_location << " is valid and is now opened." << std::endl;
+            std::cout << "Fetched bytes [" << start << ", " << end << ") of " << filename << std::endl;
         }
-        
-        auto read_stream = std::make_unique<std::ifstream>(file_location, std::ios::binary);
-        auto write_stream = std::make_unique<std::ofstream>(file_location, std::ios::binary | std::ios::in);
 
-        if (!read_stream || !read_stream->is_open() || !write_stream || !write_stream->is_open()) {
-            std::cerr << "Failed to open the local file stream." << std::endl;
-            return false;
-        }
         cache_mutex.lock();
-        opened_files[file_location] = FileStreams{std::move(read_stream), std::move(write_stream)};
-        // Create per-file mutex if not present
-        if (file_mutexes.find(file_location) == file_mutexes.end()) {
-            file_mutexes[file_location];
+        auto fresh_it = cache.find(file_location);
+        if (fresh_it != cache.end()){
+            std::vector<bool>& live = fresh_it->second.present_blocks;
+            for (int64_t b = run_start; b < i && b < static_cast<int64_t>(live.size()); b++) live[static_cast<size_t>(b)] = true;
         }
         cache_mutex.unlock();
-        std::cout << "File '" << filename << "' is now open for use." << std::endl;
-        return true;
-    }*/
+    }
+    if (fd < 0) return true; // nothing had to be fetched
+    ::close(fd);
+
+    // once every block is in, the copy is an ordinary cached version again
+    cache_mutex.lock();
+    auto fresh_it = cache.find(file_location);
+    bool complete = false, modified = false;
+    if (fresh_it != cache.end()){
+        std::vector<bool>& live = fresh_it->second.present_blocks;
+        complete = !live.empty() && std::find(live.begin(), live.end(), false) == live.end();
+        if (complete) live.clear();
+        modified = fresh_it->second.locally_modified;
+    }
+    cache_mutex.unlock();
+    stamp_cache_file(file_location, complete && !modified ? version : 0);
+    return true;
 }
 
 bool FileSystemClient::read_file(const std::string& filename, const std::string& directory, const int size, const int offset, std::vector<char>& buffer){
@@ -404,7 +844,15 @@ bool FileSystemClient::read_file(const std::string& filename, const std::string&
             }
             std::shared_ptr<std::mutex> file_mtx = m_it->second;
             cache_mutex.unlock();
+            if (!wait_for_download(file_location, static_cast<int64_t>(offset) + size)) {
+                std::cerr << "Error: The download of " << filename << " failed before reaching offset " << offset << "." << std::endl;
+                return false;
+            }
             std::lock_guard<std::mutex> file_lock(*file_mtx);
+            if (!fetch_blocks(filename, resolved_path, file_location, offset, size)) {
+                std::cerr << "Error: Could not fetch the blocks to read from the server." << std::endl;
+                return false;
+            }
             std::ifstream& file_stream = *(it->second.read_stream);
             // read the file from the cache
             file_stream.seekg(offset, std::ios::beg);
@@ -460,7 +908,20 @@ bool FileSystemClient::write_file(const std::string& filename, const std::string
             }
             std::shared_ptr<std::mutex> file_mtx = m_it->second;
             cache_mutex.unlock();
+            // the download would overwrite whatever we write, so writes wait until it is over
+            if (!wait_for_download(file_location, -1)) {
+                std::cerr << "Error: The download of " << filename << " failed, reopen the file." << std::endl;
+                return false;
+            }
             std::lock_guard<std::mutex> file_lock(*file_mtx);
+            // in a lazily opened file the blocks the write only partly covers need their other bytes first
+            int64_t write_start = static_cast<int64_t>(position);
+            int64_t write_end = write_start + static_cast<int64_t>(data.size());
+            if ((write_start % options.block_size != 0 && !fetch_blocks(filename, resolved_path, file_location, write_start, 1)) ||
+                (write_end % options.block_size != 0 && !fetch_blocks(filename, resolved_path, file_location, write_end - 1, 1))) {
+                std::cerr << "Error: Could not fetch the blocks around the write from the server." << std::endl;
+                return false;
+            }
             std::ofstream& file_stream = *(it->second.write_stream);
             file_stream.seekp(position);
             if (file_stream.fail()){
@@ -477,9 +938,13 @@ bool FileSystemClient::write_file(const std::string& filename, const std::string
                 return false;
             }
             
-            // 1. Mark the file content as changed for eventual upload
+            // 1. Mark the file content as changed for eventual upload, and exactly which bytes changed
             cache_mutex.lock();
             cache[file_location].locally_modified = true;
+            add_dirty_extent(cache[file_location].dirty_extents, static_cast<int64_t>(position), static_cast<int64_t>(data.size()));
+            if (!cache[file_location].present_blocks.empty()) {
+                mark_blocks_present(cache[file_location].present_blocks, options.block_size, write_start, write_end - write_start);
+            }
             cache_mutex.unlock();
 
             // Update the cached_attr to reflect changes immediately
@@ -607,6 +1072,18 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
     std::string resolved_path = resolve_server_path(directory);
     std::string file_location = std::string(cache_directory) + (resolved_path.front() == '/' ? "" : "/") + resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
 
+    // a copy whose download broke off can't be kept, the next open fetches the file again
+    if (!wait_for_download(file_location, -1)) {
+        std::cerr << "Error: The download of " << filename << " failed, dropping the partial copy." << std::endl;
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache.erase(file_location);
+        opened_files.erase(file_location);
+        file_mutexes.erase(file_location);
+        std::error_code ec;
+        std::filesystem::remove(file_location, ec);
+        return false;
+    }
+
     // 1. Lock Global State
     std::unique_lock<std::mutex> global_lock(cache_mutex);
 
@@ -634,6 +1111,10 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
 
 
     bool needs_flush = cache_it->second.locally_modified;
+    int64_t base_timestamp = cache_it->second.timestamp; // the server version our edits started from
+    std::map<int64_t, int64_t> dirty_extents = cache_it->second.dirty_extents;
+    int64_t truncated_to = cache_it->second.truncated_to;
+    int64_t base_size = cache_it->second.base_size;
     std::ofstream* write_stream_ptr = opened_file_it->second.write_stream.get();
     std::ifstream* read_stream_ptr = opened_file_it->second.read_stream.get();
 
@@ -666,14 +1147,41 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
             return false; 
         }
 
-        const std::size_t chunk_size = 4096;
-        char buffer[chunk_size];
+        // large enough for compression to find repeats within a chunk
+        const std::size_t chunk_size = 64 * 1024;
+        std::vector<char> buffer(chunk_size);
+        std::vector<char> packed;
 
         afs_operation::FileResponse response; 
         int num_of_tries = 0;
         grpc::Status status(grpc::StatusCode::UNKNOWN, "Initial state for retry loop");
+
+        // the server still has the version we started from: send only what changed. Small edits ship as the exact
+        // ranges we wrote; when most of the file was rewritten (editors save by truncating and writing everything)
+        // a delta against the server's blocks finds what really differs
+        int64_t dirty_bytes = 0;
+        for (const auto& [start, end] : dirty_extents) dirty_bytes += end - start;
+        int64_t local_size = 0;
+        try { local_size = static_cast<int64_t>(std::filesystem::file_size(file_location)); } catch (...) {}
+        bool know_ranges = (!dirty_extents.empty() || truncated_to >= 0) && dirty_bytes * 2 <= local_size;
+        // a log that was only written past its old end needs nothing but the new tail
+        bool only_appended = !dirty_extents.empty() && dirty_extents.begin()->first >= base_size &&
+                             (truncated_to < 0 || truncated_to >= base_size) && local_size > base_size;
+        if (base_timestamp != 0 && only_appended &&
+            upload_append(filename, resolved_path, file_location, base_timestamp, base_size, response)) {
+            status = grpc::Status::OK;
+        } else if (base_timestamp != 0 && know_ranges &&
+            upload_ranges(filename, resolved_path, file_location, base_timestamp, dirty_extents, truncated_to, response)) {
+            status = grpc::Status::OK;
+        } else if (!fetch_blocks(filename, resolved_path, file_location, 0, local_size)) {
+            // a delta or a full upload reads the whole file, so a lazy copy has to be completed first
+            std::cerr << "Error: Could not fetch the rest of " << filename << " before uploading it." << std::endl;
+            return false;
+        } else if (base_timestamp != 0 && upload_delta(filename, resolved_path, file_location, base_timestamp, response)) {
+            status = grpc::Status::OK;
+        }
         
-        // RPC Loop
+        // RPC Loop (full upload, skipped when the delta went through)
         while (num_of_tries < 3 && !status.ok()){
             grpc::ClientContext context;     
             std::unique_ptr<grpc::ClientWriter<afs_operation::FileRequest>> writer(
@@ -684,9 +1192,10 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
             file_stream.clear(); // Clear EOF flag
             file_stream.seekg(0, std::ios::beg); // Rewind to start
 
+            chunk_codec::Sampler sampler(codec);
             bool sent_at_least_once = false;
             while(true){
-                file_stream.read(buffer, chunk_size);
+                file_stream.read(buffer.data(), chunk_size);
                 std::streamsize len = file_stream.gcount();
 
                 // Always send at least one request, even if file is empty
@@ -695,8 +1204,20 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
                 afs_operation::FileRequest request;
                 request.set_directory(resolved_path);
                 request.set_filename(filename);
-                request.set_content(buffer, len);
                 request.set_client_id(client_id);
+                int32_t chunk_codec_used = sampler.active();
+                size_t packed_len = 0;
+                if (chunk_codec_used != chunk_codec::NONE && len > 0){
+                    packed.resize(chunk_codec::bound(chunk_codec_used, static_cast<size_t>(len)));
+                    packed_len = sampler.compress(buffer.data(), static_cast<size_t>(len), packed.data(), packed.size());
+                }
+                if (packed_len > 0){
+                    request.set_content(packed.data(), packed_len);
+                    request.set_codec(chunk_codec_used);
+                    request.set_raw_length(static_cast<int32_t>(len));
+                }else{
+                    request.set_content(buffer.data(), len);
+                }
 
                 if (!writer->Write(request)){
                     break;
@@ -720,7 +1241,6 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
             std::cerr << "RPC failed while flushing file to server: " << status.error_message() << std::endl;
             return false; 
         }
-
         // 4. Update Metadata (MUST Re-Lock Global)
         global_lock.lock();
 
@@ -728,8 +1248,17 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
         // The old 'cache_it' is invalid because we unlocked the mutex earlier.
         auto fresh_cache_it = cache.find(file_location);
         if (fresh_cache_it != cache.end()) {
+            // a file we created is a new entry of its directory now, the server only tells the other clients
+            if (fresh_cache_it->second.timestamp == 0) forget_directory(resolved_path);
             fresh_cache_it->second.timestamp = response.timestamp();
             fresh_cache_it->second.locally_modified = false;
+            fresh_cache_it->second.stale = false; // we just wrote the newest version ourselves
+            fresh_cache_it->second.dirty_extents.clear();
+            fresh_cache_it->second.truncated_to = -1;
+            fresh_cache_it->second.tail_from = -1;
+            try { fresh_cache_it->second.base_size = static_cast<int64_t>(std::filesystem::file_size(file_location)); } catch (...) {}
+            // a lazy copy that is still missing blocks keeps its 0 stamp, it is not a whole version
+            stamp_cache_file(file_location, fresh_cache_it->second.present_blocks.empty() ? response.timestamp() : 0);
         }
         
         std::string file_loca_server = resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
@@ -763,7 +1292,230 @@ bool FileSystemClient::close_file(const std::string& filename, const std::string
 }
 
 
+bool FileSystemClient::upload_ranges(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t base_timestamp,
+                                     const std::map<int64_t, int64_t>& extents, int64_t truncated_to, afs_operation::FileResponse& response){
+    int fd = ::open(file_location.c_str(), O_RDONLY);
+    struct stat s;
+    if (fd < 0 || fstat(fd, &s) != 0) {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    int64_t file_size = s.st_size;
+
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientWriter<afs_operation::RangeUpdate>> writer(stub_->update_ranges(&context, &response));
+    afs_operation::RangeUpdate message;
+    message.set_filename(filename);
+    message.set_directory(resolved_path);
+    message.set_client_id(client_id);
+    message.set_base_timestamp(base_timestamp);
+    message.set_truncated(truncated_to >= 0);
+    message.set_truncate_to(truncated_to);
+    message.set_file_size(file_size);
+    int64_t patch_bytes = 0;
+    for (const auto& [start, end] : extents) {
+        patch_bytes += std::max<int64_t>(0, std::min(end, file_size) - start);
+    }
+    message.set_patch_bytes(patch_bytes);
+
+    const int64_t max_message = 1024 * 1024;
+    int64_t pending = 0, sent_bytes = 0;
+    bool ok = true, header_sent = false;
+    auto send = [&]() {
+        if (ok && !writer->Write(message)) ok = false;
+        message.Clear();
+        pending = 0;
+        header_sent = true;
+    };
+    for (const auto& [start, end] : extents) {
+        // the extents describe the file as it is now, so its current bytes are the ones to ship
+        for (int64_t offset = start; ok && offset < std::min(end, file_size); ) {
+            int64_t len = std::min(std::min(end, file_size) - offset, max_message - pending);
+            afs_operation::Extent* extent = message.add_extents();
+            extent->set_offset(offset);
+            std::string* data = extent->mutable_data();
+            data->resize(static_cast<size_t>(len));
+            if (pread(fd, data->data(), static_cast<size_t>(len), offset) != len) ok = false;
+            offset += len;
+            pending += len;
+            sent_bytes += len;
+            if (pending >= max_message) send();
+        }
+    }
+    ::close(fd);
+    if (ok && (pending > 0 || !header_sent)) send();
+    writer->WritesDone();
+    grpc::Status status = writer->Finish();
+
+    if (!ok || !status.ok()) {
+        std::cout << "Ranged close rejected (" << status.error_message() << "), trying the next upload method" << std::endl;
+        return false;
+    }
+    std::cout << "Ranged close of " << filename << " sent " << sent_bytes << " of " << file_size << " bytes in "
+              << extents.size() << " extents" << std::endl;
+    return true;
+}
+
+bool FileSystemClient::upload_append(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t base_timestamp,
+                                     int64_t base_size, afs_operation::FileResponse& response){
+    int fd = ::open(file_location.c_str(), O_RDONLY);
+    struct stat s;
+    if (fd < 0 || fstat(fd, &s) != 0) {
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    int64_t file_size = s.st_size;
+
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientWriter<afs_operation::FileRequest>> writer(stub_->append(&context, &response));
+    const int64_t max_message = 1024 * 1024;
+    bool ok = true;
+    for (int64_t offset = base_size; ok && offset < file_size; ) {
+        int64_t len = std::min(file_size - offset, max_message);
+        afs_operation::FileRequest message;
+        if (offset == base_size) { // the first message names the file and the version the tail goes on top of
+            message.set_filename(filename);
+            message.set_directory(resolved_path);
+            message.set_client_id(client_id);
+            message.set_timestamp(base_timestamp);
+            message.set_offset(base_size);
+            message.set_file_size(file_size);
+        }
+        std::string* data = message.mutable_content();
+        data->resize(static_cast<size_t>(len));
+        if (pread(fd, data->data(), static_cast<size_t>(len), offset) != len) ok = false;
+        if (ok && !writer->Write(message)) ok = false;
+        offset += len;
+    }
+    ::close(fd);
+    writer->WritesDone();
+    grpc::Status status = writer->Finish();
+
+    if (!ok || !status.ok()) {
+        std::cout << "Append rejected (" << status.error_message() << "), trying the next upload method" << std::endl;
+        return false;
+    }
+    std::cout << "Append close of " << filename << " sent " << (file_size - base_size) << " of " << file_size << " bytes" << std::endl;
+    return true;
+}
+
+bool FileSystemClient::upload_delta(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t base_timestamp, afs_operation::FileResponse& response){
+    int fd = ::open(file_location.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size < delta_sync::kMinDeltaFile) {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(s.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    const char* data = static_cast<const char*>(mapped);
+
+    // 1. what the server holds
+    afs_operation::SignatureRequest sig_request;
+    sig_request.set_filename(filename);
+    sig_request.set_directory(resolved_path);
+    std::vector<delta_sync::BlockSignature> blocks;
+    int64_t server_timestamp = 0, block_size = 0, base_size = 0;
+    grpc::Status status;
+    {
+        grpc::ClientContext context;
+        std::unique_ptr<grpc::ClientReader<afs_operation::SignatureResponse>> reader(stub_->signatures(&context, sig_request));
+        afs_operation::SignatureResponse sig_response;
+        while (reader->Read(&sig_response)) {
+            if (sig_response.block_size() > 0) { // header
+                server_timestamp = sig_response.timestamp();
+                block_size = sig_response.block_size();
+                base_size = sig_response.file_size();
+            }
+            for (const afs_operation::BlockSignature& block : sig_response.blocks()) {
+                blocks.push_back(delta_sync::BlockSignature{block.weak(), block.strong()});
+            }
+        }
+        status = reader->Finish();
+    }
+    int64_t expected_blocks = block_size > 0 ? (base_size + block_size - 1) / block_size : -1;
+    if (!status.ok() || server_timestamp != base_timestamp || static_cast<int64_t>(blocks.size()) != expected_blocks) {
+        std::cout << "Delta close not possible for " << filename << ", sending the whole file" << std::endl;
+        munmap(mapped, size);
+        return false;
+    }
+
+    // 2. the delta against it
+    delta_sync::Sha256 sha;
+    sha.update(data, size);
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientWriter<afs_operation::DeltaRequest>> writer(stub_->close_delta(&context, &response));
+    afs_operation::DeltaRequest message;
+    message.set_filename(filename);
+    message.set_directory(resolved_path);
+    message.set_client_id(client_id);
+    message.set_base_timestamp(base_timestamp);
+    message.set_block_size(static_cast<int32_t>(block_size));
+    message.set_file_size(static_cast<int64_t>(size));
+    message.set_sha256(sha.final());
+
+    size_t pending = 0, literal_bytes = 0;
+    bool stream_ok = true, header_sent = false;
+    auto send = [&]() {
+        if (stream_ok && !writer->Write(message)) stream_ok = false;
+        message.Clear();
+        pending = 0;
+        header_sent = true;
+    };
+    delta_sync::compute_delta(data, size, blocks, static_cast<size_t>(block_size), base_size,
+        [&](const char* bytes, size_t len) {
+            message.add_ops()->set_literal(bytes, len);
+            pending += len;
+            literal_bytes += len;
+            if (pending >= delta_sync::kMaxLiteral) send();
+        },
+        [&](int64_t first_block, int64_t block_count) {
+            afs_operation::DeltaOp* op = message.add_ops();
+            op->set_block_index(first_block);
+            op->set_block_count(block_count);
+            pending += 16;
+            if (pending >= delta_sync::kMaxLiteral) send();
+        });
+    if (pending > 0 || !header_sent) send();
+    writer->WritesDone();
+    status = writer->Finish();
+    munmap(mapped, size);
+
+    if (!status.ok()) {
+        std::cout << "Delta close rejected (" << status.error_message() << "), sending the whole file" << std::endl;
+        return false;
+    }
+    std::cout << "Delta close of " << filename << " sent " << literal_bytes << " of " << size << " bytes" << std::endl;
+    return true;
+}
+
+
 std::optional<std::map<std::string, std::string>> FileSystemClient::ls_contents(const std::string& directory){
+    // nothing in the directory changed since we listed it, or the server would have said so
+    auto listing = cached_listing(directory);
+    if (!listing && options.listing_cache_entries > 0){
+        // a listing to keep has to know every entry's type, ls itself leaves out what is neither a directory nor a
+        // regular file and readdir would replay it without them: read it through ls_plus
+        bool unimplemented = false;
+        listing = read_listing_plus(directory, unimplemented);
+        if (!listing && !unimplemented) return std::nullopt;
+    }
+    if (!listing) return ls_uncached(directory);
+
+    // what ls lists: directories and regular files
+    std::map<std::string, std::string> entry_map;
+    for (const auto& [name, type] : *listing) {
+        if (type == DT_DIR) entry_map[name] = "Directory";
+        else if (type == DT_REG) entry_map[name] = "Regular_File";
+    }
+    return entry_map;
+}
+
+
+std::optional<std::map<std::string, std::string>> FileSystemClient::ls_uncached(const std::string& directory){
     grpc::ClientContext context;  
     afs_operation::ListDirectoryRequest request;
     afs_operation::ListDirectoryResponse response;
@@ -789,6 +1541,57 @@ std::optional<std::map<std::string, std::string>> FileSystemClient::ls_contents(
 }
 
 
+std::optional<std::map<std::string, std::string>> FileSystemClient::ls_plus_contents(const std::string& directory){
+    bool unimplemented = false;
+    auto listing = read_listing_plus(directory, unimplemented);
+    if (unimplemented) {
+        return ls_uncached(directory); // a server without ls_plus, the attributes come one getattr at a time
+    }
+    if (!listing) return std::nullopt;
+
+    std::map<std::string, std::string> entry_map;
+    for (const auto& [name, type] : *listing) {
+        entry_map[name] = type == DT_DIR ? "Directory" : "Regular_File";
+    }
+    return entry_map;
+}
+
+
+std::optional<DirectoryListing> FileSystemClient::read_listing_plus(const std::string& directory, bool& unimplemented){
+    grpc::ClientContext context;
+    afs_operation::ListDirectoryRequest request;
+    afs_operation::ListDirectoryPlusResponse response;
+    std::string resolved_path = resolve_server_path(directory);
+    request.set_directory(resolved_path);
+    uint64_t generation = 0;
+    if (options.listing_cache_entries > 0){ // the listing is going to be cached, the server has to tell us when it changes
+        request.set_client_id(client_id);
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        generation = listing_generation;
+    }
+
+    grpc::Status status = stub_ -> ls_plus(&context, request, &response);
+    unimplemented = status.error_code() == grpc::StatusCode::UNIMPLEMENTED;
+    if (!status.ok()){
+        if (!unimplemented) std::cerr << "Failed to load the directory content from the server: " << status.error_message() << std::endl;
+        return std::nullopt;
+    }
+
+    DirectoryListing listing;
+    std::string prefix = resolved_path + (resolved_path.back() == '/' ? "" : "/");
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        for (const afs_operation::DirectoryEntryPlus& entry : response.entries()) {
+            listing[entry.name()] = static_cast<unsigned char>(IFTODT(entry.attr().mode()));
+            // an entry already there is either just as fresh (notifications drop stale ones) or carries local writes
+            cached_attr.emplace(prefix + entry.name(), to_attributes(entry.attr()));
+        }
+    }
+    if (options.listing_cache_entries > 0) keep_listing(resolved_path, listing, generation);
+    return listing;
+}
+
+
 // In filesystem_client.cpp
 
 bool FileSystemClient::rename_file(const std::string& from_name, const std::string& to_name, const std::string& old_path, const std::string& new_path) {
@@ -882,6 +1685,11 @@ bool FileSystemClient::rename_file(const std::string& from_name, const std::stri
     update_map_keys(cache, old_local_path, new_local_path);
     update_map_keys(opened_files, old_local_path, new_local_path);
     update_map_keys(cached_attr, old_server_path, new_server_path);
+    // the server tells everyone but us that these listings changed
+    forget_directory(resolved_path);
+    forget_directory(resolved_path_new);
+    forget_directory(old_server_path, true);
+    forget_directory(new_server_path, true);
     cache_mutex.unlock();
 
     // 5. Send RPC to Server (Implementation depends on your proto)
@@ -914,7 +1722,24 @@ bool FileSystemClient::rename_file(const std::string& from_name, const std::stri
 
 bool FileSystemClient::truncate_file(const std::string& filename, const std::string& path, const int size){
     std::string resolved_path = resolve_server_path(path);
-    std::string cache_path = std::string(cache_directory) + (resolved_path[0] == '/'? "" : "/" ) + resolved_path +filename;
+    std::string cache_path = std::string(cache_directory) + (resolved_path[0] == '/'? "" : "/" ) + resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename;
+    if (!wait_for_download(cache_path, -1)){
+        std::cerr << "Error: The download of " << filename << " failed, reopen the file." << std::endl;
+        return false;
+    }
+    // the lock read_file and write_file take: no read or write of an open copy runs while it is cut
+    std::shared_ptr<std::mutex> file_mtx;
+    cache_mutex.lock();
+    auto m_it = file_mutexes.find(cache_path);
+    if (m_it != file_mutexes.end()) file_mtx = m_it->second;
+    cache_mutex.unlock();
+    std::unique_lock<std::mutex> file_lock;
+    if (file_mtx) file_lock = std::unique_lock<std::mutex>(*file_mtx);
+    // a lazy copy cut inside a block needs that block's surviving bytes before they are gone from the server's view
+    if (size % options.block_size != 0 && !fetch_blocks(filename, resolved_path, cache_path, size, 1)){
+        std::cerr << "Error: Could not fetch the block at the new end of " << filename << std::endl;
+        return false;
+    }
     try{
         std::filesystem::resize_file(cache_path, size);
     } catch(std::filesystem::filesystem_error& e){
@@ -923,6 +1748,25 @@ bool FileSystemClient::truncate_file(const std::string& filename, const std::str
         std::cerr << "Error code: " << e.code().message() << '\n';
         return false;
     }
+    // a truncation is a modification too: the next close has to cut the server's copy as well
+    cache_mutex.lock();
+    auto it = cache.find(cache_path);
+    if (it != cache.end()){
+        it->second.locally_modified = true;
+        if (it->second.truncated_to < 0 || size < it->second.truncated_to) it->second.truncated_to = size;
+        clip_dirty_extents(it->second.dirty_extents, size);
+        std::vector<bool>& present = it->second.present_blocks;
+        if (!present.empty()){ // blocks past the old end are zeros we made ourselves, blocks past the new end are gone
+            size_t blocks = static_cast<size_t>((static_cast<int64_t>(size) + options.block_size - 1) / options.block_size);
+            present.resize(blocks, true);
+            if (std::find(present.begin(), present.end(), false) == present.end()) present.clear();
+        }
+    }
+    auto attr_it = cached_attr.find(resolved_path + (resolved_path.back() == '/' ? "" : "/") + filename);
+    if (attr_it != cached_attr.end()){
+        attr_it->second.size = size;
+    }
+    cache_mutex.unlock();
     return true;
 }
 
@@ -940,6 +1784,9 @@ bool FileSystemClient::make_directory(const std::string& directory, const uint32
         std::cout << "Directory Creation Failed: " << status.error_message() << std::endl;
         return false;
     }
+    // the server's NOTIFY_DIRECTORY may come after the next readdir
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    forget_directory(std::filesystem::path(listing_key(resolved_path)).parent_path().generic_string());
     return true;
 }
 
@@ -980,6 +1827,9 @@ bool FileSystemClient::delete_file(const std::string& directory){
         std::cout << "Delete file in: "<< resolved_path << "in cached_attr";
     }
     file_mutexes.erase(cache_path);
+    // its directory's listing, and its own if it is a directory
+    forget_directory(std::filesystem::path(listing_key(resolved_path)).parent_path().generic_string());
+    forget_directory(resolved_path, true);
     global_lock.unlock();
 
     // And then we actually delete the files physically
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <memory>       // For std::unique_ptr, std::shared_ptr
 #include <fstream>     
 #include <optional>    
@@ -16,6 +17,34 @@
 #include <thread>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <set>
+#include <atomic>
+#include <deque>
+
+// Tunables of a client, every field has a default that suits the usual small file workload
+struct ClientOptions {
+    // files larger than this are opened lazily: open_file returns at once and reads fetch only the blocks they touch
+    // (0 turns lazy opens off)
+    int64_t lazy_threshold = 64 * 1024 * 1024;
+    int64_t block_size = 1024 * 1024; // granularity of lazy fetches, one bit of a file's present-block bitmap each
+    // open_file returns as soon as the first chunk is in, the rest streams in the background while reads of the
+    // bytes already received are served
+    bool progressive_open = true;
+    // offer chunk compression to the server, it picks the codec; incompressible data is sent as is either way
+    bool compression = true;
+    // directory listings are kept and served locally until the server reports that an entry changed; a directory
+    // with more entries than this is asked for every time (0 turns the listing cache off)
+    size_t listing_cache_entries = 10000;
+    // names get_attributes found missing are remembered per directory, so probes for files that don't exist
+    // (AppleDouble ._ files, PATH and include searches) stay local until the directory changes; at most this many
+    // names are kept in all (0 turns the negative cache off)
+    size_t negative_cache_entries = 65536;
+};
+
+// a directory listing as the client caches it: name -> d_type (DT_DIR, DT_REG, DT_LNK, ...), what readdir replays
+using DirectoryListing = std::map<std::string, unsigned char>;
 
 class FileSystemClient {
 private:
@@ -23,6 +52,23 @@ private:
         bool locally_modified;      // True if the local copy has been modified and then if locally_modified == true, we push it to the server on close()
         int64_t timestamp;    // The last known timestamp from the server
         std::string filename; // The base name of the file
+        bool stale = false;   // the server announced a newer version, revalidate with compare() before the next open
+        std::map<int64_t, int64_t> dirty_extents; // offset -> end of every byte range written since the base version
+        int64_t truncated_to = -1;                // smallest size truncate_file() cut the file to since then, -1 if never
+        int64_t base_size = 0;                    // size of the server's version `timestamp`, an append starts past it
+        int64_t tail_from = -1;                   // with stale: the server only appended, our copy just lacks the bytes from here on
+        std::vector<bool> present_blocks;         // lazily opened file: which blocks of the copy hold real bytes, empty once complete
+    };
+    // progressive open: the rest of a file's open() stream, written to the cached copy by a background thread
+    struct Download {
+        std::mutex mu;
+        std::condition_variable cv;
+        int64_t received = 0;                   // watermark: bytes [0, received) are in the cached copy
+        bool done = false;
+        bool failed = false;
+        bool cancelled = false;                 // the client is going away, don't resume
+        grpc::ClientContext* context = nullptr; // the stream in flight, for cancelling it
+        std::thread worker;
     };
     struct FileStreams {
         std::unique_ptr<std::ifstream> read_stream;
@@ -37,11 +83,85 @@ private:
     std::mutex cache_mutex; // this mutex is for cache, cache_attr and opened_files all together
     std::string server_root_path_;
     std::string client_id;
-    std::unique_ptr<grpc::ClientContext> subscriber_context_;
+    std::unique_ptr<grpc::ClientContext> subscriber_context_; // the subscription in flight, replaced on every reconnect
+    std::mutex subscriber_mutex_;                             // guards subscriber_context_ and subscriber_stopping_
+    // subscriber_stopping_ and subscriber_cv_ also stop the lease renewal thread
+    std::condition_variable subscriber_cv_;
+    bool subscriber_stopping_ = false;
+    // where the subscription stands in the server's notification log, to resume from after a reconnect
+    // Only touched by the subscriber thread
+    uint64_t notify_epoch = 0;
+    uint64_t notify_seq = 0;
     std::thread subscriber_thread;
+    std::thread lease_thread;
+    int32_t lease_seconds = 0; // callback lease length announced by the server in request_dir, 0 = no expiry
     std::unordered_map<std::string, std::shared_ptr<std::mutex>> file_mutexes; // Protects file stream access
     std::string cache_directory;
+    ClientOptions options;
+    int32_t codec = 0; // chunk compression agreed with the server in request_dir, 0 = none
+    std::map<std::string, std::shared_ptr<Download>> downloads; // key: file_location, guarded by cache_mutex
+    // cached directory listings by server directory without trailing slash, only ever filled from a read that knows
+    // every entry's type (list_dir, ls_plus, walk). The server holds a callback on each of them and sends
+    // NOTIFY_DIRECTORY once an entry changes. Guarded by cache_mutex
+    std::map<std::string, DirectoryListing> listings;
+    uint64_t listing_generation = 0; // bumped whenever a listing is dropped, a listing read across a bump is not kept
+    // what the last bumps dropped: a directory, or with true every directory whose key + "/" starts with it
+    // A long read (a walk of a subtree) then only loses the directories that changed under it. Guarded by cache_mutex
+    std::deque<std::pair<std::string, bool>> recent_drops;
+    // records a drop and bumps listing_generation; cache_mutex held
+    void note_drop(const std::string& path, bool below);
+    // whether a listing of the server directory key read since generation may be stale; cache_mutex held
+    bool dropped_since(const std::string& key, uint64_t generation);
+    // names known to be missing, by server directory like listings; kept under the same directory callback
+    // Guarded by cache_mutex
+    std::map<std::string, std::set<std::string>> negative_entries;
+    size_t negative_count = 0;                // names in negative_entries
+    std::atomic<uint64_t> negative_hits{0};   // getattr RPCs answered by negative_entries instead
+    // drops the listing and the missing names of the server directory (with below, also those under it); called
+    // with cache_mutex held
+    void forget_directory(const std::string& directory, bool below = false);
+    // the server directories the client holds a callback on for its listing or its missing names; cache_mutex held
+    std::vector<std::string> held_directories();
+    // keeps entries as the listing of the server directory, unless a listing was dropped since generation
+    void keep_listing(const std::string& directory, DirectoryListing entries, uint64_t generation);
+    // ls_plus: every entry of directory with its type, the attributes go to cached_attr and with the listing cache on
+    // the listing is kept. Sets unimplemented for a server without ls_plus
+    std::optional<DirectoryListing> read_listing_plus(const std::string& directory, bool& unimplemented);
+    // ls, which names directories and regular files only and leaves the rest out: never cached
+    std::optional<std::map<std::string, std::string>> ls_uncached(const std::string& directory);
+    static std::string listing_key(const std::string& directory);
     void RunSubscriber();
+    void RunLeaseRenewal();
+    // applies one batch from the subscription to the cache
+    void handle_notifications(const afs_operation::NotificationBatch& batch);
+    // marks every cached copy under the server path prefix ("" for all) stale and drops their cached attributes and listings
+    void mark_stale_under(const std::string& prefix);
+    std::string server_path_of(const std::string& location);
+    void RunDownload(std::shared_ptr<Download> download, std::unique_ptr<grpc::ClientContext> context,
+                     std::unique_ptr<grpc::ClientReader<afs_operation::FileResponse>> reader,
+                     std::string filename, std::string resolved_path, std::string file_location, int64_t timestamp);
+    // waits until bytes [0, upto) of a progressively opened file are in (upto < 0: the whole download is over)
+    // True at once for files without a download in flight, false if the download failed short of upto
+    bool wait_for_download(const std::string& file_location, int64_t upto);
+    // conditional open: keeps the cached copy at file_location if the server still has version `timestamp`,
+    // otherwise replaces it with the server's content. Leaves a fresh cache entry behind on success
+    // With tail_from >= 0 the copy is known to be a prefix of the new version and only the missing tail is fetched
+    bool revalidate_cached_file(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t timestamp, int64_t tail_from = -1);
+    // delta close: uploads only the parts of file_location that the server's version (base_timestamp) lacks.
+    // Returns false whenever a delta can't be used (small file, server version moved on, RPC failure) so the caller
+    // falls back to uploading the whole file
+    bool upload_delta(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t base_timestamp, afs_operation::FileResponse& response);
+    // ranged close: uploads just the dirty extents (and truncation) recorded since base_timestamp
+    // Returns false when the server no longer has that version or the RPC fails, the caller then falls back
+    bool upload_ranges(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t base_timestamp,
+                       const std::map<int64_t, int64_t>& extents, int64_t truncated_to, afs_operation::FileResponse& response);
+    // append close: the file only grew past base_size, so just the bytes after it are sent
+    // Returns false when the server's version is no longer exactly the base one or the RPC fails
+    bool upload_append(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t base_timestamp,
+                       int64_t base_size, afs_operation::FileResponse& response);
+    // lazy open: makes sure every block overlapping [offset, offset + length) of a lazily opened file is in the cached copy,
+    // fetching the missing ones with read_range. Callers hold the file's mutex. True for files that are not lazy
+    bool fetch_blocks(const std::string& filename, const std::string& resolved_path, const std::string& file_location, int64_t offset, int64_t length);
 
 public:
     // Map of locally cached FileAttributes. key is the directory of the file on the server
@@ -49,8 +169,10 @@ public:
     /**
      * @brief Constructs the client and initializes the connection with the server.
      * @param channel The gRPC channel to use for communication.
+     * @param cache_path Where cached copies of the server's files are kept.
+     * @param options Tunables such as the lazy open threshold, see ClientOptions.
      */
-    FileSystemClient(std::shared_ptr<grpc::Channel> channel, std::string cache_path = "./tmp/cache");
+    FileSystemClient(std::shared_ptr<grpc::Channel> channel, std::string cache_path = "./tmp/cache", ClientOptions options = ClientOptions());
     ~FileSystemClient();
 
     std::string resolve_server_path(const std::string& user_path);
@@ -99,8 +221,64 @@ public:
     bool close_file(const std::string& filename, const std::string& directory);
 
     std::optional<std::map<std::string, std::string>> ls_contents(const std::string& directory); // list the contents in the specified directory
+    // ls_contents that also fills cached_attr for every entry in the same round trip, so the getattr calls that
+    // follow a readdir are answered locally
+    std::optional<std::map<std::string, std::string>> ls_plus_contents(const std::string& directory);
+    // the listing of directory as the client caches it, std::nullopt when it has to be asked from the server
+    std::optional<DirectoryListing> cached_listing(const std::string& directory);
+
+    // a directory listed through list_dir, a page at a time, for directories too big to list in one message
+    // read() hands entries over in order and stops when the callback turns one down; the next read() from the cookie
+    // of the last accepted entry carries on with the same stream, any other cursor starts a new one there.
+    // With attributes, cached_attr is filled a page at a time like ls_plus_contents does. A stream that runs from the
+    // start to the end of a directory leaves its listing in the listing cache. See client_directory.hpp
+    class DirectoryStream {
+    public:
+        ~DirectoryStream();
+        // calls fn with the entries after cursor (0: from the start) until fn returns false or the directory ends
+        // False if the listing failed, not_found then tells whether the directory is missing
+        bool read(uint64_t cursor, const std::function<bool(const afs_operation::DirEntry&)>& fn);
+        bool not_found = false;
+
+    private:
+        friend class FileSystemClient;
+        DirectoryStream(FileSystemClient* client, std::string resolved_path, bool with_attributes, uint32_t page_size);
+        void restart(uint64_t cursor);
+        void cancel();
+        bool next_page();
+
+        FileSystemClient* client;
+        std::string resolved_path;
+        bool with_attributes;
+        uint32_t page_size;
+        std::unique_ptr<grpc::ClientContext> context;
+        std::unique_ptr<grpc::ClientReader<afs_operation::DirPage>> reader;
+        afs_operation::DirPage page;
+        int next = 0;          // first entry of page not handed over yet
+        uint64_t position = 0; // cookie of the last entry handed over, where the stream stands
+        bool ended = false;    // the server sent everything after position
+        bool collecting = false; // read from the start: the listing is gathered for the listing cache
+        uint64_t generation = 0;
+        DirectoryListing collected;
+    };
+    std::unique_ptr<DirectoryStream> open_directory(const std::string& directory, bool with_attributes = true, uint32_t page_size = 0);
+
+    // reads every directory under directory (max_depth 1: just directory itself, 0: all the way down) in one stream,
+    // the server lists them in parallel. Each entry's attributes go to cached_attr and each directory's listing to
+    // the listing cache, so a find or du over the tree afterwards runs locally; fn, if given, sees every entry with
+    // its path relative to directory. False if the walk failed. See client_directory.hpp
+    bool walk_subtree(const std::string& directory, uint32_t max_depth = 0,
+                      const std::function<void(const std::string&, const FileAttributes&)>& fn = nullptr);
+    // paths under directory (as the client names them, "/data/a.parquet") whose name matches the glob pattern, or
+    // contains it with substring; a pattern with a '/' is matched against the path below directory. The server
+    // answers from its name index; a server without one is walked instead. At most limit paths (0: the server's
+    // default), std::nullopt if the search failed
+    std::optional<std::vector<std::string>> find_paths(const std::string& directory, const std::string& pattern,
+                                                       bool substring = false, uint32_t limit = 0);
     
     std::optional<FileAttributes> get_attributes(const std::string& filename, const std::string& path);
+    // how many get_attributes calls for missing files were answered locally, each one a getattr RPC saved
+    uint64_t negative_cache_hits() const { return negative_hits; }
 
     bool rename_file(const std::string& from_name, const std::string& to_name, const std::string& old_path, const std::string& new_path);
 
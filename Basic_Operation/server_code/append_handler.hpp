@@ -0,0 +1,189 @@
+#ifndef APPEND_HANDLER_HPP
+#define APPEND_HANDLER_HPP
+
+#include "filesystem_server.hpp"
+#include "async_call_data.hpp"
+#include <iostream>
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// append takes only the bytes a client added past the end of the version it started from (log files)
+// The tail goes onto a copy of the base version next to the original (copy_file_range, which shares the blocks on
+// filesystems that can), and the copy replaces the file once every byte is in and the base is still current, as
+// close_delta does. Nobody reading the file sees half a tail, and a stream that fails half way leaves it as it was.
+// One append per path at a time, concurrent appenders are refused.
+class AppendCallData : public CallData {
+public:
+    AppendCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), reader(&ctx) {
+        service->Requestappend(&ctx, &reader, cq, cq, &request_tag);
+    }
+
+    ~AppendCallData() {
+        if (fd >= 0) ::close(fd);
+        if (!temp_path.empty()) ::unlink(temp_path.c_str()); // only still set if the append was not applied
+        if (claimed) {
+            std::lock_guard<std::mutex> lock(fs->append_mutex);
+            fs->appending.erase(path);
+        }
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new AppendCallData(fs, service, cq);
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case READ: {
+                if (!ok) { // the client called WritesDone
+                    Complete();
+                    return;
+                }
+                grpc::Status status = path.empty() ? Begin() : grpc::Status::OK;
+                if (status.ok()) status = Write();
+                if (!status.ok()) {
+                    std::cerr << "Append to " << path << " failed: " << status.error_message() << std::endl;
+                    reader.FinishWithError(status, &finish_tag);
+                    return;
+                }
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, READ, FINISH };
+
+    grpc::Status Begin() {
+        std::string directory = request.directory();
+        path = directory + (directory.back()=='/'? "" : "/") + request.filename();
+        client_id = request.client_id();
+        base_timestamp = request.timestamp();
+        file_size = request.file_size();
+        std::cout << "[SERVER] append() called for " << path << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(fs->append_mutex);
+            if (!fs->appending.insert(path).second) {
+                return grpc::Status(grpc::StatusCode::ABORTED, "Another append to this file is in progress.");
+            }
+            claimed = true;
+        }
+        // the copy is taken from the file itself, so it has to hold its bytes rather than a storage placeholder
+        if (!fs->storage->prepare_update(path)) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version is not available for an in place update, send the whole file.");
+        }
+        int base_fd = ::open(path.c_str(), O_RDONLY);
+        struct stat s;
+        if (base_fd < 0 || fstat(base_fd, &s) != 0) {
+            if (base_fd >= 0) ::close(base_fd);
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "Base version not found on the server.");
+        }
+        // the tail only makes sense on top of exactly the version the client grew
+        if (stat_timestamp(s) != base_timestamp || s.st_size != request.offset()) {
+            ::close(base_fd);
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version changed, send the whole file.");
+        }
+        base_size = s.st_size;
+        base_mode = s.st_mode;
+        cursor = base_size;
+
+        std::filesystem::path file_path(path);
+        std::string temp = (file_path.parent_path() / ("." + file_path.filename().string() + ".afs_append.XXXXXX")).string();
+        std::vector<char> temp_name(temp.begin(), temp.end());
+        temp_name.push_back('\0');
+        fd = mkstemp(temp_name.data());
+        if (fd < 0) {
+            ::close(base_fd);
+            return grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "cant open file to write");
+        }
+        temp_path = temp_name.data();
+        bool copied = copy_prefix(base_fd, fd, base_size);
+        ::close(base_fd);
+        if (!copied) {
+            return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to copy the base version.");
+        }
+        return grpc::Status::OK;
+    }
+
+    grpc::Status Write() {
+        const char* data = request.content().data();
+        size_t len = request.content().size();
+        while (len > 0) {
+            ssize_t n = pwrite(fd, data, len, cursor);
+            if (n <= 0) {
+                return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to append to the file.");
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+            cursor += n;
+        }
+        return grpc::Status::OK;
+    }
+
+    void Complete() {
+        if (path.empty()) {
+            std::cerr << "Append received no data." << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No file data received."), &finish_tag);
+            return;
+        }
+        if (cursor != file_size) {
+            std::cerr << "Append to " << path << " was cut short" << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::DATA_LOSS, "Not every appended byte arrived."), &finish_tag);
+            return;
+        }
+        fchmod(fd, base_mode & 07777);
+        ::close(fd);
+        fd = -1;
+        {
+            // someone else may have closed the file while the tail arrived, their version must not be lost silently
+            std::lock_guard<std::mutex> commit(fs->commit_lock(path));
+            if (get_file_timestamp(path) != base_timestamp) {
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version changed, send the whole file."), &finish_tag);
+                return;
+            }
+            if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to replace the file."), &finish_tag);
+                return;
+            }
+            temp_path.clear();
+            std::cout << "[SERVER] Appended " << (cursor - base_size) << " bytes to " << path << std::endl;
+            response.set_timestamp(fs->publish_close(path, client_id, base_size, base_timestamp));
+        }
+        reader.Finish(response, grpc::Status::OK, &finish_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    grpc::ServerAsyncReader<afs_operation::FileResponse, afs_operation::FileRequest> reader;
+    afs_operation::FileRequest request;
+    afs_operation::FileResponse response;
+    std::string path;
+    std::string temp_path; // the staging copy the tail goes onto
+    std::string client_id;
+    int fd = -1;
+    int64_t base_timestamp = 0;
+    int64_t base_size = 0;
+    mode_t base_mode = 0644;
+    int64_t file_size = 0;
+    int64_t cursor = 0;
+    bool claimed = false;
+    CallTag request_tag{this, REQUEST};
+    CallTag read_tag{this, READ};
+    CallTag finish_tag{this, FINISH};
+};
+
+#endif
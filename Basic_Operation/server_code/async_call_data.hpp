@@ -0,0 +1,372 @@
+#ifndef ASYNC_CALL_DATA_HPP
+#define ASYNC_CALL_DATA_HPP
+
+#include "filesystem_server.hpp"
+#include <iostream>
+#include <fstream>
+
+// Every in-flight RPC is a CallData object: a small state machine that is advanced each time one
+// of its operations (request matched, write done, read done, finish done ...) comes out of the
+// completion queue. A call only occupies a thread while one of its events is being processed.
+class CallData {
+public:
+    virtual ~CallData() = default;
+    virtual void Proceed(int event, bool ok) = 0;
+};
+
+// what we hand to gRPC as the void* tag: which call the completion belongs to and what it was
+struct CallTag {
+    CallData* call;
+    int event;
+};
+
+// generic handler for the unary RPCs: it waits for one request, runs the matching FileSystem
+// handler on the completion queue thread and sends the response back
+template <class Request, class Response>
+class UnaryCallData : public CallData {
+public:
+    using RequestFn = void (AsyncService::*)(grpc::ServerContext*, Request*, grpc::ServerAsyncResponseWriter<Response>*,
+                                                                     grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+    using HandlerFn = grpc::Status (FileSystem::*)(grpc::ServerContext*, const Request*, Response*);
+
+    UnaryCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq, RequestFn request_fn, HandlerFn handler)
+        : fs(fs), service(service), cq(cq), request_fn(request_fn), handler(handler), responder(&ctx) {
+        // ask gRPC for the next call of this method, it shows up as REQUEST on this cq
+        (service->*request_fn)(&ctx, &request, &responder, cq, cq, &request_tag);
+    }
+
+    void Proceed(int event, bool ok) override {
+        if (event == REQUEST) {
+            if (!ok) { // the server is shutting down
+                delete this;
+                return;
+            }
+            // keep one call of this method armed at all times
+            new UnaryCallData(fs, service, cq, request_fn, handler);
+            grpc::Status status = (fs->*handler)(&ctx, &request, &response);
+            if (status.ok()) {
+                responder.Finish(response, status, &finish_tag);
+            } else {
+                responder.FinishWithError(status, &finish_tag);
+            }
+        } else { // FINISH
+            delete this;
+        }
+    }
+
+private:
+    enum Event { REQUEST, FINISH };
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    RequestFn request_fn;
+    HandlerFn handler;
+    grpc::ServerContext ctx;
+    Request request;
+    Response response;
+    grpc::ServerAsyncResponseWriter<Response> responder;
+    CallTag request_tag{this, REQUEST};
+    CallTag finish_tag{this, FINISH};
+};
+
+
+// open streams the requested file to the client one chunk per completed write
+// The method is raw: the request arrives as bytes and every FileResponse is assembled by FileChunkReader
+// around a pooled buffer, with the chunk size picked from the file size and the client's message limit
+// The same call also serves compare (COMPARE), the conditional open used to revalidate a cached copy:
+// if the client's timestamp still matches the file only a "not modified" response goes out,
+// and read_range (READ_RANGE), which streams one byte range of a file the client opened lazily
+class OpenCallData : public CallData {
+public:
+    // OPEN streams the whole file, COMPARE is the conditional open, READ_RANGE serves one range of a lazily opened file
+    enum Mode { OPEN, COMPARE, READ_RANGE };
+
+    OpenCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq, Mode mode = OPEN)
+        : fs(fs), service(service), cq(cq), mode(mode), writer(&ctx), chunks(fs->buffer_pool) {
+        if (mode == COMPARE) {
+            service->Requestcompare(&ctx, &raw_request, &writer, cq, cq, &request_tag);
+        } else if (mode == READ_RANGE) {
+            service->Requestread_range(&ctx, &raw_request, &writer, cq, cq, &request_tag);
+        } else {
+            service->Requestopen(&ctx, &raw_request, &writer, cq, cq, &request_tag);
+        }
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new OpenCallData(fs, service, cq, mode);
+                Start();
+                break;
+            }
+            case WRITE: {
+                if (!ok) {
+                    std::cerr << "Error: Failed write " << std::endl;
+                    writer.Finish(grpc::Status(grpc::StatusCode::INTERNAL, "Server failed to create the file."), &finish_tag);
+                    return;
+                }
+                SendNextChunk();
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, WRITE, FINISH };
+
+    void Start() {
+        if (!grpc::SerializationTraits<afs_operation::FileRequest>::Deserialize(&raw_request, &request).ok()) {
+            writer.Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Malformed open request."), &finish_tag);
+            return;
+        }
+        //get the file name
+        filename = request.filename(); // gRPC generates getter methods
+        std::string directory = request.directory();
+        std::cout << "Client wants " << directory<<(directory.back()=='/'? "" : "/")<<filename << std::endl;
+        std::string path = directory + (directory.back()=='/'? "" : "/") + filename;
+        if (mode == READ_RANGE) { // the client registered its interest when it opened the file
+            StartRange(path);
+            return;
+        }
+        // this client is registering its interest
+        std::string client_id = request.client_id();
+        // update the interest registry: the client caches the path and has it open right now
+        fs->interests.opened(path, client_id);
+
+        if (!chunks.open(*fs->storage, path, request.max_chunk_size())){
+            std::cerr << "file: " << path << " not found" << std::endl;
+            writer.Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found on the server."), &finish_tag);
+            return;
+        }
+        // the version this client now holds, a change made outside the server is measured against it
+        fs->detector.record(path, {chunks.version(), chunks.size()});
+        UseCodec();
+        if (mode == OPEN && request.lazy_threshold() > 0 && chunks.size() > request.lazy_threshold()) {
+            // too big to make the client wait for all of it, it fetches the blocks it touches with read_range
+            std::cout << "Opening '" << filename << "' lazily: " << chunks.size() << " bytes" << std::endl;
+            afs_operation::FileResponse response;
+            response.set_timestamp(chunks.version());
+            response.set_file_size(chunks.size());
+            response.set_update_bit(3);
+            SendLast(response);
+            return;
+        }
+        if (mode == COMPARE) {
+            afs_operation::FileResponse response;
+            response.set_timestamp(chunks.version());
+            // != rather than <: a file restored from a backup can carry an older mtime and is still a different version
+            if (request.timestamp() == chunks.version() && request.offset() < chunks.size() && request.offset() > 0) {
+                // the client holds this version up to offset (it saw an APPEND), the tail is all it needs
+                std::cout << "Cache for '" << filename << "' is missing its tail from " << request.offset() << std::endl;
+                chunks.skip_to(request.offset());
+                update_bit = 2;
+                SendNextChunk();
+                return;
+            }
+            if (request.timestamp() == chunks.version() && request.offset() <= chunks.size()) {
+                std::cout << "Cache for '" << filename << "' is valid." << std::endl;
+                response.set_update_bit(0);
+                SendLast(response);
+                return;
+            }
+            std::cout << "Cache for '" << filename << "' is stale. Sending update." << std::endl;
+            update_bit = 1;
+            if (chunks.size() == 0) { // an empty file has no chunk to carry the update bit
+                response.set_update_bit(1);
+                SendLast(response);
+                return;
+            }
+        }
+        std::cout << "Streaming " << chunks.size() << " bytes in chunks of " << chunks.chunk() << " bytes" << std::endl;
+        SendNextChunk();
+    }
+
+    // ranges are only served from the version the client opened, mixing versions in one cached copy would corrupt it
+    void StartRange(const std::string& path) {
+        if (!chunks.open(*fs->storage, path, request.max_chunk_size())) {
+            writer.Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found on the server."), &finish_tag);
+            return;
+        }
+        UseCodec();
+        if (chunks.version() != request.timestamp()) {
+            writer.Finish(grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "File changed since it was opened."), &finish_tag);
+            return;
+        }
+        if (request.offset() < 0 || request.length() <= 0) {
+            writer.Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Bad range."), &finish_tag);
+            return;
+        }
+        chunks.skip_to(request.offset());
+        chunks.stop_at(request.offset() + request.length());
+        SendNextChunk();
+    }
+
+    // compress the chunks if the client asked for a codec this server has
+    void UseCodec() {
+        int32_t codec = chunk_codec::choose(std::vector<int32_t>{request.codec()});
+        if (fs->compression && codec != chunk_codec::NONE) chunks.compress_with(codec, &fs->compressed_cache);
+    }
+
+    // a single plain FileResponse that ends the stream
+    void SendLast(const afs_operation::FileResponse& response) {
+        grpc::ByteBuffer buffer;
+        bool own_buffer;
+        grpc::SerializationTraits<afs_operation::FileResponse>::Serialize(response, &buffer, &own_buffer);
+        last_sent = true;
+        writer.Write(buffer, &write_tag);
+    }
+
+    void SendNextChunk() {
+        grpc::ByteBuffer chunk;
+        if (last_sent || !chunks.next(&chunk, update_bit)) {
+            if (chunks.failed()) {
+                std::cerr << "Error: read failed while streaming " << filename << std::endl;
+                writer.Finish(grpc::Status(grpc::StatusCode::INTERNAL, "Server failed to read the file."), &finish_tag);
+                return;
+            }
+            std::cout << "File: " << filename << " successfully retrieved" << (chunks.replayed() ? " from the compressed cache." : ".") << std::endl;
+            writer.Finish(grpc::Status::OK, &finish_tag);
+            return;
+        }
+        writer.Write(chunk, &write_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    Mode mode;
+    bool last_sent = false;
+    int32_t update_bit = 0; // what every streamed chunk carries: 0 for open, 1 (whole file) or 2 (tail) for compare
+    grpc::ServerContext ctx;
+    grpc::ByteBuffer raw_request;
+    afs_operation::FileRequest request;
+    grpc::ServerAsyncWriter<grpc::ByteBuffer> writer;
+    std::string filename;
+    FileChunkReader chunks;
+    CallTag request_tag{this, REQUEST};
+    CallTag write_tag{this, WRITE};
+    CallTag finish_tag{this, FINISH};
+};
+
+
+// close receives the client's file chunk by chunk, one outstanding read at a time
+class CloseCallData : public CallData {
+public:
+    CloseCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), reader(&ctx) {
+        service->Requestclose(&ctx, &reader, cq, cq, &request_tag);
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new CloseCallData(fs, service, cq);
+                std::cout << "[SERVER] close() called" << std::endl;
+                std::cout << "[SERVER] Starting to read chunks..." << std::endl;
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case READ: {
+                if (!ok) { // the client called WritesDone (or went away), the upload is complete
+                    Complete();
+                    return;
+                }
+                if (!WriteChunk()) return;
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, READ, FINISH };
+
+    bool WriteChunk() {
+        if(filename.empty() || path.empty()){
+            filename = request.filename();
+            path = request.directory() + (request.directory().back()=='/'? "" : "/") + filename;
+            {
+                std::lock_guard<std::mutex> commit(fs->commit_lock(path));
+                outfile = fs->storage->create(path);
+            }
+            if(!outfile){
+                std::cerr << "failed to open file: " << path << std::endl;
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::PERMISSION_DENIED,
+                                    "cant open file to write"), &finish_tag);
+                return false;
+            }
+        }
+        if (!chunk_codec::valid_raw_length(request.codec(), request.raw_length())) {
+            std::cerr << "Chunk for " << path << " claims a raw length of " << request.raw_length() << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Invalid chunk raw length."), &finish_tag);
+            return false;
+        }
+        const std::string* content = chunk_codec::plain_content(request.codec(), request.content(), request.raw_length(), scratch);
+        if (!content) {
+            std::cerr << "Corrupt compressed chunk for " << path << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::DATA_LOSS, "Chunk could not be decompressed."), &finish_tag);
+            return false;
+        }
+        if (!outfile->write(content->data(), content->size())) {
+            std::cerr << "failed to write file: " << path << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write the file."), &finish_tag);
+            return false;
+        }
+        client_id = request.client_id();
+        return true;
+    }
+
+    void Complete() {
+        std::cout << "close is in progress" <<std::endl;
+        // Check if path is empty, which happens if no messages were received
+        if (path.empty()) {
+            std::cerr << "Close RPC received no file data." << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No file data received."), &finish_tag);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> commit(fs->commit_lock(path));
+            if (!outfile->commit()) {
+                std::cerr << "failed to store file: " << path << std::endl;
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to store the file."), &finish_tag);
+                return;
+            }
+            response.set_timestamp(fs->publish_close(path, client_id));
+        }
+        reader.Finish(response, grpc::Status::OK, &finish_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    grpc::ServerAsyncReader<afs_operation::FileResponse, afs_operation::FileRequest> reader;
+    afs_operation::FileRequest request;
+    afs_operation::FileResponse response;
+    std::string filename;
+    std::string path;
+    std::string client_id;
+    std::unique_ptr<StoredWriter> outfile;
+    std::string scratch; // decompressed content of the current chunk
+    CallTag request_tag{this, REQUEST};
+    CallTag read_tag{this, READ};
+    CallTag finish_tag{this, FINISH};
+};
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef CHANGE_DETECTOR_HPP
+#define CHANGE_DETECTOR_HPP
+
+#include "tree_watcher.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bookkeeping for changes made under root_dir behind the server's back (batch jobs, a shell on the server)
+// The server records the version (mtime stamp and size) of every file it hands out or publishes. What the
+// TreeWatcher reports is held back until the path has been quiet for `settle`, so a writer that is still busy is
+// not announced halfway, and then handed to the server, which compares it with the recorded version: the server's
+// own writes match and are dropped, and so are the renames, unlinks and mkdirs it expect()s, anything else becomes
+// an ordinary notification. Since inotify can lose events
+// (queue overflow, directories it could not watch, filesystems that don't report) a reconciliation scan compares
+// every recorded version with the disk once per `scan_interval` as well, and at once after an overflow.
+class ChangeDetector {
+public:
+    struct Version {
+        int64_t stamp = 0;
+        int64_t size = 0;
+        bool operator==(const Version& other) const { return stamp == other.stamp && size == other.size; }
+    };
+
+    struct Metrics {
+        uint64_t events = 0;        // reported by the watcher
+        uint64_t notifications = 0; // external changes published
+        uint64_t scans = 0;
+    };
+
+    // set before the watcher and the scans start
+    void configure(std::chrono::milliseconds settle_time, std::chrono::seconds interval) {
+        std::lock_guard<std::mutex> lock(mu);
+        settle = settle_time;
+        scan_interval = interval;
+        next_scan = std::chrono::steady_clock::now() + interval;
+    }
+
+    // clients were handed, or told about, this version of path
+    void record(const std::string& path, const Version& version) {
+        std::lock_guard<std::mutex> lock(mu);
+        versions[path] = version;
+    }
+
+    // false if no version of path was recorded
+    bool known(const std::string& path, Version& version) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = versions.find(path);
+        if (it == versions.end()) return false;
+        version = it->second;
+        return true;
+    }
+
+    void forget(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mu);
+        versions.erase(path);
+    }
+
+    // from was renamed to; what was recorded below a directory moves along
+    void moved(const std::string& from, const std::string& to, bool directory) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!directory) {
+            auto it = versions.find(from);
+            if (it == versions.end()) return;
+            Version version = it->second;
+            versions.erase(it);
+            versions[to] = version;
+            return;
+        }
+        std::vector<std::pair<std::string, Version>> carried;
+        for (auto it = versions.begin(); it != versions.end();) {
+            if (it->first == from || under(it->first, from)) {
+                carried.emplace_back(to + it->first.substr(from.size()), it->second);
+                it = versions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto& [path, version] : carried) versions[path] = version;
+    }
+
+    // the server renames, removes or creates a path itself and tells its clients as it does: the watcher's report of
+    // it is dropped like one of its own writes. Forgotten if the watcher doesn't report it in time
+    void expect(const TreeWatcher::Change& change) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto now = std::chrono::steady_clock::now();
+        drop_expired(now);
+        expected.push_back(Expected{change.kind, trimmed(change.path), trimmed(change.new_path), now});
+    }
+
+    // true, once per expect(), for the report of a change the server made itself
+    bool own(const TreeWatcher::Change& change) {
+        std::lock_guard<std::mutex> lock(mu);
+        drop_expired(std::chrono::steady_clock::now());
+        for (auto it = expected.begin(); it != expected.end(); ++it) {
+            if (it->kind == change.kind && it->path == change.path && it->new_path == change.new_path) {
+                expected.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // drops the versions of paths nobody holds any more
+    void prune(const std::function<bool(const std::string&)>& held) {
+        std::vector<std::string> paths = recorded();
+        std::lock_guard<std::mutex> lock(mu);
+        for (const std::string& path : paths) {
+            if (!held(path)) versions.erase(path);
+        }
+    }
+
+    std::vector<std::string> recorded() {
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<std::string> paths;
+        paths.reserve(versions.size());
+        for (const auto& entry : versions) paths.push_back(entry.first);
+        return paths;
+    }
+
+    // TreeWatcher listener: a later change of the same path replaces the earlier one and restarts its clock
+    void observe(const TreeWatcher::Change& change) {
+        events++;
+        std::lock_guard<std::mutex> lock(mu);
+        if (change.kind == TreeWatcher::Change::OVERFLOW) {
+            scan_requested = true;
+        } else {
+            std::string key = change.kind == TreeWatcher::Change::MOVED ? change.path + '\n' + change.new_path : change.path;
+            pending[key] = Pending{change, std::chrono::steady_clock::now()};
+        }
+        cv.notify_one();
+    }
+
+    // waits for changes that settled or for the next scan; false once stopped
+    bool wait(std::vector<TreeWatcher::Change>& settled, bool& scan) {
+        std::unique_lock<std::mutex> lock(mu);
+        while (!stopping) {
+            auto now = std::chrono::steady_clock::now();
+            auto wake = scan_interval.count() > 0 ? next_scan : now + std::chrono::hours(1);
+            for (auto it = pending.begin(); it != pending.end();) {
+                auto due = it->second.last_seen + settle;
+                if (due <= now) {
+                    settled.push_back(std::move(it->second.change));
+                    it = pending.erase(it);
+                } else {
+                    wake = std::min(wake, due);
+                    ++it;
+                }
+            }
+            scan = scan_requested || (scan_interval.count() > 0 && next_scan <= now);
+            if (scan) {
+                scan_requested = false;
+                next_scan = now + scan_interval;
+            }
+            if (scan || !settled.empty()) return true;
+            cv.wait_until(lock, wake);
+        }
+        return false;
+    }
+
+    void stop() {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+        cv.notify_all();
+    }
+
+    // a is below directory b
+    static bool under(const std::string& a, const std::string& b) {
+        return a.size() > b.size() && a.compare(0, b.size(), b) == 0 && a[b.size()] == '/';
+    }
+
+    Metrics metrics() const {
+        Metrics m;
+        m.events = events;
+        m.notifications = notifications;
+        m.scans = scans;
+        return m;
+    }
+
+    std::atomic<uint64_t> notifications{0};
+    std::atomic<uint64_t> scans{0};
+
+private:
+    struct Pending {
+        TreeWatcher::Change change;
+        std::chrono::steady_clock::time_point last_seen;
+    };
+
+    struct Expected {
+        TreeWatcher::Change::Kind kind;
+        std::string path;
+        std::string new_path;
+        std::chrono::steady_clock::time_point made;
+    };
+
+    // the watcher spells paths without a trailing slash
+    static std::string trimmed(std::string path) {
+        while (path.size() > 1 && path.back() == '/') path.pop_back();
+        return path;
+    }
+
+    // mu held
+    void drop_expired(std::chrono::steady_clock::time_point now) {
+        while (!expected.empty() && expected.front().made + settle + std::chrono::seconds(30) < now) expected.pop_front();
+    }
+
+    std::chrono::milliseconds settle{500};
+    std::chrono::seconds scan_interval{60}; // 0: no periodic scans, only after an overflow
+    std::mutex mu;
+    std::condition_variable cv;
+    std::unordered_map<std::string, Version> versions;
+    std::unordered_map<std::string, Pending> pending;
+    std::deque<Expected> expected; // own namespace changes the watcher has yet to report, oldest first
+    std::chrono::steady_clock::time_point next_scan;
+    bool scan_requested = false; // events were lost
+    bool stopping = false;
+    std::atomic<uint64_t> events{0};
+};
+
+#endif
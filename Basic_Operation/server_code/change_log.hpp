@@ -0,0 +1,199 @@
+#ifndef CHANGE_LOG_HPP
+#define CHANGE_LOG_HPP
+
+#include "interest_registry.hpp"
+#include "afs_operation.pb.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+// The notifications the server published, so that a subscriber that reconnects can catch up
+// Every published notification gets the next sequence number and is kept, with the client that caused it and the
+// clients that held the path, in a window of the most recent `capacity` entries. A subscriber resuming after
+// sequence N is replayed the entries past N that were meant for it, as long as all of them are still in the window
+// and N comes from this log (same epoch; a new epoch is drawn whenever the log starts from scratch).
+// With a state directory every entry is also appended to notifications.log there, so the sequence numbers and the
+// window survive a restart. Entries read back from the file no longer know who they were meant for and are
+// replayed to every resuming client, which at worst costs a client a revalidation of a file it didn't need.
+class ChangeLog {
+public:
+    struct Entry {
+        afs_operation::Notification notif;
+        std::string origin;
+        InterestRegistry::Snapshot clients; // nullptr: read back from disk, recipients unknown
+    };
+
+    // held across append() and handing the notification to the fan-out, so sequence order is delivery order,
+    // and by a resuming subscriber while it reads the window and puts its queue in place
+    std::mutex mu;
+
+    ChangeLog() {
+        std::random_device random;
+        epoch_ = (static_cast<uint64_t>(random()) << 32 | random()) | 1; // never 0, a client that has no epoch sends 0
+    }
+
+    ~ChangeLog() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    // keeps the last `entries` notifications and, with a state_dir, loads and continues the log kept there
+    // False if the file can't be used, the log then lives in memory only
+    bool open(const std::string& state_dir, size_t entries) {
+        std::lock_guard<std::mutex> lock(mu);
+        capacity = std::max<size_t>(entries, 1);
+        if (state_dir.empty()) return false;
+        std::error_code ec;
+        std::filesystem::create_directories(state_dir, ec);
+        path = state_dir + "/notifications.log";
+        if (!load()) {
+            std::cerr << "Notification log " << path << " is unreadable, starting a new one" << std::endl;
+            log.clear();
+            next_seq = 1;
+        }
+        if (!rewrite()) {
+            std::cerr << "Can't write the notification log to " << path << ", keeping it in memory only" << std::endl;
+            path.clear();
+            return false;
+        }
+        std::cout << "Notification log: epoch " << epoch_ << ", sequence " << head() << ", " << log.size()
+                  << " entries kept" << std::endl;
+        return true;
+    }
+
+    // stamps notif with the next sequence number and records it; caller holds mu
+    uint64_t append(afs_operation::Notification& notif, const std::string& origin, InterestRegistry::Snapshot clients) {
+        notif.set_seq(next_seq++);
+        log.push_back(Entry{notif, origin, std::move(clients)});
+        if (log.size() > capacity) log.pop_front();
+        if (fd >= 0) {
+            if (!write_entry(fd, log.back())) {
+                std::cerr << "Writing the notification log failed, keeping it in memory only" << std::endl;
+                ::close(fd);
+                fd = -1;
+            } else if (++on_disk > 2 * capacity && !rewrite()) { // drops what fell out of the window
+                on_disk = 0; // keep appending to the old file, try again later
+            }
+            dirty = true;
+        }
+        return notif.seq();
+    }
+
+    // calls fn with every entry past sequence `after`, oldest first; caller holds mu
+    // False, without any call, when the log can't account for everything since then
+    bool replay(uint64_t epoch, uint64_t after, const std::function<void(const Entry&)>& fn) const {
+        if (epoch != epoch_ || after > head()) return false;
+        uint64_t first = log.empty() ? next_seq : log.front().notif.seq();
+        if (after + 1 < first) return false; // some of them already fell out of the window
+        for (const Entry& entry : log) {
+            if (entry.notif.seq() > after) fn(entry);
+        }
+        return true;
+    }
+
+    uint64_t epoch() const { return epoch_; }
+    // the last sequence number handed out; caller holds mu
+    uint64_t head() const { return next_seq - 1; }
+
+    // makes the entries appended so far durable, called periodically rather than on every append
+    void sync() {
+        int copy = -1;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (!dirty || fd < 0) return;
+            dirty = false;
+            copy = ::dup(fd);
+        }
+        if (copy < 0) return;
+        ::fdatasync(copy);
+        ::close(copy);
+    }
+
+private:
+    static constexpr char kMagic[8] = {'A', 'F', 'S', 'L', 'O', 'G', '1', '\n'};
+
+    // file: magic, epoch, then per entry the lengths of the notification and the origin followed by both
+    static bool write_entry(int out, const Entry& entry) {
+        std::string record(8, '\0');
+        uint32_t lengths[2] = {static_cast<uint32_t>(entry.notif.ByteSizeLong()), static_cast<uint32_t>(entry.origin.size())};
+        memcpy(&record[0], lengths, sizeof(lengths));
+        entry.notif.AppendToString(&record);
+        record += entry.origin;
+        return write_all(out, record.data(), record.size());
+    }
+
+    static bool write_all(int out, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(out, data, len);
+            if (n <= 0) return false;
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    // reads the file back into the window; a missing file starts a new log, a torn last entry is dropped
+    bool load() {
+        FILE* in = fopen(path.c_str(), "rb");
+        if (!in) return true;
+        char magic[8];
+        uint64_t epoch;
+        bool ok = fread(magic, 1, 8, in) == 8 && memcmp(magic, kMagic, 8) == 0 && fread(&epoch, 8, 1, in) == 1 && epoch != 0;
+        if (ok) {
+            epoch_ = epoch;
+            uint32_t lengths[2];
+            std::string buffer;
+            while (fread(lengths, sizeof(lengths), 1, in) == 1 && lengths[0] < (64u << 20) && lengths[1] < 4096) {
+                buffer.resize(static_cast<size_t>(lengths[0]) + lengths[1]);
+                if (!buffer.empty() && fread(&buffer[0], 1, buffer.size(), in) != buffer.size()) break;
+                Entry entry;
+                if (!entry.notif.ParseFromArray(buffer.data(), static_cast<int>(lengths[0])) || entry.notif.seq() < next_seq) break;
+                entry.origin = buffer.substr(lengths[0]);
+                next_seq = entry.notif.seq() + 1;
+                log.push_back(std::move(entry));
+                if (log.size() > capacity) log.pop_front();
+            }
+        }
+        fclose(in);
+        return ok;
+    }
+
+    // writes the window to a new file and switches to appending to it
+    bool rewrite() {
+        std::string temp = path + ".tmp";
+        int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) return false;
+        bool ok = write_all(out, kMagic, sizeof(kMagic)) && write_all(out, reinterpret_cast<const char*>(&epoch_), sizeof(epoch_));
+        for (const Entry& entry : log) ok = ok && write_entry(out, entry);
+        ok = ok && ::fdatasync(out) == 0 && ::rename(temp.c_str(), path.c_str()) == 0;
+        if (!ok) {
+            ::close(out);
+            ::unlink(temp.c_str());
+            return false;
+        }
+        if (fd >= 0) ::close(fd);
+        fd = out; // still positioned at the end
+        on_disk = log.size();
+        return true;
+    }
+
+    size_t capacity = 65536;
+    std::deque<Entry> log;
+    uint64_t next_seq = 1;
+    uint64_t epoch_;
+    std::string path;
+    int fd = -1;
+    size_t on_disk = 0;  // entries in the file, it is rewritten from the window once it holds twice as many
+    bool dirty = false;  // appended since the last sync()
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef COMPRESSED_CACHE_HPP
+#define COMPRESSED_CACHE_HPP
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Compressed copies of hot files, so that a file opened over and over is not compressed again on every open
+// A file becomes hot on its second open of the same version; that transfer records the chunks it sends and later
+// opens replay them. Entries are keyed by version, a new version simply misses and the old one ages out (LRU).
+
+struct CompressedChunk {
+    std::string data;    // as it goes on the wire
+    int32_t codec;       // what data is compressed with, 0 when it did not shrink and is sent as is
+    uint32_t length;     // bytes of the file in this chunk
+};
+
+struct CompressedFile {
+    std::vector<CompressedChunk> chunks;
+    size_t bytes = 0;
+};
+
+class CompressedCache {
+public:
+    static const int64_t kMaxFile = 64 * 1024 * 1024; // bigger files are streamed, never held in memory whole
+    static const int kHotOpens = 2;
+
+    explicit CompressedCache(size_t max_bytes = 256 * 1024 * 1024) : max_bytes(max_bytes) {}
+
+    static std::string key(const std::string& path, int64_t version, int32_t codec, size_t chunk_size) {
+        return path + '\0' + std::to_string(version) + '\0' + std::to_string(codec) + '\0' + std::to_string(chunk_size);
+    }
+
+    std::shared_ptr<const CompressedFile> find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto it = entries.find(key);
+        if (it == entries.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second.position);
+        return it->second.file;
+    }
+
+    // counts an open of key and tells whether the file is now hot enough to be worth recording
+    bool note_open(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (open_counts.size() > kMaxTracked) open_counts.clear(); // forget cold files rather than grow without bound
+        return ++open_counts[key] >= kHotOpens;
+    }
+
+    void insert(const std::string& key, std::shared_ptr<const CompressedFile> file) {
+        if (file->bytes > max_bytes) return;
+        std::lock_guard<std::mutex> lock(mu);
+        if (entries.count(key)) return;
+        lru.push_front(key);
+        entries[key] = Entry{file, lru.begin()};
+        total_bytes += file->bytes;
+        while (total_bytes > max_bytes && !lru.empty()) {
+            auto victim = entries.find(lru.back());
+            total_bytes -= victim->second.file->bytes;
+            entries.erase(victim);
+            lru.pop_back();
+        }
+    }
+
+private:
+    static const size_t kMaxTracked = 4096;
+
+    struct Entry {
+        std::shared_ptr<const CompressedFile> file;
+        std::list<std::string>::iterator position;
+    };
+
+    std::mutex mu;
+    size_t max_bytes;
+    size_t total_bytes = 0;
+    std::list<std::string> lru; // most recently used first
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<std::string, int> open_counts;
+};
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef DEDUP_STORAGE_HPP
+#define DEDUP_STORAGE_HPP
+
+#include "storage.hpp"
+#include "delta_sync.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <time.h>
+
+// Content defined chunking: a cut is placed wherever a rolling (gear) hash of the last bytes hits a pattern, so
+// chunk boundaries follow the content instead of fixed offsets. An insert early in a file only changes the chunks
+// around it and everything after it still dedups against the old version.
+// Normalized chunking (FastCDC): a stricter mask before the average size and a looser one after it keeps most
+// chunks close to kAvg, kMin and kMax bound the rest.
+namespace cdc {
+
+const size_t kMin = 16 * 1024;
+const size_t kAvg = 64 * 1024;
+const size_t kMax = 256 * 1024;
+
+// a mask of bits set bits spread over the top of the hash; a gear hash's high bits depend on the most input bytes
+inline uint64_t spread_mask(int bits) {
+    uint64_t mask = 0;
+    for (int i = 0; i < bits; i++) mask |= 1ULL << (63 - i * 48 / bits);
+    return mask;
+}
+
+inline const uint64_t* gear() {
+    static const std::vector<uint64_t> table = [] {
+        std::vector<uint64_t> values(256);
+        uint64_t state = 0x9E3779B97F4A7C15ULL; // splitmix64, fixed so that every server cuts the same way
+        for (uint64_t& value : values) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            value = z ^ (z >> 31);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+// length of the chunk that starts at data; len must be at least kMax unless data runs to the end of the file
+inline size_t cut(const char* data, size_t len) {
+    if (len <= kMin) return len;
+    static const uint64_t mask_small = spread_mask(18); // log2(kAvg) + 2 bits, boundaries are rare below kAvg
+    static const uint64_t mask_large = spread_mask(14); // log2(kAvg) - 2 bits, and likely above it
+    const uint64_t* table = gear();
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    size_t limit = std::min(len, kMax);
+    size_t normal = std::min(limit, kAvg);
+    uint64_t hash = 0;
+    size_t i = kMin;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + table[bytes[i]];
+        if (!(hash & mask_small)) return i + 1;
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + table[bytes[i]];
+        if (!(hash & mask_large)) return i + 1;
+    }
+    return limit;
+}
+
+// splits a stream fed in arbitrary pieces into the same chunks cut() finds on the whole file
+class Chunker {
+public:
+    using Emit = std::function<bool(const char*, size_t)>;
+
+    explicit Chunker(Emit emit) : emit(std::move(emit)) {}
+
+    bool feed(const char* data, size_t len) {
+        pending.insert(pending.end(), data, data + len);
+        while (pending.size() - begin >= kMax) {
+            if (!emit_one()) return false;
+        }
+        if (begin > pending.size() / 2) { // drop what has been emitted once it is the bigger half
+            pending.erase(pending.begin(), pending.begin() + begin);
+            begin = 0;
+        }
+        return true;
+    }
+
+    bool finish() {
+        while (begin < pending.size()) {
+            if (!emit_one()) return false;
+        }
+        pending.clear();
+        begin = 0;
+        return true;
+    }
+
+private:
+    bool emit_one() {
+        size_t n = cut(pending.data() + begin, pending.size() - begin);
+        bool ok = emit(pending.data() + begin, n);
+        begin += n;
+        return ok;
+    }
+
+    Emit emit;
+    std::vector<char> pending;
+    size_t begin = 0;
+};
+
+} // namespace cdc
+
+// Deduplicating backend: files are split into content defined chunks and every distinct chunk is stored once,
+// named by its SHA-256, under state_dir/chunks. A file under root_dir becomes a sparse placeholder with the right
+// size, mode and mtime, and state_dir/manifests/<device>_<inode> lists its chunks. The manifest is keyed by inode so
+// that rename needs no bookkeeping, and it records the size and mtime it was written for, so a placeholder that
+// changed behind our back (or a recycled inode) simply falls back to being read as a plain file.
+// New versions are always built next to the file and renamed over it: readers never see a half written placeholder.
+// Chunks are never deleted here, and neither are the manifests of files replaced or removed without going through the
+// backend (a delta close renames over the old file, unlink); reclaiming both is left to an offline sweep.
+class DedupStorage : public Storage {
+public:
+    explicit DedupStorage(const std::string& state_dir)
+        : chunks_dir(state_dir + "/chunks"), manifests_dir(state_dir + "/manifests") {
+        std::filesystem::create_directories(chunks_dir);
+        std::filesystem::create_directories(manifests_dir);
+    }
+
+    const char* name() const override { return "dedup"; }
+
+    std::unique_ptr<StoredFile> open(const std::string& path) override {
+        struct stat s;
+        if (::stat(path.c_str(), &s) != 0 || !S_ISREG(s.st_mode)) return nullptr;
+        Manifest manifest;
+        if (!load_manifest(s, manifest)) return PosixStoredFile::open(path);
+        return std::unique_ptr<StoredFile>(new ChunkedFile(this, std::move(manifest), s));
+    }
+
+    std::unique_ptr<StoredWriter> create(const std::string& path) override {
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+        return std::unique_ptr<StoredWriter>(new Writer(this, path));
+    }
+
+    bool prepare_update(const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mu);
+        struct stat s;
+        if (::stat(path.c_str(), &s) != 0) return true; // nothing to rebuild, the update itself reports the missing file
+        Manifest manifest;
+        if (!load_manifest(s, manifest)) return true; // already a plain file
+        return materialize(path, manifest, s);
+    }
+
+    void ingest(const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mu);
+        struct stat s;
+        if (::stat(path.c_str(), &s) != 0 || !S_ISREG(s.st_mode)) return;
+        Manifest manifest;
+        if (load_manifest(s, manifest)) return; // a full close already stored it
+        std::unique_ptr<StoredFile> file = PosixStoredFile::open(path);
+        if (!file) return;
+        manifest = Manifest();
+        manifest.size = file->size();
+        Counts counts;
+        cdc::Chunker chunker([&](const char* data, size_t len) { return add_chunk(data, len, manifest, counts); });
+        std::vector<char> buffer(4 * 1024 * 1024);
+        int64_t offset = 0;
+        while (offset < manifest.size) {
+            ssize_t n = file->read(buffer.data(), buffer.size(), offset);
+            if (n <= 0 || !chunker.feed(buffer.data(), static_cast<size_t>(n))) {
+                std::cerr << "Failed to take " << path << " into the chunk store, it stays a plain file" << std::endl;
+                return;
+            }
+            offset += n;
+        }
+        if (!chunker.finish() || offset != manifest.size) return;
+        // the stamp of the version that is being published must survive the swap to a placeholder
+        if (install(path, manifest, file->mode(), file->version())) log_stored(path, manifest, counts);
+    }
+
+private:
+    struct ChunkRef {
+        std::string id; // hex SHA-256 of the chunk's bytes
+        uint32_t length;
+    };
+
+    struct Manifest {
+        int64_t size = 0;
+        int64_t version = 0;
+        std::vector<ChunkRef> chunks;
+    };
+
+    struct Counts {
+        size_t new_chunks = 0;
+        int64_t new_bytes = 0;
+    };
+
+    // reads a file back from its manifest, chunk by chunk
+    class ChunkedFile : public StoredFile {
+    public:
+        ChunkedFile(DedupStorage* storage, Manifest manifest, const struct stat& s)
+            : storage(storage), manifest(std::move(manifest)), file_mode(s.st_mode) {
+            int64_t offset = 0;
+            for (const ChunkRef& chunk : this->manifest.chunks) {
+                starts.push_back(offset);
+                offset += chunk.length;
+            }
+        }
+        ~ChunkedFile() override {
+            if (fd >= 0) ::close(fd);
+        }
+
+        int64_t size() const override { return manifest.size; }
+        int64_t version() const override { return manifest.version; }
+        mode_t mode() const override { return file_mode; }
+
+        // reads at most up to the end of the chunk holding offset, callers loop like they do around pread
+        ssize_t read(char* out, size_t len, int64_t offset) override {
+            if (offset >= manifest.size || len == 0) return 0;
+            size_t index = static_cast<size_t>(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1;
+            if (index != open_index) {
+                if (fd >= 0) ::close(fd);
+                fd = ::open(storage->chunk_path(manifest.chunks[index].id).c_str(), O_RDONLY);
+                open_index = fd >= 0 ? index : static_cast<size_t>(-1);
+                if (fd < 0) return -1;
+            }
+            int64_t within = offset - starts[index];
+            size_t want = static_cast<size_t>(std::min<int64_t>(len, manifest.chunks[index].length - within));
+            return pread(fd, out, want, within);
+        }
+
+    private:
+        DedupStorage* storage;
+        Manifest manifest;
+        mode_t file_mode;
+        std::vector<int64_t> starts; // file offset of every chunk
+        size_t open_index = static_cast<size_t>(-1);
+        int fd = -1;
+    };
+
+    // a full close: chunks are stored as the upload streams in, the placeholder swaps in on commit
+    class Writer : public StoredWriter {
+    public:
+        Writer(DedupStorage* storage, const std::string& path)
+            : storage(storage), path(path),
+              chunker([this](const char* data, size_t len) { return this->storage->add_chunk(data, len, manifest, counts); }) {}
+
+        bool write(const char* data, size_t len) override {
+            manifest.size += static_cast<int64_t>(len);
+            return chunker.feed(data, len);
+        }
+
+        bool commit() override {
+            if (!chunker.finish()) return false;
+            std::lock_guard<std::mutex> lock(storage->mu);
+            struct stat s;
+            mode_t mode = ::stat(path.c_str(), &s) == 0 ? s.st_mode : 0644;
+            if (!storage->install(path, manifest, mode, -1)) return false;
+            storage->log_stored(path, manifest, counts);
+            return true;
+        }
+
+    private:
+        DedupStorage* storage;
+        std::string path;
+        Manifest manifest;
+        Counts counts;
+        cdc::Chunker chunker;
+    };
+
+    std::string chunk_path(const std::string& id) const {
+        return chunks_dir + "/" + id.substr(0, 2) + "/" + id;
+    }
+
+    std::string manifest_path(const struct stat& s) const {
+        return manifests_dir + "/" + std::to_string(s.st_dev) + "_" + std::to_string(s.st_ino);
+    }
+
+    static std::string hex(const std::string& digest) {
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : digest) {
+            out.push_back(digits[c >> 4]);
+            out.push_back(digits[c & 15]);
+        }
+        return out;
+    }
+
+    // stores a chunk unless an identical one is already there and appends it to manifest
+    bool add_chunk(const char* data, size_t len, Manifest& manifest, Counts& counts) {
+        delta_sync::Sha256 sha;
+        sha.update(data, len);
+        std::string id = hex(sha.final());
+        manifest.chunks.push_back(ChunkRef{id, static_cast<uint32_t>(len)});
+        std::string target = chunk_path(id);
+        if (::access(target.c_str(), F_OK) == 0) return true;
+
+        std::filesystem::create_directories(std::filesystem::path(target).parent_path());
+        std::string temp = target + ".XXXXXX";
+        std::vector<char> temp_name(temp.begin(), temp.end());
+        temp_name.push_back('\0');
+        int fd = mkstemp(temp_name.data());
+        if (fd < 0) return false;
+        bool ok = true;
+        for (size_t done = 0; ok && done < len;) {
+            ssize_t n = ::write(fd, data + done, len - done);
+            ok = n > 0;
+            if (ok) done += static_cast<size_t>(n);
+        }
+        ok = ::close(fd) == 0 && ok;
+        // two writers racing on the same chunk both rename identical bytes into place, either one wins
+        if (!ok || std::rename(temp_name.data(), target.c_str()) != 0) {
+            ::unlink(temp_name.data());
+            return false;
+        }
+        counts.new_chunks++;
+        counts.new_bytes += static_cast<int64_t>(len);
+        return true;
+    }
+
+    // the manifest of the file s describes, false if there is none or it was written for another version
+    bool load_manifest(const struct stat& s, Manifest& manifest) const {
+        std::ifstream in(manifest_path(s));
+        std::string magic;
+        if (!(in >> magic >> manifest.size >> manifest.version) || magic != "afs-manifest") return false;
+        if (manifest.size != s.st_size || manifest.version != stat_timestamp(s)) return false;
+        ChunkRef chunk;
+        int64_t total = 0;
+        while (in >> chunk.id >> chunk.length) {
+            manifest.chunks.push_back(chunk);
+            total += chunk.length;
+        }
+        return total == manifest.size;
+    }
+
+    // builds the placeholder for manifest next to path, records the manifest and renames the placeholder over path
+    // version < 0 stamps the new version with the current time, like writing the file would
+    bool install(const std::string& path, Manifest& manifest, mode_t mode, int64_t version) {
+        std::filesystem::path file_path(path);
+        std::string temp = (file_path.parent_path() / ("." + file_path.filename().string() + ".afs_chunks.XXXXXX")).string();
+        std::vector<char> temp_name(temp.begin(), temp.end());
+        temp_name.push_back('\0');
+        int fd = mkstemp(temp_name.data());
+        if (fd < 0) return false;
+
+        struct timespec times[2];
+        if (version < 0) {
+            clock_gettime(CLOCK_REALTIME, &times[1]);
+        } else {
+            times[1].tv_sec = version / 1000000000LL;
+            times[1].tv_nsec = version % 1000000000LL;
+        }
+        times[0] = times[1];
+        struct stat placeholder;
+        bool ok = ftruncate(fd, manifest.size) == 0 && fchmod(fd, mode & 07777) == 0 && futimens(fd, times) == 0 &&
+                  fstat(fd, &placeholder) == 0;
+        ::close(fd);
+        if (ok) {
+            manifest.version = stat_timestamp(placeholder); // as the file system stored it
+            ok = write_manifest(manifest_path(placeholder), manifest);
+        }
+        struct stat old;
+        bool had_old = ::stat(path.c_str(), &old) == 0;
+        if (!ok || std::rename(temp_name.data(), path.c_str()) != 0) {
+            ::unlink(temp_name.data());
+            if (ok) ::unlink(manifest_path(placeholder).c_str());
+            std::cerr << "Failed to store " << path << " in the chunk store" << std::endl;
+            return false;
+        }
+        if (had_old) ::unlink(manifest_path(old).c_str());
+        return true;
+    }
+
+    bool write_manifest(const std::string& target, const Manifest& manifest) {
+        std::string temp = target + ".tmp";
+        {
+            std::ofstream out(temp, std::ios::trunc);
+            out << "afs-manifest " << manifest.size << " " << manifest.version << "\n";
+            for (const ChunkRef& chunk : manifest.chunks) out << chunk.id << " " << chunk.length << "\n";
+            out.flush();
+            if (!out) return false;
+        }
+        return std::rename(temp.c_str(), target.c_str()) == 0;
+    }
+
+    // turns a placeholder back into a plain file holding its bytes, same version stamp
+    bool materialize(const std::string& path, const Manifest& manifest, const struct stat& s) {
+        std::filesystem::path file_path(path);
+        std::string temp = (file_path.parent_path() / ("." + file_path.filename().string() + ".afs_plain.XXXXXX")).string();
+        std::vector<char> temp_name(temp.begin(), temp.end());
+        temp_name.push_back('\0');
+        int fd = mkstemp(temp_name.data());
+        if (fd < 0) return false;
+
+        ChunkedFile source(this, manifest, s);
+        std::vector<char> buffer(cdc::kMax);
+        bool ok = true;
+        for (int64_t offset = 0; ok && offset < manifest.size;) {
+            ssize_t n = source.read(buffer.data(), buffer.size(), offset);
+            ok = n > 0;
+            for (ssize_t done = 0; ok && done < n;) {
+                ssize_t w = ::write(fd, buffer.data() + done, static_cast<size_t>(n - done));
+                ok = w > 0;
+                done += w;
+            }
+            offset += n;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = manifest.version / 1000000000LL;
+        times[0].tv_nsec = manifest.version % 1000000000LL;
+        times[1] = times[0];
+        ok = ok && fchmod(fd, s.st_mode & 07777) == 0 && futimens(fd, times) == 0;
+        ::close(fd);
+        if (!ok || std::rename(temp_name.data(), path.c_str()) != 0) {
+            ::unlink(temp_name.data());
+            std::cerr << "Failed to rebuild " << path << " from the chunk store" << std::endl;
+            return false;
+        }
+        ::unlink(manifest_path(s).c_str());
+        std::cout << "[SERVER] Rebuilt " << path << " from " << manifest.chunks.size() << " chunks for an in place update" << std::endl;
+        return true;
+    }
+
+    void log_stored(const std::string& path, const Manifest& manifest, const Counts& counts) {
+        std::cout << "[SERVER] Stored " << path << ": " << manifest.size << " bytes in " << manifest.chunks.size()
+                  << " chunks, " << counts.new_chunks << " new (" << counts.new_bytes << " bytes)" << std::endl;
+    }
+
+    std::string chunks_dir;
+    std::string manifests_dir;
+    std::mutex mu; // one placeholder swap at a time
+};
+
+#endif
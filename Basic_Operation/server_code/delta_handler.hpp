@@ -0,0 +1,312 @@
+#ifndef DELTA_HANDLER_HPP
+#define DELTA_HANDLER_HPP
+
+#include "filesystem_server.hpp"
+#include "async_call_data.hpp"
+#include "delta_sync.hpp"
+#include <iostream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+// signatures streams the block signatures of the server's current version of a file, the first half of a delta close
+// The file is hashed a slice at a time, one slice per completed write, so a huge file never holds a thread for long
+class SignatureCallData : public CallData {
+public:
+    SignatureCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), writer(&ctx) {
+        service->Requestsignatures(&ctx, &request, &writer, cq, cq, &request_tag);
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new SignatureCallData(fs, service, cq);
+                Start();
+                break;
+            }
+            case WRITE: {
+                if (!ok) {
+                    std::cerr << "Error: Failed to send signatures" << std::endl;
+                    writer.Finish(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to send signatures."), &finish_tag);
+                    return;
+                }
+                SendNext();
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, WRITE, FINISH };
+    static const size_t kBytesPerMessage = 4 * 1024 * 1024; // file bytes hashed per message
+
+    void Start() {
+        std::string directory = request.directory();
+        path = directory + (directory.back()=='/'? "" : "/") + request.filename();
+        file = fs->storage->open(path);
+        if (!file) {
+            std::cerr << "file: " << path << " not found for signatures" << std::endl;
+            writer.Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found on the server."), &finish_tag);
+            return;
+        }
+        file_size = file->size();
+        timestamp = file->version();
+        block_size = delta_sync::choose_block_size(file_size);
+        buffer.resize(std::max(block_size, kBytesPerMessage / block_size * block_size));
+        std::cout << "Signing " << path << ": " << file_size << " bytes in blocks of " << block_size << std::endl;
+        SendNext();
+    }
+
+    void SendNext() {
+        if (offset >= file_size && header_sent) {
+            writer.Finish(grpc::Status::OK, &finish_tag);
+            return;
+        }
+        afs_operation::SignatureResponse response;
+        if (!header_sent) {
+            response.set_timestamp(timestamp);
+            response.set_block_size(static_cast<int32_t>(block_size));
+            response.set_file_size(file_size);
+            header_sent = true;
+        }
+        size_t want = static_cast<size_t>(std::min<int64_t>(buffer.size(), file_size - offset));
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = file->read(buffer.data() + got, want - got, offset + got);
+            if (n <= 0) break;
+            got += static_cast<size_t>(n);
+        }
+        if (got < want) { // the file changed underneath us, the delta would be built against a moving target
+            writer.Finish(grpc::Status(grpc::StatusCode::ABORTED, "File changed while computing signatures."), &finish_tag);
+            return;
+        }
+        for (size_t at = 0; at < got; at += block_size) {
+            delta_sync::BlockSignature block = delta_sync::sign_block(buffer.data() + at, std::min(block_size, got - at));
+            afs_operation::BlockSignature* sig = response.add_blocks();
+            sig->set_weak(block.weak);
+            sig->set_strong(block.strong);
+        }
+        offset += got;
+        writer.Write(response, &write_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    afs_operation::SignatureRequest request;
+    grpc::ServerAsyncWriter<afs_operation::SignatureResponse> writer;
+    std::string path;
+    std::unique_ptr<StoredFile> file;
+    int64_t file_size = 0;
+    int64_t offset = 0;
+    int64_t timestamp = 0;
+    size_t block_size = delta_sync::kMinBlock;
+    bool header_sent = false;
+    std::vector<char> buffer;
+    CallTag request_tag{this, REQUEST};
+    CallTag write_tag{this, WRITE};
+    CallTag finish_tag{this, FINISH};
+};
+
+
+// close_delta rebuilds the client's new version from literal bytes and blocks of the version the server already has
+// The result goes to a temporary file next to the original and only replaces it (rename) once its SHA-256 checks out,
+// so readers never see a half applied delta. The notification goes out after the rename, exactly like a full close.
+class DeltaCallData : public CallData {
+public:
+    DeltaCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), reader(&ctx) {
+        service->Requestclose_delta(&ctx, &reader, cq, cq, &request_tag);
+    }
+
+    ~DeltaCallData() {
+        if (out_fd >= 0) ::close(out_fd);
+        if (!temp_path.empty()) ::unlink(temp_path.c_str()); // only still set if the delta was not applied
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new DeltaCallData(fs, service, cq);
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case READ: {
+                if (!ok) { // the client called WritesDone, every op has arrived
+                    Complete();
+                    return;
+                }
+                grpc::Status status = path.empty() ? Begin() : grpc::Status::OK;
+                if (status.ok()) status = Apply();
+                if (!status.ok()) {
+                    std::cerr << "Delta close of " << path << " failed: " << status.error_message() << std::endl;
+                    reader.FinishWithError(status, &finish_tag);
+                    return;
+                }
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, READ, FINISH };
+
+    // the first message names the file and the base version the delta was computed against
+    grpc::Status Begin() {
+        filename = request.filename();
+        std::string directory = request.directory();
+        path = directory + (directory.back()=='/'? "" : "/") + filename;
+        client_id = request.client_id();
+        base_timestamp = request.base_timestamp();
+        block_size = request.block_size();
+        file_size = request.file_size();
+        expected_sha = request.sha256();
+        std::cout << "[SERVER] close_delta() called for " << path << std::endl;
+
+        base = fs->storage->open(path);
+        if (!base) {
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "Base version not found on the server.");
+        }
+        if (base->version() != base_timestamp || block_size <= 0) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version changed, send the whole file.");
+        }
+        base_size = base->size();
+        base_mode = base->mode();
+
+        std::filesystem::path file_path(path);
+        std::string temp = (file_path.parent_path() / ("." + filename + ".afs_delta.XXXXXX")).string();
+        std::vector<char> temp_name(temp.begin(), temp.end());
+        temp_name.push_back('\0');
+        out_fd = mkstemp(temp_name.data());
+        if (out_fd < 0) {
+            return grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "cant open file to write");
+        }
+        temp_path = temp_name.data();
+        return grpc::Status::OK;
+    }
+
+    grpc::Status Apply() {
+        for (const afs_operation::DeltaOp& op : request.ops()) {
+            if (!op.literal().empty()) {
+                if (!Write(op.literal().data(), op.literal().size())) {
+                    return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write the new version.");
+                }
+                literal_bytes += op.literal().size();
+                continue;
+            }
+            // checked against the block count before any multiplication, hostile indices would overflow it
+            int64_t blocks = base_size / block_size + (base_size % block_size != 0);
+            if (op.block_index() < 0 || op.block_count() <= 0 || op.block_index() >= blocks) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Block reference outside the base version.");
+            }
+            int64_t offset = op.block_index() * block_size;
+            int64_t end = op.block_count() >= blocks - op.block_index() ? base_size : offset + op.block_count() * block_size;
+            if (scratch.empty()) scratch.resize(1024 * 1024);
+            while (offset < end) {
+                size_t want = static_cast<size_t>(std::min<int64_t>(scratch.size(), end - offset));
+                ssize_t n = base->read(scratch.data(), want, offset);
+                if (n <= 0 || !Write(scratch.data(), static_cast<size_t>(n))) {
+                    return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to copy from the base version.");
+                }
+                offset += n;
+                copied_bytes += n;
+            }
+        }
+        return grpc::Status::OK;
+    }
+
+    bool Write(const char* data, size_t len) {
+        sha.update(data, len);
+        written += len;
+        while (len > 0) {
+            ssize_t n = ::write(out_fd, data, len);
+            if (n <= 0) return false;
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void Complete() {
+        std::cout << "delta close is in progress" << std::endl;
+        if (path.empty()) {
+            std::cerr << "Delta close received no data." << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No file data received."), &finish_tag);
+            return;
+        }
+        if (written != file_size || sha.final() != expected_sha) {
+            std::cerr << "Rebuilt " << path << " does not match the client's version" << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::DATA_LOSS, "Rebuilt file does not match."), &finish_tag);
+            return;
+        }
+        fchmod(out_fd, base_mode & 07777);
+        ::close(out_fd);
+        out_fd = -1;
+        {
+            // someone else may have closed the file while we were rebuilding, their version must not be lost silently
+            std::lock_guard<std::mutex> commit(fs->commit_lock(path));
+            if (get_file_timestamp(path) != base_timestamp) {
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version changed, send the whole file."), &finish_tag);
+                return;
+            }
+            if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to replace the file."), &finish_tag);
+                return;
+            }
+            temp_path.clear();
+            std::cout << "[SERVER] Rebuilt " << path << ": " << literal_bytes << " literal bytes, "
+                      << copied_bytes << " bytes reused from the old version" << std::endl;
+            response.set_timestamp(fs->publish_close(path, client_id));
+        }
+        reader.Finish(response, grpc::Status::OK, &finish_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    grpc::ServerAsyncReader<afs_operation::FileResponse, afs_operation::DeltaRequest> reader;
+    afs_operation::DeltaRequest request;
+    afs_operation::FileResponse response;
+    std::string filename;
+    std::string path;
+    std::string temp_path;
+    std::string client_id;
+    std::string expected_sha;
+    int64_t base_timestamp = 0;
+    int64_t block_size = 0;
+    int64_t file_size = 0;
+    int64_t base_size = 0;
+    mode_t base_mode = 0644;
+    std::unique_ptr<StoredFile> base; // the version the delta was computed against
+    int out_fd = -1;
+    int64_t written = 0;
+    int64_t literal_bytes = 0;
+    int64_t copied_bytes = 0;
+    delta_sync::Sha256 sha;
+    std::vector<char> scratch;
+    CallTag request_tag{this, REQUEST};
+    CallTag read_tag{this, READ};
+    CallTag finish_tag{this, FINISH};
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef FANOUT_DISPATCHER_HPP
+#define FANOUT_DISPATCHER_HPP
+
+#include "interest_registry.hpp"
+#include "afs_operation.pb.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Delivers notifications to the subscriber queues off the RPC thread
+// A close, rename or unlink only enqueues an event (the holders snapshot, who caused it, the notification) and
+// returns. A pool of lanes pushes it into the subscriber queues in parallel: every client belongs to exactly one lane
+// (its id modulo the lane count) and each lane works through its events in order, so a client still receives the
+// notifications of one path in the order they were published. Small events only wake the lanes that own one of
+// their clients, large ones are walked by every lane, each picking out its own clients.
+class FanoutDispatcher {
+public:
+    struct Event {
+        InterestRegistry::Snapshot clients;
+        std::string origin; // the client that caused it, it is not notified
+        afs_operation::Notification notif;
+        std::chrono::steady_clock::time_point enqueued;
+        std::atomic<size_t> remaining{0}; // lanes still delivering it
+    };
+
+    // pushes event to the clients of lane (out of lanes) and returns how many queues it reached
+    using Deliver = std::function<size_t(const Event& event, size_t lane, size_t lanes)>;
+
+    struct Metrics {
+        uint64_t events = 0;      // fully delivered
+        uint64_t pending = 0;     // enqueued and not yet fully delivered
+        uint64_t deliveries = 0;  // subscriber queues reached
+        int64_t last_us = 0;      // enqueue to last delivery of the most recent event
+        int64_t avg_us = 0;
+        int64_t max_us = 0;
+    };
+
+    ~FanoutDispatcher() { stop(); }
+
+    // with no lanes events are delivered on the caller's thread, as close() used to
+    void start(size_t lane_count, Deliver deliver_fn) {
+        deliver = std::move(deliver_fn);
+        for (size_t i = 0; i < lane_count; i++) lanes.emplace_back(new Lane());
+        for (size_t i = 0; i < lane_count; i++) lanes[i]->worker = std::thread(&FanoutDispatcher::Run, this, i);
+    }
+
+    // delivers what is still queued and joins the lanes
+    void stop() {
+        for (auto& lane : lanes) {
+            std::lock_guard<std::mutex> lock(lane->mu);
+            lane->stopping = true;
+            lane->cv.notify_one();
+        }
+        for (auto& lane : lanes) {
+            if (lane->worker.joinable()) lane->worker.join();
+        }
+        lanes.clear();
+    }
+
+    void submit(InterestRegistry::Snapshot clients, const std::string& origin, const afs_operation::Notification& notif) {
+        if (!clients || clients->empty() || !deliver) return;
+        auto event = std::make_shared<Event>();
+        event->clients = std::move(clients);
+        event->origin = origin;
+        event->notif = notif;
+        event->enqueued = std::chrono::steady_clock::now();
+        pending++;
+        if (lanes.empty()) {
+            deliveries += deliver(*event, 0, 1);
+            finished(*event);
+            return;
+        }
+
+        std::vector<size_t> targets;
+        if (event->clients->size() < lanes.size() * 2) {
+            for (InterestRegistry::ClientId id : *event->clients) {
+                size_t lane = id % lanes.size();
+                if (std::find(targets.begin(), targets.end(), lane) == targets.end()) targets.push_back(lane);
+            }
+        } else {
+            for (size_t lane = 0; lane < lanes.size(); lane++) targets.push_back(lane);
+        }
+        event->remaining = targets.size();
+        for (size_t lane : targets) {
+            std::lock_guard<std::mutex> lock(lanes[lane]->mu);
+            lanes[lane]->queue.push_back(event);
+            lanes[lane]->cv.notify_one();
+        }
+    }
+
+    Metrics metrics() const {
+        Metrics m;
+        m.events = events;
+        m.pending = pending;
+        m.deliveries = deliveries;
+        m.last_us = last_ns / 1000;
+        m.avg_us = m.events ? static_cast<int64_t>(total_ns / m.events / 1000) : 0;
+        m.max_us = max_ns / 1000;
+        return m;
+    }
+
+private:
+    struct Lane {
+        std::mutex mu;
+        std::condition_variable cv;
+        std::deque<std::shared_ptr<Event>> queue;
+        bool stopping = false;
+        std::thread worker;
+    };
+
+    void Run(size_t index) {
+        Lane& lane = *lanes[index];
+        size_t lane_count = lanes.size();
+        while (true) {
+            std::shared_ptr<Event> event;
+            {
+                std::unique_lock<std::mutex> lock(lane.mu);
+                lane.cv.wait(lock, [&] { return lane.stopping || !lane.queue.empty(); });
+                if (lane.queue.empty()) return; // stopping and drained
+                event = std::move(lane.queue.front());
+                lane.queue.pop_front();
+            }
+            deliveries += deliver(*event, index, lane_count);
+            if (--event->remaining == 0) finished(*event);
+        }
+    }
+
+    void finished(const Event& event) {
+        int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - event.enqueued).count();
+        last_ns = ns;
+        total_ns += static_cast<uint64_t>(ns);
+        int64_t seen = max_ns;
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns)) {}
+        events++;
+        pending--;
+    }
+
+    Deliver deliver;
+    std::vector<std::unique_ptr<Lane>> lanes;
+    std::atomic<uint64_t> events{0};
+    std::atomic<uint64_t> pending{0};
+    std::atomic<uint64_t> deliveries{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<int64_t> last_ns{0};
+    std::atomic<int64_t> max_ns{0};
+};
+
+#endif
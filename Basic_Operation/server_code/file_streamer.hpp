@@ -0,0 +1,289 @@
+#ifndef FILE_STREAMER_HPP
+#define FILE_STREAMER_HPP
+
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/slice.h>
+#include "chunk_codec.hpp"
+#include "compressed_cache.hpp"
+#include "storage.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+// Streaming engine behind open(): file bytes are read straight into pooled buffers and those buffers are
+// handed to gRPC as slices, so a chunk is never copied into a protobuf std::string on its way out.
+// Compressed chunks are written into a second pooled buffer and go out the same way.
+
+// A pooled buffer is a small header followed by `capacity` bytes of payload in the same allocation
+struct PooledBuffer {
+    class BufferPool* pool;
+    size_t capacity;
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
+// Recycles chunk buffers between transfers. Buffers are bucketed by power of two capacity and the pool
+// keeps at most max_pooled_bytes around, anything beyond that goes back to the allocator.
+class BufferPool {
+public:
+    explicit BufferPool(size_t max_pooled_bytes = 64 * 1024 * 1024) : max_pooled_bytes(max_pooled_bytes) {}
+
+    ~BufferPool() {
+        for (auto& [capacity, buffers] : free_lists) {
+            for (PooledBuffer* buffer : buffers) ::operator delete(buffer);
+        }
+    }
+
+    PooledBuffer* acquire(size_t size) {
+        size_t capacity = 4096;
+        while (capacity < size) capacity *= 2;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            auto it = free_lists.find(capacity);
+            if (it != free_lists.end() && !it->second.empty()) {
+                PooledBuffer* buffer = it->second.back();
+                it->second.pop_back();
+                pooled_bytes -= capacity;
+                return buffer;
+            }
+        }
+        PooledBuffer* buffer = static_cast<PooledBuffer*>(::operator new(sizeof(PooledBuffer) + capacity));
+        buffer->pool = this;
+        buffer->capacity = capacity;
+        return buffer;
+    }
+
+    void release(PooledBuffer* buffer) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (pooled_bytes + buffer->capacity <= max_pooled_bytes) {
+                free_lists[buffer->capacity].push_back(buffer);
+                pooled_bytes += buffer->capacity;
+                return;
+            }
+        }
+        ::operator delete(buffer);
+    }
+
+    // gRPC calls this once it no longer needs the slice, which may be on any thread
+    static void release_slice(void* user_data) {
+        PooledBuffer* buffer = static_cast<PooledBuffer*>(user_data);
+        buffer->pool->release(buffer);
+    }
+
+private:
+    std::mutex mu;
+    std::unordered_map<size_t, std::vector<PooledBuffer*>> free_lists;
+    size_t pooled_bytes = 0;
+    size_t max_pooled_bytes;
+};
+
+namespace file_streamer {
+
+const size_t kMinChunk = 64 * 1024;                 // below this the per message overhead dominates
+const size_t kMaxChunk = 4 * 1024 * 1024;           // keeps a single write's latency and memory bounded
+const size_t kDefaultMessageLimit = 4 * 1024 * 1024; // gRPC's default receive limit, used when the client doesn't say
+const size_t kEnvelope = 64;                         // room for the FileResponse fields around the content
+const int64_t kTargetMessages = 8;                   // aim for enough messages to keep the stream pipelined
+
+// Picks the chunk size for a transfer from the file size and the largest message the client accepts:
+// small files go out as one right sized message, large files in the biggest power of two chunk that fits
+inline size_t choose_chunk_size(int64_t file_size, int64_t max_message_size) {
+    size_t limit = max_message_size > 0 ? static_cast<size_t>(max_message_size) : kDefaultMessageLimit;
+    limit = std::min(limit > kEnvelope ? limit - kEnvelope : 1, kMaxChunk);
+    if (limit <= kMinChunk) return limit;
+
+    size_t chunk = kMinChunk;
+    while (chunk * 2 <= limit && static_cast<int64_t>(chunk) * kTargetMessages < file_size) {
+        chunk *= 2;
+    }
+    if (file_size > 0 && static_cast<int64_t>(chunk) > file_size) {
+        chunk = static_cast<size_t>(file_size);
+    }
+    return chunk;
+}
+
+inline size_t put_varint(uint8_t* out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+// Wire encoding of a FileResponse{content, length, timestamp, update_bit, file_size, codec} around a content slice of
+// content_len bytes that stands for length bytes of the file (they differ when the content is compressed). The slice
+// points into a pooled buffer or a cached compressed copy and lets go of it when gRPC is done with it.
+inline grpc::ByteBuffer encode_file_response(const grpc::Slice& content, size_t content_len, size_t length, int64_t timestamp,
+                                             int32_t update_bit, int32_t codec = 0, int64_t file_size = 0) {
+    uint8_t header[11];
+    size_t header_len = 0;
+    header[header_len++] = (1 << 3) | 2; // field 1 (content), length delimited
+    header_len += put_varint(header + header_len, content_len);
+
+    uint8_t trailer[48];
+    size_t trailer_len = 0;
+    trailer[trailer_len++] = (2 << 3) | 0; // field 2 (length), varint
+    trailer_len += put_varint(trailer + trailer_len, static_cast<uint32_t>(length));
+    trailer[trailer_len++] = (3 << 3) | 0; // field 3 (timestamp), varint
+    trailer_len += put_varint(trailer + trailer_len, static_cast<uint64_t>(timestamp));
+    if (update_bit != 0) { // proto3 leaves zero fields off the wire
+        trailer[trailer_len++] = (4 << 3) | 0; // field 4 (update_bit), varint
+        trailer_len += put_varint(trailer + trailer_len, static_cast<uint32_t>(update_bit));
+    }
+    if (file_size != 0) {
+        trailer[trailer_len++] = (5 << 3) | 0; // field 5 (file_size), varint
+        trailer_len += put_varint(trailer + trailer_len, static_cast<uint64_t>(file_size));
+    }
+    if (codec != 0) {
+        trailer[trailer_len++] = (6 << 3) | 0; // field 6 (codec), varint
+        trailer_len += put_varint(trailer + trailer_len, static_cast<uint32_t>(codec));
+    }
+
+    grpc::Slice slices[3] = {
+        grpc::Slice(header, header_len),
+        content,
+        grpc::Slice(trailer, trailer_len),
+    };
+    return grpc::ByteBuffer(slices, 3);
+}
+
+// a slice into a cached compressed copy holds a reference to it, this drops the reference
+inline void release_cached(void* user_data) {
+    delete static_cast<std::shared_ptr<const CompressedFile>*>(user_data);
+}
+
+} // namespace file_streamer
+
+// Reads one file (or a range of it) sequentially into pooled chunks for an open(), compare() or read_range() stream
+class FileChunkReader {
+public:
+    FileChunkReader(BufferPool& pool) : pool(pool) {}
+
+    // opens the current version of path in storage; size and version stay consistent for the whole transfer
+    bool open(Storage& storage, const std::string& file_path, int64_t max_message_size) {
+        path = file_path;
+        file = storage.open(path);
+        if (!file) return false;
+        file_size = file->size();
+        stop = file_size;
+        timestamp = file->version();
+        chunk_size = file_streamer::choose_chunk_size(file_size, max_message_size);
+        return true;
+    }
+
+    // start the transfer at offset instead of the beginning of the file (tail fetches)
+    void skip_to(int64_t start) { offset = std::min(start, file_size); }
+    // stop the transfer at end instead of the end of the file (ranged reads)
+    void stop_at(int64_t end) { stop = std::min(end, file_size); }
+
+    // compress the chunks with codec (as long as the sample chunk shows it pays off); whole file transfers of hot
+    // files are kept compressed in cache and replayed from there
+    void compress_with(int32_t chosen, CompressedCache* compressed_cache) {
+        codec = chosen;
+        cache = compressed_cache;
+    }
+
+    // fills the next chunk, returns false at the end of the file (or on a read error, see failed())
+    bool next(grpc::ByteBuffer* out, int32_t update_bit = 0) {
+        if (!started) start();
+        if (cached) return replay(out, update_bit);
+        if (offset >= stop) {
+            if (recording && !error) cache->insert(cache_key, recording);
+            recording.reset();
+            return false;
+        }
+        size_t want = static_cast<size_t>(std::min<int64_t>(chunk_size, stop - offset));
+        PooledBuffer* chunk = pool.acquire(want);
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = file->read(chunk->data() + got, want - got, offset + got);
+            if (n <= 0) break; // the file shrank underneath us or a real error, send what we have
+            got += static_cast<size_t>(n);
+        }
+        if (got == 0) {
+            pool.release(chunk);
+            error = true;
+            return false;
+        }
+        offset += got;
+
+        PooledBuffer* payload = chunk;
+        size_t payload_len = got;
+        int32_t used_codec = sampler.active();
+        if (used_codec != chunk_codec::NONE) {
+            size_t capacity = chunk_codec::bound(used_codec, got);
+            PooledBuffer* packed = pool.acquire(capacity);
+            size_t n = sampler.compress(chunk->data(), got, packed->data(), capacity);
+            if (n > 0) {
+                pool.release(chunk);
+                payload = packed;
+                payload_len = n;
+            } else {
+                pool.release(packed);
+                used_codec = chunk_codec::NONE;
+            }
+        }
+        if (recording && sampler.active() == chunk_codec::NONE) {
+            recording.reset(); // the data does not compress, a copy would only cost memory
+        } else if (recording) {
+            recording->chunks.push_back(CompressedChunk{std::string(payload->data(), payload_len), used_codec, static_cast<uint32_t>(got)});
+            recording->bytes += payload_len;
+        }
+        grpc::Slice content(payload->data(), payload_len, &BufferPool::release_slice, payload);
+        *out = file_streamer::encode_file_response(content, payload_len, got, timestamp, update_bit, used_codec, file_size);
+        return true;
+    }
+
+    bool failed() const { return error; }
+    int64_t size() const { return file_size; }
+    size_t chunk() const { return chunk_size; }
+    int64_t version() const { return timestamp; }
+    bool replayed() const { return cached != nullptr; }
+
+private:
+    void start() {
+        started = true;
+        if (codec == chunk_codec::NONE) return;
+        sampler = chunk_codec::Sampler(codec);
+        // only whole file transfers are cached, tails and ranges are compressed as they go
+        if (cache && offset == 0 && stop == file_size && file_size > 0 && file_size <= CompressedCache::kMaxFile) {
+            cache_key = CompressedCache::key(path, timestamp, codec, chunk_size);
+            cached = cache->find(cache_key);
+            if (!cached && cache->note_open(cache_key)) recording = std::make_shared<CompressedFile>();
+        }
+    }
+
+    bool replay(grpc::ByteBuffer* out, int32_t update_bit) {
+        if (replay_index >= cached->chunks.size()) return false;
+        const CompressedChunk& chunk = cached->chunks[replay_index++];
+        auto* reference = new std::shared_ptr<const CompressedFile>(cached);
+        grpc::Slice content(const_cast<char*>(chunk.data.data()), chunk.data.size(), &file_streamer::release_cached, reference);
+        *out = file_streamer::encode_file_response(content, chunk.data.size(), chunk.length, timestamp, update_bit, chunk.codec, file_size);
+        return true;
+    }
+
+    BufferPool& pool;
+    std::string path;
+    std::unique_ptr<StoredFile> file;
+    int64_t file_size = 0;
+    int64_t offset = 0;
+    int64_t stop = 0;
+    int64_t timestamp = 0;
+    size_t chunk_size = file_streamer::kMinChunk;
+    bool error = false;
+    bool started = false;
+    int32_t codec = chunk_codec::NONE;
+    chunk_codec::Sampler sampler;
+    CompressedCache* cache = nullptr;
+    std::string cache_key;
+    std::shared_ptr<const CompressedFile> cached;  // replaying a hot file's compressed copy
+    std::shared_ptr<CompressedFile> recording;     // building one while this transfer goes out
+    size_t replay_index = 0;
+};
+
+#endif
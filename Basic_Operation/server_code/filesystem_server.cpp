@@ -1,5 +1,11 @@
 #include "filesystem_server.hpp" 
 #include "subscriber_handler.hpp"
+#include "delta_handler.hpp"
+#include "range_handler.hpp"
+#include "append_handler.hpp"
+#include "list_dir_handler.hpp"
+#include "walk_handler.hpp"
+#include "dedup_storage.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -14,6 +20,10 @@ int64_t get_file_timestamp(const std::string& path) {
     if (stat(path.c_str(), &s) != 0) {
         return 0; // Or handle error appropriately
     }
+    return stat_timestamp(s);
+}
+
+int64_t stat_timestamp(const struct stat& s) {
     // Combine Seconds + Nanoseconds into a single int64 timestamp
     // This guarantees high precision for 'compare' and perfect alignment with 'getattr'
     #ifdef __APPLE__
@@ -27,51 +37,19 @@ int64_t get_file_timestamp(const std::string& path) {
     return timestamp;
 }
 
-// temperary debug
-void print_unorder(std::unordered_set<std::string> set, std::string path){
-    std::cout << "Current client which registered(close): " << path << ": "; 
-    for (std::string s: set){
-        std::cout << s << ", ";
-    }
-    std::cout << "\n";
-}
 
 void print_notification_queue(const std::string& client_id, std::shared_ptr<NotificationQueue> notif_queue) {
     if (!notif_queue) {
         std::cout << "[DEBUG] Queue for client " << client_id << " is NULL" << std::endl;
         return;
     }
-    
-    std::lock_guard<std::mutex> lock(notif_queue->mu);
-    
+    // the ring can only be read by its consumer, so this reports the counters instead of the content
     std::cout << "========================================" << std::endl;
     std::cout << "[DEBUG] Notification Queue for Client: " << client_id << std::endl;
-    std::cout << "Queue Size: " << notif_queue->queue.size() << std::endl;
+    std::cout << "Queue Size: " << notif_queue->ring.size() << " of " << notif_queue->ring.capacity() << std::endl;
     std::cout << "Shutdown: " << (notif_queue->shutdown ? "true" : "false") << std::endl;
-    std::cout << "----------------------------------------" << std::endl;
-    
-    if (notif_queue->queue.empty()) {
-        std::cout << "  (Queue is empty)" << std::endl;
-    } else {
-        // Create a temporary copy to iterate without destroying original
-        std::queue<afs_operation::Notification> temp_queue = notif_queue->queue;
-        int index = 0;
-        
-        while (!temp_queue.empty()) {
-            const afs_operation::Notification& notif = temp_queue.front();
-            
-            std::cout << "  [" << index << "] Message: " << notif.message() << std::endl;
-            std::cout << "      Directory: " << notif.directory() << std::endl;
-            if (!notif.new_directory().empty()) {
-                std::cout << "      New Directory: " << notif.new_directory() << std::endl;
-            }
-            std::cout << "      Timestamp: " << notif.timestamp() << std::endl;
-            std::cout << "      ---" << std::endl;
-            
-            temp_queue.pop();
-            index++;
-        }
-    }
+    std::cout << "Coalesced: " << notif_queue->coalesced << ", overflows: " << notif_queue->overflows
+              << ", dropped: " << notif_queue->dropped << std::endl;
     std::cout << "========================================" << std::endl;
 }
 
@@ -79,103 +57,122 @@ void print_notification_queue(const std::string& client_id, std::shared_ptr<Noti
 // this is called in close()
 bool FileSystem::file_change_callback_close(const std::string& path, const std::string& client_id, afs_operation::Notification& notif){
     // close() is called
-    {
-        std::cout << "myclose is triggered" << std::endl;
-        std::lock_guard<std::mutex> lock_file_map(file_map_mutex);
-        auto it = file_map.find(path);
-        if (it != file_map.end()){  // we find the path entry in the file_map
-            std::unordered_set<std::string> client_set = it -> second;
-            print_unorder(client_set, path);
-            {
-                std::lock_guard<std::mutex> lock_subscribers(subscriber_mutex);
-                for (const std::string client: client_set){ // iterate through the client_set and update all of them
-                    std::cout << client << std::endl;
-                    if (client == client_id) continue; // skip the client that initiated the rename
-                    auto queue_it = subscribers.find(client);
-
-                    if (queue_it != subscribers.end()) {
-                        // copy the shared_ptr in the queue and then this notif_ptr also owns the object now with this new shared_ptr
-                        std::shared_ptr<NotificationQueue> notif_queue = queue_it->second;
-                        // push to the producer worker queue
-                        std::cout << "myclose is pushed to the queue" << std::endl;
-                        notif_queue->push(notif);
-                        //print_notification_queue(client_id, notif_queue);
-                    }else{
-                        std::cout << "we don't find "<< client << " in subscribers"<< std::endl;
-                    }
-                }
-            }
-        }else{// this may mean that we created the file on the client and we have not registered it on the maps
-            // register this file path and the client id in file_map
-            // NOTE: We already hold file_map_mutex from line 34, so NO nested lock needed
-            file_map[path].insert(client_id); // add the path to the map and add the corresponding client
-        }
+    std::cout << "myclose is triggered" << std::endl;
+    InterestRegistry::Snapshot client_set = interests.interested(path);
+    if (!client_set){
+        // this may mean that we created the file on the client and we have not registered it on the maps
+        interests.add(path, client_id); // add the path to the registry with the corresponding client
+        return true;
     }
+    std::cout << "Notifying the " << client_set->size() << " client(s) that registered " << path << std::endl;
+    notify_clients(client_set, client_id, notif);
     return true;
 }
 
+// logs notif under the next sequence number and hands it to the fan-out stage for every client in client_set except
+// the one that caused it
+void FileSystem::notify_clients(InterestRegistry::Snapshot client_set, const std::string& client_id, const afs_operation::Notification& notif){
+    afs_operation::Notification logged = notif;
+    std::lock_guard<std::mutex> lock(change_log.mu);
+    change_log.append(logged, client_id, client_set);
+    fanout.submit(std::move(client_set), client_id, logged);
+}
 
-bool FileSystem::file_change_callback_rename(const std::string& old_path, const std::string& new_path, const std::string& client_id, afs_operation::Notification& notif){
-    // rename() is called
-    {
-        std::lock_guard<std::mutex> lock_file_map(file_map_mutex);
-        auto it = file_map.find(old_path);
-        if (it != file_map.end()){  // we find the old_path entry in the file_map
-            std::unordered_set<std::string> client_set = it->second;
-            {
-                std::lock_guard<std::mutex> lock_subscribers(subscriber_mutex);
-                for (const std::string& client: client_set){ // iterate through the client_set and update all of them
-                    if (client == client_id) continue; // skip the client that initiated the rename
-                    
-                    // copy the shared_ptr in the queue and then this notif_ptr also owns the object now with this new shared_ptr
-                    auto queue_it = subscribers.find(client);
-                    if (queue_it != subscribers.end()) {
-                        std::shared_ptr<NotificationQueue> notif_queue = queue_it->second;
-                        // push to the producer worker queue
-                        notif_queue->push(notif); 
-                    }
-                }
-            }
-            // Update the file_map: move clients from old_path to new_path
-            file_map[new_path] = client_set;
-            file_map.erase(it);
-        } else {
-            // If old_path is not in the map, just register the new_path with the client
-            std::lock_guard<std::mutex> lock(file_map_mutex);
-            file_map[new_path].insert(client_id);
+// runs on a fan-out lane: pushes the event to the queues of the lane's clients
+size_t FileSystem::deliver_notification(const FanoutDispatcher::Event& event, size_t lane, size_t lanes){
+    size_t reached = 0;
+    std::shared_lock<std::shared_mutex> lock_subscribers(subscriber_mutex);
+    interests.for_each_client(*event.clients, [&](const std::string& client){ // iterate through the client_set and update all of them
+        if (client == event.origin) return; // skip the client that initiated the change
+        auto queue_it = subscribers.find(client);
+        if (queue_it != subscribers.end()) {
+            // push to the producer worker queue
+            queue_it->second->push(event.notif);
+            reached++;
+        }else{
+            std::cout << "we don't find "<< client << " in subscribers"<< std::endl;
         }
+    }, lane, lanes);
+    return reached;
+}
+
+
+// the part of close shared by every upload path, once the new version is in place at path:
+// stamp it, tell every other client that caches it and mark it closed for the closing client
+// An append (old_size >= 0) is announced as NOTIFY_APPEND so that clients holding base_timestamp only fetch the tail
+int64_t FileSystem::publish_close(const std::string& path, const std::string& client_id, int64_t old_size, int64_t base_timestamp){
+    // the storage takes in a version that was put in place as a plain file, keeping its mtime
+    storage->ingest(path);
+    if (metadata) metadata->invalidate(path); // before anyone hears of the new version
+    // Get the new authoritative timestamp generated by the OS after the write
+    struct stat s;
+    bool stated = stat(path.c_str(), &s) == 0;
+    int64_t timestamp_server = stated ? stat_timestamp(s) : 0;
+    if (timestamp_server != 0) detector.record(path, {timestamp_server, s.st_size}); // the watcher will see this write too
+    // without the new size there is no tail to announce, the clients refetch the whole file
+    bool append = old_size >= 0 && stated;
+
+    // generate the Notification object that we are gonna use to pass to all related clients
+    afs_operation::Notification notif;
+    notif.set_directory(path);
+    notif.set_type(append ? afs_operation::NOTIFY_APPEND : afs_operation::NOTIFY_UPDATE);
+    notif.set_timestamp(timestamp_server);
+    if (append) {
+        notif.set_old_size(old_size);
+        notif.set_new_size(s.st_size);
+        notif.set_base_timestamp(base_timestamp);
     }
+    // then we start updating the maps for the specific file
+    std::cout << "[SERVER] Calling file_change_callback_close..." << std::endl;
+    file_change_callback_close(path, client_id, notif);
+    if (names) names->add(path, false);
+    // a new entry, or new attributes for one that the listing clients got along with it
+    directory_changed(path, client_id);
+    std::cout << "[SERVER] Callback complete, returning OK" << std::endl;
+    std::cout.flush();
+
+    // the client keeps the file in its cache but no longer has it open
+    interests.closed(path, client_id);
+    std::cout << path << " is closed by " << client_id << std::endl;
+    return timestamp_server;
+}
+
+
+bool FileSystem::file_change_callback_rename(const std::string& old_path, const std::string& new_path, const std::string& client_id, afs_operation::Notification& notif){
+    // rename() is called: the clients holding old_path now hold new_path, and are told about it
+    // If old_path is not registered, the renaming client is registered for new_path
+    InterestRegistry::Snapshot client_set = interests.move_path(old_path, new_path, client_id);
+    if (client_set) notify_clients(client_set, client_id, notif);
     return true;
 }
 
 bool FileSystem::file_change_callback_unlink(const std::string& path, const std::string& client_id, afs_operation::Notification& notif){
-    // unlink() is called - notify all clients watching this file
-    {
-        std::lock_guard<std::mutex> lock_file_map(file_map_mutex);
-        auto it = file_map.find(path);
-        if (it != file_map.end()){  // we find the path entry in the file_map
-            std::unordered_set<std::string> client_set = it->second;
-            {
-                std::lock_guard<std::mutex> lock_subscribers(subscriber_mutex);
-                for (const std::string& client: client_set){ // iterate through the client_set and update all of them
-                    if (client == client_id) continue; // skip the client that initiated the unlink
-                    
-                    // copy the shared_ptr in the queue and then this notif_ptr also owns the object now with this new shared_ptr
-                    auto queue_it = subscribers.find(client);
-                    if (queue_it != subscribers.end()) {
-                        std::shared_ptr<NotificationQueue> notif_queue = queue_it->second;
-                        // push to the producer worker queue
-                        notif_queue->push(notif); 
-                    }
-                }
-            }
-            // Remove the file from file_map since it no longer exists
-            file_map.erase(it);
-        }
-    }
+    // unlink() is called - notify all clients watching this file, the file is forgotten since it no longer exists
+    InterestRegistry::Snapshot client_set = interests.remove_path(path);
+    if (client_set) notify_clients(client_set, client_id, notif);
     return true;
 }
 
+void FileSystem::directory_changed(const std::string& path, const std::string& client_id){
+    // directory callbacks live in the interest registry next to the file ones, under the directory's key
+    std::string key = directory_key(path);
+    size_t slash = key.rfind('/');
+    if (slash == std::string::npos) return;
+    std::string directory = slash == 0 ? std::string("/") : key.substr(0, slash);
+    InterestRegistry::Snapshot client_set = interests.interested(directory);
+    if (!client_set) return; // nobody caches this listing
+    afs_operation::Notification notif;
+    notif.set_type(afs_operation::NOTIFY_DIRECTORY);
+    notif.set_directory(directory);
+    notify_clients(client_set, client_id, notif);
+}
+
+std::string FileSystem::directory_key(const std::string& directory){
+    std::string key = directory;
+    while (key.size() > 1 && key.back() == '/') key.pop_back();
+    return key;
+}
+
 
 // when a client disconnects, we need to clean up the maps on the server which contained info about the client
 // this is called when the subscribe() method ends
@@ -188,23 +185,12 @@ void FileSystem::cleanup_client(const std::string& client_id) {
         clients_db.erase(client_id);
     }
     
-    // Remove from file_map
-    {
-        std::lock_guard<std::mutex> lock(file_map_mutex);
-        for (auto it = file_map.begin(); it != file_map.end(); ) {
-            it->second.erase(client_id);
-            // Optionally remove empty entries
-            if (it->second.empty()) {
-                it = file_map.erase(it);
-            } else {
-                ++it;
-            }
-        }
-    }
+    // Remove from the interest registry, only the paths this client registered are touched
+    interests.remove_client(client_id);
     
     // Remove from subscribers and signal shutdown
     {
-        std::lock_guard<std::mutex> lock(subscriber_mutex);
+        std::lock_guard<std::shared_mutex> lock(subscriber_mutex);
         auto it = subscribers.find(client_id);
         if (it != subscribers.end()) {
             it->second->cancel();  // Signal the queue to shutdown
@@ -215,6 +201,187 @@ void FileSystem::cleanup_client(const std::string& client_id) {
     std::cout << "Client " << client_id << " cleanup complete" << std::endl;
 }
 
+void FileSystem::disconnect_client(const std::string& client_id, const std::shared_ptr<NotificationQueue>& queue) {
+    std::lock_guard<std::mutex> session(session_mutex);
+    {
+        // only if the entry is still ours, the client may already have re-subscribed on a new stream
+        std::lock_guard<std::shared_mutex> lock(subscriber_mutex);
+        auto it = subscribers.find(client_id);
+        if (it == subscribers.end() || it->second != queue) return;
+        subscribers.erase(it);
+    }
+    if (resume_grace <= 0) {
+        cleanup_client(client_id);
+        return;
+    }
+    // its registrations stay, notifications for it are only logged until it resumes
+    disconnected[client_id] = std::chrono::steady_clock::now();
+    std::cout << "Client " << client_id << " disconnected, it can resume within " << resume_grace << "s" << std::endl;
+}
+
+void FileSystem::RunMaintenance() {
+    auto next_sweep = std::chrono::steady_clock::now() + std::chrono::milliseconds(lease_seconds * 500);
+    std::unique_lock<std::mutex> lock(maintenance_mutex);
+    while (!maintenance_cv.wait_for(lock, std::chrono::seconds(1), [this] { return maintenance_stop; })) {
+        lock.unlock();
+        change_log.sync();
+        // every half lease: what was neither renewed nor opened since the previous sweep is dropped, so a lease
+        // lasts between half a lease and a whole one after the client last renewed it
+        if (lease_seconds > 0 && std::chrono::steady_clock::now() >= next_sweep) {
+            next_sweep += std::chrono::milliseconds(lease_seconds * 500);
+            size_t expired = interests.expire_leases();
+            expired_leases += expired;
+            if (expired > 0) std::cout << "Expired " << expired << " lease(s), " << interests.path_count() << " path(s) still registered" << std::endl;
+        }
+        {
+            std::lock_guard<std::mutex> session(session_mutex);
+            auto deadline = std::chrono::steady_clock::now() - std::chrono::seconds(resume_grace);
+            for (auto it = disconnected.begin(); it != disconnected.end();) {
+                if (it->second > deadline) {
+                    ++it;
+                    continue;
+                }
+                std::cout << "Client " << it->first << " did not resume" << std::endl;
+                cleanup_client(it->first);
+                it = disconnected.erase(it);
+            }
+        }
+        lock.lock();
+    }
+}
+
+
+
+void FileSystem::RunChangeDetection() {
+    std::vector<TreeWatcher::Change> settled;
+    bool scan = false;
+    while (detector.wait(settled, scan)) {
+        for (const TreeWatcher::Change& change : settled) publish_external(change);
+        settled.clear();
+        if (scan) reconcile();
+    }
+}
+
+void FileSystem::publish_external(const TreeWatcher::Change& reported) {
+    TreeWatcher::Change change = reported;
+    if (!TreeWatcher::strip_server_temp(change)) return;
+    // the server's own rename, unlink or mkdir: its clients were told when it was made
+    if (detector.own(change)) return;
+    // the listings holding the path change too, except when a file only shows a version the server wrote itself
+    ChangeDetector::Version seen;
+    struct stat s;
+    bool own_write = !change.directory && change.kind == TreeWatcher::Change::CHANGED && detector.known(change.path, seen) &&
+                     storage->stat(change.path, &s) && seen == ChangeDetector::Version{stat_timestamp(s), s.st_size};
+    if (!own_write) directory_changed(change.path, "");
+    if (change.kind == TreeWatcher::Change::MOVED) directory_changed(change.new_path, "");
+    if (!change.directory) {
+        if (change.kind == TreeWatcher::Change::MOVED) {
+            external_moved(change.path, change.new_path);
+        } else {
+            external_update(change.path, true);
+        }
+        return;
+    }
+    if (change.kind == TreeWatcher::Change::CHANGED) return; // the files inside are reported on their own
+    // a directory went away or moved: so did every held path below it
+    std::vector<std::string> below;
+    interests.for_each_path([&](const std::string& path){
+        if (ChangeDetector::under(path, change.path)) below.push_back(path);
+    });
+    for (const std::string& path : below) {
+        if (change.kind == TreeWatcher::Change::MOVED) {
+            external_moved(path, change.new_path + path.substr(change.path.size()));
+        } else {
+            external_update(path, true);
+        }
+    }
+}
+
+void FileSystem::external_update(const std::string& path, bool report_unknown) {
+    InterestRegistry::Snapshot holders = interests.interested(path);
+    if (!holders) return; // nobody caches it, nobody to tell
+    afs_operation::Notification notif;
+    notif.set_directory(path);
+    struct stat s;
+    if (storage->stat(path, &s)) {
+        if (!S_ISREG(s.st_mode)) return;
+        ChangeDetector::Version now{stat_timestamp(s), s.st_size};
+        ChangeDetector::Version seen;
+        bool known = detector.known(path, seen);
+        if (known && seen == now) return; // the server's own write, or nothing new
+        detector.record(path, now);
+        if (!known && !report_unknown) return;
+        notif.set_type(afs_operation::NOTIFY_UPDATE);
+        notif.set_timestamp(now.stamp);
+        notify_clients(holders, "", notif); // no origin: every holder is told
+    } else {
+        if (errno != ENOENT) return;
+        notif.set_type(afs_operation::NOTIFY_DELETE);
+        detector.forget(path);
+        file_change_callback_unlink(path, "", notif);
+    }
+    if (metadata) metadata->invalidate(path); // the watcher may not have seen it
+    detector.notifications++;
+    std::cout << "Changed outside the server: " << path << std::endl;
+}
+
+void FileSystem::external_moved(const std::string& old_path, const std::string& new_path) {
+    // after a rename through the server its holders already moved along, what is left is checking new_path
+    struct stat s;
+    if (!interests.interested(old_path) || storage->stat(old_path, &s)) {
+        external_update(old_path, true);
+        external_update(new_path, false);
+        return;
+    }
+    // whoever held new_path held a file the rename replaced, they only get to revalidate it
+    InterestRegistry::Snapshot replaced = interests.interested(new_path);
+    afs_operation::Notification notif;
+    notif.set_type(afs_operation::NOTIFY_RENAME);
+    notif.set_directory(old_path);
+    notif.set_new_directory(new_path);
+    if (storage->stat(new_path, &s)) notif.set_timestamp(stat_timestamp(s));
+    detector.moved(old_path, new_path, false);
+    file_change_callback_rename(old_path, new_path, "", notif);
+    if (replaced) {
+        afs_operation::Notification update;
+        update.set_type(afs_operation::NOTIFY_UPDATE);
+        update.set_directory(new_path);
+        update.set_timestamp(notif.timestamp());
+        notify_clients(replaced, "", update);
+    }
+    if (metadata) {
+        metadata->invalidate(old_path);
+        metadata->invalidate(new_path);
+    }
+    detector.notifications++;
+    std::cout << "Renamed outside the server: " << old_path << " -> " << new_path << std::endl;
+}
+
+void FileSystem::reconcile() {
+    detector.scans++;
+    // paths registered without their version being handed out (resumed sessions) only get a baseline here
+    interests.for_each_path([this](const std::string& path){ external_update(path, false); });
+    detector.prune([this](const std::string& path){ return interests.interested(path) != nullptr; });
+}
+
+
+bool FileSystem::stat_cached(const std::string& path, struct stat* s) {
+    if (!metadata) return storage->stat(path, s);
+    return metadata->stat(path, s, [this](const std::string& p, struct stat* st){ return storage->stat(p, st); });
+}
+
+void FileSystem::fill_attributes(const struct stat& s, afs_operation::GetAttrResponse* response) {
+    response->set_size(s.st_size);   // file size in bytes
+    response->set_mode(s.st_mode);      // This includes file type (S_IFREG/S_IFDIR) AND permissions
+    response->set_nlink(s.st_nlink);      // number of hard links to the file
+    response->set_uid(s.st_uid);       // user id and group id of the file's owner
+    response->set_gid(s.st_gid);
+
+    int64_t precise_time = stat_timestamp(s);
+    response->set_mtime(precise_time);
+    response->set_atime(precise_time); // Or create a similar helper for atime if needed
+    response->set_ctime(precise_time);
+}
 
 
 grpc::Status FileSystem::getattr(grpc::ServerContext* context, const afs_operation::GetAttrRequest* request, afs_operation::GetAttrResponse* response) {
@@ -236,8 +403,6 @@ grpc::Status FileSystem::getattr(grpc::ServerContext* context, const afs_operati
         path = directory + (directory.back() == '/' ? "" : "/") + filename;
     }*/
     path = directory + (directory.back() == '/' ? "" : "/") + filename;
-    
-    std::cout << "GetAttr request for resolved path: " << path << std::endl;
 
     try {
         // We must use stat() from <sys/stat.h> to get all POSIX info
@@ -245,8 +410,18 @@ grpc::Status FileSystem::getattr(grpc::ServerContext* context, const afs_operati
         // The macOS can be asking whether metadata files like ._file1.txt exists or not
         // However, we can only see the files that can be listed with ls -a which doesn't contain ._file1.txt
         // so for every ._file1.txt, we see file not found error and this is totally normal
+        // the storage backend answers, a placeholder of the dedup backend has the size and mtime of the real file
+        // Answers (missing files included) are kept in the metadata cache, a hit costs no system call; nothing is
+        // logged per call since tools like ls -l and IDE indexers ask for thousands of these
         struct stat s;
-        if (stat(path.c_str(), &s) != 0) {
+        bool found = stat_cached(path, &s);
+        if (!found && errno == ENOENT && !request->client_id().empty()) {
+            // the client caches the miss under a callback on the directory; looking again once that is registered
+            // catches a file created in between, anything created later is announced
+            interests.add(directory_key(directory), request->client_id());
+            found = stat_cached(path, &s);
+        }
+        if (!found) {
             if (errno == ENOENT) {
                 // 1. ENOENT means "Entry Not Found". 
                 // This is NORMAL behavior when FUSE asks for a file that doesn't exist. 
@@ -260,20 +435,7 @@ grpc::Status FileSystem::getattr(grpc::ServerContext* context, const afs_operati
             }
         }
         
-        // Populate the response
-        response->set_size(s.st_size);   // file size in bytes
-        response->set_mode(s.st_mode);      // This includes file type (S_IFREG/S_IFDIR) AND permissions
-        response->set_nlink(s.st_nlink);      // number of hard links to the file
-        response->set_uid(s.st_uid);       // user id and group id of the file's owner
-        response->set_gid(s.st_gid);
-
-        int64_t precise_time = get_file_timestamp(path);
-        response->set_mtime(precise_time);
-        response->set_atime(precise_time); // Or create a similar helper for atime if needed
-        response->set_ctime(precise_time);     
-
-        // Log mode in octal, which is standard for permissions
-        std::cout << "Attributes sent (mode): " << std::oct << s.st_mode << std::dec << std::endl;
+        fill_attributes(s, response);
         return grpc::Status::OK;
 
     } catch (const std::exception& e) { // Catch generic exceptions too
@@ -287,10 +449,16 @@ grpc::Status FileSystem::request_dir(grpc::ServerContext* context, const afs_ope
     if (request->code_to_initialise() == "I want input/output directory"){
         std::cout << "Received client request(later I should add the name of the client)" << std::endl;
         response->set_root_path(root_dir);
+        response->set_lease_seconds(lease_seconds);
+        if (compression) {
+            response->set_codec(chunk_codec::choose(request->codecs()));
+        }
         if (request -> client_id() != ""){
             std::string client_id = request -> client_id();
+            std::lock_guard<std::mutex> lock(client_db_mutex);
             if (clients_db.find(client_id) == clients_db.end()){ // client is not in the clients_db yet so we are good
                 clients_db.insert(client_id);
+                interests.register_client(client_id); // its dense id in the interest registry
                 std::cout << "Connection successful and the client ID is " << client_id << std::endl;
             }else{
                 std::cout << "Client ID already exists, please retry later ...." << std::endl;
@@ -303,226 +471,74 @@ grpc::Status FileSystem::request_dir(grpc::ServerContext* context, const afs_ope
     }
 }
 
-grpc::Status FileSystem::open(grpc::ServerContext* context, const afs_operation::FileRequest* request, grpc::ServerWriter<afs_operation::FileResponse>* writer) {
-    //get the file name
-    std::string filename = request -> filename(); // gRPC generates getter methods
+grpc::Status FileSystem::ls(grpc::ServerContext* context, const afs_operation::ListDirectoryRequest* request, afs_operation::ListDirectoryResponse* response){
     std::string directory = request -> directory();
-    std::cout << "Client wants " << directory<<(directory.back()=='/'? "" : "/")<<filename << std::endl;
-    std::string path = directory + (directory.back()=='/'? "" : "/") + filename;
-    // this client is registering its interest
-    std::string client_id = request->client_id();
-    // update the file_map
-    {
-        std::lock_guard<std::mutex> lock(file_map_mutex);
-        file_map[path].insert(client_id); // add the path to the map and add the corresponding client
-    }
-
-    // update the file_map_open
-    {
-        std::lock_guard<std::mutex> lock(file_map_open_mutex);
-        file_map_open[path].insert(client_id); // add the path to the map and add the corresponding client
-    }
-
-    // have to read the file in binary mode to avoid line ending translation
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open()){
-        std::cerr << "file: " << path << " not found" << std::endl;
-        return grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found on the server.");
-    }
-
-    const std::size_t chunk_size = 4096;
-    char buffer[chunk_size];
-    afs_operation::FileResponse fr;
-    // Get the authoritative timestamp via stat
-    int64_t timestamp_server = get_file_timestamp(path);
-
-    while(true){
-        file.read(buffer, chunk_size);
-        std::streamsize len = file.gcount();
-        
-        if(len <= 0)break;
-        fr.clear_content();
-        fr.set_content(buffer, len);
-        fr.set_length(static_cast<int32_t>(len));
-        // Use the consistent stat-based timestamp
-        fr.set_timestamp(timestamp_server);
-
-        if(!writer->Write(fr)){
-            std::cerr << "Error: Failed write " << std::endl;
-            return grpc::Status(grpc::StatusCode::INTERNAL, "Server failed to create the file.");
-        }
-    }
-    // writer->WritesDone();
-    std::cout << "File: " << filename << " successfully retrieved." << std::endl;
-    return grpc::Status::OK;
-}
-
-
-grpc::Status FileSystem::close(grpc::ServerContext* context, grpc::ServerReader<afs_operation::FileRequest>* reader, afs_operation::FileResponse* response) {
-    std::cout << "[SERVER] close() called" << std::endl;
-
-    afs_operation::FileRequest request;
-    std::string filename;
-    std::string path;
-    std::string client_id;
-
-    std::ofstream outfile;
-
-    std::cout << "[SERVER] Starting to read chunks..." << std::endl;
-    while(reader->Read(&request)){
-        if(filename.empty() || path.empty()){
-            filename = request.filename();
-            path = request.directory() + (request.directory().back()=='/'? "" : "/") + filename;
-            std::filesystem::path file_path(path);
-            std::filesystem::create_directories(file_path.parent_path());
-            outfile.open(path, std::ios::binary);
-            if(!outfile.is_open()){
-                std::cerr << "failed to open file: " << path << std::endl;
-                return grpc::Status(grpc::StatusCode::PERMISSION_DENIED,
-                                    "cant open file to write");
-            }
-        }
-        outfile.write(request.content().data(), request.content().size());
-        client_id = request.client_id();
-    }
-
-    std::cout << "close is in progress" <<std::endl;
-    if(outfile.is_open()) outfile.close();
+    // the client caches the listing: registered before the directory is read, so no change can slip in between
+    if (!request -> client_id().empty()) interests.add(directory_key(directory), request -> client_id());
     
-    // Check if path is empty, which happens if no messages were received
-    if (path.empty()) {
-        std::cerr << "Close RPC received no file data." << std::endl;
-        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No file data received.");
-    }
-
-    // Get the new authoritative timestamp generated by the OS after the write
-    int64_t timestamp_server = get_file_timestamp(path);
-    response->set_timestamp(timestamp_server);
-
-
-    // generate the Notification object that we are gonna use to pass to all related clients
-    afs_operation::Notification notif;
-    notif.set_directory(path);
-    notif.set_message("UPDATE");
-    notif.set_timestamp(timestamp_server);
-    // then we start updating the maps for the specific file
-    std::cout << "[SERVER] Calling file_change_callback_close..." << std::endl;
-    file_change_callback_close(path, client_id, notif);
-    std::cout << "[SERVER] Callback complete, returning OK" << std::endl;
-    std::cout.flush();
-
-        // update the file_map_open
-    {
-        std::lock_guard<std::mutex> lock(file_map_open_mutex);
-        
-        auto it = file_map_open.find(path);
-        if (it != file_map_open.end()) {
-            it->second.erase(client_id);
-            
-            if (it->second.empty()) {
-                file_map_open.erase(it);
+    std::filesystem::path directory_path(directory);
+    grpc::Status status = grpc::Status::OK;
+
+    // walks the directory, only on a miss of the metadata cache; failures are not cached
+    auto list_directory = [&](afs_operation::ListDirectoryResponse& listing) {
+        try {
+            // Check if the path exists and is a directory
+            if (!std::filesystem::exists(directory_path)) {
+                std::cerr << "Error: Directory not found: " << directory << std::endl;
+                status = grpc::Status(grpc::StatusCode::NOT_FOUND, "Specified Directory not found");
+                return false;
+            }
+            if (!std::filesystem::is_directory(directory_path)) {
+                std::cerr << "Error: Path is not a directory: " << directory << std::endl;
+                status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Path is not a directory");
+                return false;
             }
-        }
-        
-        std::cout << path << " is closed by " << client_id << std::endl;
-    }
-
 
-    return grpc::Status::OK;
-}
+            std::cout << "Listing contents for: " << directory_path.string() << std::endl;
 
-/*grpc::Status FileSystem::compare(grpc::ServerContext* context, const afs_operation::FileRequest* request, grpc::ServerWriter< ::afs_operation::FileResponse>* writer) {
-    std::string filename = request->filename();
-    int64_t timestamp = request -> timestamp();
-    std::string path = request->directory() + (request->directory().back()=='/'? "" : "/") + request->filename();
+            // Get mutable pointer to protobuf map
+            auto* entry_map = listing.mutable_entry_list();  
             
-    try {
-        int64_t timestamp_server = get_file_timestamp(path);
-        
-        if (timestamp_server > timestamp){
-            // Server version is newer, send update
-            std::ifstream new_content(path,std::ios::binary);
-            
-            if (!new_content.is_open()) {
-                std::cerr << "Failed to open file for compare-read: " << path << std::endl;
-                return grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found during compare.");
-            }
-        
-            const std::size_t chunk_size = 4096;
-            char buffer[chunk_size];
-            bool sent_at_least_once = false; // Flag to track if we sent anything
-            while(true){
-                new_content.read(buffer, chunk_size);
-                std::streamsize len = new_content.gcount();
-                if(len <= 0 && sent_at_least_once)break;
-                
-                afs_operation::FileResponse response;
-                response.set_content(buffer, len);
-                response.set_timestamp(timestamp_server);
-                response.set_update_bit(1);
-                if (!writer->Write(response)) {
-                    std::cerr << "Failed to write chunk " << " to client" << std::endl;
-                    return grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "Failed to write chunk");
+            // Iterate over the path provided in the request
+            for(const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory_path)){
+                std::string name = entry.path().filename().string();
+                if (entry.is_directory()){
+                    (*entry_map)[name] = "Directory";
+                } else if(entry.is_regular_file()){
+                    (*entry_map)[name] = "Regular_File";
                 }
-                sent_at_least_once = true;
             }
-
-            std::cout << "Cache for '" << filename << "' is stale. Sent update." << std::endl;
-            return grpc::Status::OK;
-
-        } else {
-            // Client version is valid
-            afs_operation::FileResponse response;
-            response.set_update_bit(0);
-            response.set_timestamp(timestamp_server); // Send back server time for consistency
-            writer->Write(response);
-
-            std::cout << "Cache for '" << filename << "' is valid." << std::endl;
-            return grpc::Status::OK;
+        } catch(std::filesystem::filesystem_error& e){
+            std::cerr << "Error: " << e.what() << std::endl;
+            status = grpc::Status(grpc::StatusCode::ABORTED, "Error occurred while iterating through the directory");
+            return false;
         }
-    } catch (const std::filesystem::filesystem_error& e) {
-        std::cerr << "Warning: Could not get timestamp for file: " << e.what() << std::endl;
-        // This could also be NOT_FOUND if the file doesn't exist
-        return grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found on server for compare.");
+        return true;
+    };
+    if (metadata) {
+        metadata->list(directory, *response, list_directory);
+    } else {
+        list_directory(*response);
     }
-}*/
+    return status;
+}
 
 
-grpc::Status FileSystem::ls(grpc::ServerContext* context, const afs_operation::ListDirectoryRequest* request, afs_operation::ListDirectoryResponse* response){
+grpc::Status FileSystem::ls_plus(grpc::ServerContext* context, const afs_operation::ListDirectoryRequest* request, afs_operation::ListDirectoryPlusResponse* response){
+    // the names come from ls and the attributes from the same place getattr takes them, both cached when possible
+    afs_operation::ListDirectoryResponse listing;
+    grpc::Status status = ls(context, request, &listing);
+    if (!status.ok()) return status;
     std::string directory = request -> directory();
-    
-    std::filesystem::path directory_path(directory);
-    
-    try {
-        // Check if the path exists and is a directory
-        if (!std::filesystem::exists(directory_path)) {
-            std::cerr << "Error: Directory not found: " << directory << std::endl;
-            return grpc::Status(grpc::StatusCode::NOT_FOUND, "Specified Directory not found");
-        }
-        if (!std::filesystem::is_directory(directory_path)) {
-            std::cerr << "Error: Path is not a directory: " << directory << std::endl;
-            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Path is not a directory");
-        }
-
-        std::cout << "Listing contents for: " << directory_path.string() << std::endl;
-
-        // Get mutable pointer to protobuf map
-        auto* entry_map = response->mutable_entry_list();  
-        
-        // Iterate over the path provided in the request
-        for(const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(directory_path)){
-            std::string name = entry.path().filename().string();
-            if (entry.is_directory()){
-                (*entry_map)[name] = "Directory";
-            } else if(entry.is_regular_file()){
-                (*entry_map)[name] = "Regular_File";
-            }
-        }
-    } catch(std::filesystem::filesystem_error& e){
-        std::cerr << "Error: " << e.what() << std::endl;
-        return grpc::Status(grpc::StatusCode::ABORTED, "Error occurred while iterating through the directory");
+    std::string prefix = directory + (directory.back() == '/' ? "" : "/");
+    response->mutable_entries()->Reserve(listing.entry_list().size());
+    for (const auto& [name, type] : listing.entry_list()) {
+        struct stat s;
+        if (!stat_cached(prefix + name, &s)) continue; // removed since it was listed
+        afs_operation::DirectoryEntryPlus* entry = response->add_entries();
+        entry->set_name(name);
+        fill_attributes(s, entry->mutable_attr());
     }
-    
     return grpc::Status::OK;
 }
 
@@ -550,6 +566,10 @@ grpc::Status FileSystem::mkdir(grpc::ServerContext* context, const afs_operation
         }else{
             // successfully created the directory
             std::filesystem::permissions(directory, static_cast<std::filesystem::perms>(mode));
+            if (metadata) metadata->invalidate(directory);
+            if (names) names->add(directory, true);
+            detector.expect(TreeWatcher::Change{TreeWatcher::Change::CHANGED, directory, "", true});
+            directory_changed(directory, ""); // mkdir doesn't say who asked, the creator hears about it too
             std::cout << "Directory creation successful: " << directory << std::endl;
         }
     }catch(const std::filesystem::filesystem_error& e){
@@ -581,17 +601,38 @@ grpc::Status FileSystem::rename(grpc::ServerContext* context, const afs_operatio
         // std::filesystem::rename is atomic and replaces existing files
 
         // ensure the destination folder exists by create_directories()
-        std::filesystem::create_directories(std::filesystem::path(new_path).parent_path());
+        // the highest directory it is going to make shows up in a listing that exists already
+        std::string top_created;
+        for (std::filesystem::path p = std::filesystem::path(new_path).parent_path(); !p.empty() && !std::filesystem::exists(p); p = p.parent_path()) {
+            top_created = p.generic_string();
+        }
+        bool created = std::filesystem::create_directories(std::filesystem::path(new_path).parent_path());
 
         std::filesystem::rename(old_path, new_path);
+        bool directory = std::filesystem::is_directory(new_path);
+        detector.moved(old_path, new_path, directory);
+        detector.expect(TreeWatcher::Change{TreeWatcher::Change::MOVED, old_path, new_path, directory});
+        if (created) detector.expect(TreeWatcher::Change{TreeWatcher::Change::CHANGED, top_created, "", true});
+        if (names) names->move(old_path, new_path, directory);
+        if (metadata) {
+            // a directory takes everything below it along, and new parents change listings further up
+            if (created || directory) {
+                metadata->invalidate_all();
+            } else {
+                metadata->invalidate(old_path);
+                metadata->invalidate(new_path);
+            }
+        }
         afs_operation::Notification notif;
-        notif.set_message("Rename");
+        notif.set_type(afs_operation::NOTIFY_RENAME);
         notif.set_new_directory(new_path);
         notif.set_directory(old_path);
 
         int64_t timestamp = get_file_timestamp(new_path);
         notif.set_timestamp(timestamp);
         file_change_callback_rename(old_path,new_path,client_id,notif);
+        directory_changed(old_path, client_id);
+        if (s_dir_new != s_dir) directory_changed(created ? top_created : new_path, client_id);
 
         std::cout << "Server Renamed: " << request->filename() << " -> " << request->new_filename() << std::endl;
         response->set_success(true);
@@ -610,11 +651,16 @@ grpc::Status FileSystem::unlink(grpc::ServerContext* context, const afs_operatio
     std::string client_id = request -> client_id();
     std::error_code ec;
     if (std::filesystem::remove(directory, ec)) {
+        if (metadata) metadata->invalidate(directory);
+        detector.forget(directory);
+        detector.expect(TreeWatcher::Change{TreeWatcher::Change::REMOVED, directory, "", false});
+        if (names) names->remove(directory);
         // now generate the notif message
         afs_operation::Notification notif;
         notif.set_directory(request -> directory());
-        notif.set_message("DELETE");
+        notif.set_type(afs_operation::NOTIFY_DELETE);
         file_change_callback_unlink(directory, client_id, notif);
+        directory_changed(directory, client_id);
         std::cout << "File deleted successfully on the server at: " << directory << std::endl;
     } else {
         if (ec){
@@ -634,6 +680,29 @@ grpc::Status FileSystem::unlink(grpc::ServerContext* context, const afs_operatio
     return grpc::Status::OK;
 }
 
+grpc::Status FileSystem::find(grpc::ServerContext* context, const afs_operation::FindRequest* request, afs_operation::FindResponse* response){
+    if (!names) return grpc::Status(grpc::StatusCode::UNAVAILABLE, "The name index is turned off");
+    if (request->pattern().empty()) return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Empty pattern");
+    size_t limit = request->limit() == 0 ? 10000 : std::min<size_t>(request->limit(), 100000);
+    NameIndex::Result result;
+    auto started = std::chrono::steady_clock::now();
+    switch (names->query(request->directory(), request->pattern(), request->substring(), limit, result)) {
+        case NameIndex::NOT_READY:
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "The name index is still being built");
+        case NameIndex::NO_DIRECTORY:
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "Specified Directory not found");
+        case NameIndex::ANSWERED:
+            break;
+    }
+    for (std::string& path : result.paths) response->add_paths(std::move(path));
+    response->set_truncated(result.truncated);
+    response->set_candidates(result.candidates);
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "find " << request->pattern() << " under " << request->directory() << ": " << response->paths_size()
+              << " of " << result.candidates << " candidates in " << elapsed.count() << " us" << std::endl;
+    return grpc::Status::OK;
+}
+
 // gRPC for the dashboard
 grpc::Status FileSystem::GetStatus(grpc::ServerContext* context, 
                                    const afs_operation::GetStatusRequest* request, 
@@ -651,37 +720,176 @@ grpc::Status FileSystem::GetStatus(grpc::ServerContext* context,
 
     // 2. Handle File Map (Same as before)
     {
-        std::lock_guard<std::mutex> lock(file_map_open_mutex);
         auto* response_map = response->mutable_file_to_clients();
 
-        for (const auto& [file_path, user_set] : file_map_open) {
+        interests.for_each_open([&](const std::string& file_path, const std::vector<std::string>& user_set){
             afs_operation::FileUsers file_users_msg;
             for (const auto& user_id : user_set) {
                 file_users_msg.add_users(user_id);
             }
             (*response_map)[file_path] = file_users_msg;
+        });
+    }
+
+    // 3. Notification fan-out
+    FanoutDispatcher::Metrics fanout_metrics = fanout.metrics();
+    afs_operation::FanoutMetrics* metrics = response->mutable_fanout();
+    metrics->set_events(fanout_metrics.events);
+    metrics->set_pending(fanout_metrics.pending);
+    metrics->set_deliveries(fanout_metrics.deliveries);
+    metrics->set_last_us(fanout_metrics.last_us);
+    metrics->set_avg_us(fanout_metrics.avg_us);
+    metrics->set_max_us(fanout_metrics.max_us);
+
+    response->set_registered_paths(interests.path_count());
+    response->set_expired_leases(expired_leases);
+
+    if (metadata) {
+        MetadataCache::Metrics cache_metrics = metadata->metrics();
+        afs_operation::MetadataCacheMetrics* cache = response->mutable_metadata_cache();
+        cache->set_attr_hits(cache_metrics.attr_hits);
+        cache->set_attr_misses(cache_metrics.attr_misses);
+        cache->set_dir_hits(cache_metrics.dir_hits);
+        cache->set_dir_misses(cache_metrics.dir_misses);
+        cache->set_invalidations(cache_metrics.invalidations);
+        cache->set_entries(cache_metrics.entries);
+        cache->set_watches(watcher.watch_count());
+    }
+
+    ChangeDetector::Metrics detector_metrics = detector.metrics();
+    afs_operation::ExternalChanges* external = response->mutable_external_changes();
+    external->set_events(detector_metrics.events);
+    external->set_notifications(detector_metrics.notifications);
+    external->set_scans(detector_metrics.scans);
+    external->set_watches(watcher.watch_count());
+
+    // 4. Subscriber queues
+    {
+        auto* queues = response->mutable_subscriber_queues();
+        std::shared_lock<std::shared_mutex> lock(subscriber_mutex);
+        for (const auto& [client, queue] : subscribers) {
+            afs_operation::SubscriberQueue& entry = (*queues)[client];
+            entry.set_depth(queue->ring.size());
+            entry.set_capacity(queue->ring.capacity());
+            entry.set_overflows(queue->overflows);
+            entry.set_dropped(queue->dropped);
+            entry.set_coalesced(queue->coalesced);
         }
     }
 
     return grpc::Status::OK;
 }
 
+grpc::Status FileSystem::renew_leases(grpc::ServerContext* context, const afs_operation::RenewLeasesRequest* request, afs_operation::RenewLeasesResponse* response){
+    // a path whose lease already ended is not taken back here: the client may have missed a callback since, it
+    // has to revalidate the copy, and that open registers it again
+    for (const std::string& path : request->paths()) {
+        if (!interests.renew(path, request->client_id())) response->add_expired(path);
+    }
+    response->set_lease_seconds(lease_seconds);
+    return grpc::Status::OK;
+}
+
+void FileSystem::HandleRpcs(grpc::ServerCompletionQueue* cq){
+    // arm one call of every RPC on this queue, each call re-arms its method as soon as it gets matched
+    new UnaryCallData<afs_operation::InitialiseRequest, afs_operation::InitialiseResponse>(this, &service, cq, &AsyncService::Requestrequest_dir, &FileSystem::request_dir);
+    new UnaryCallData<afs_operation::ListDirectoryRequest, afs_operation::ListDirectoryResponse>(this, &service, cq, &AsyncService::Requestls, &FileSystem::ls);
+    new UnaryCallData<afs_operation::ListDirectoryRequest, afs_operation::ListDirectoryPlusResponse>(this, &service, cq, &AsyncService::Requestls_plus, &FileSystem::ls_plus);
+    new UnaryCallData<afs_operation::GetAttrRequest, afs_operation::GetAttrResponse>(this, &service, cq, &AsyncService::Requestgetattr, &FileSystem::getattr);
+    new UnaryCallData<afs_operation::RenameRequest, afs_operation::RenameResponse>(this, &service, cq, &AsyncService::Requestrename, &FileSystem::rename);
+    new UnaryCallData<afs_operation::MakeDir_request, afs_operation::MakeDir_response>(this, &service, cq, &AsyncService::Requestmkdir, &FileSystem::mkdir);
+    new UnaryCallData<afs_operation::Delete_request, afs_operation::Delete_response>(this, &service, cq, &AsyncService::Requestunlink, &FileSystem::unlink);
+    new UnaryCallData<afs_operation::FindRequest, afs_operation::FindResponse>(this, &service, cq, &AsyncService::Requestfind, &FileSystem::find);
+    new UnaryCallData<afs_operation::GetStatusRequest, afs_operation::GetStatusResponse>(this, &service, cq, &AsyncService::RequestGetStatus, &FileSystem::GetStatus);
+    new UnaryCallData<afs_operation::RenewLeasesRequest, afs_operation::RenewLeasesResponse>(this, &service, cq, &AsyncService::Requestrenew_leases, &FileSystem::renew_leases);
+    new OpenCallData(this, &service, cq, OpenCallData::OPEN);
+    new OpenCallData(this, &service, cq, OpenCallData::COMPARE);
+    new OpenCallData(this, &service, cq, OpenCallData::READ_RANGE);
+    new CloseCallData(this, &service, cq);
+    new SignatureCallData(this, &service, cq);
+    new DeltaCallData(this, &service, cq);
+    new RangeUpdateCallData(this, &service, cq);
+    new AppendCallData(this, &service, cq);
+    new ListDirCallData(this, &service, cq);
+    new WalkCallData(this, &service, cq);
+    new SubscribeCallData(this, &service, cq);
+
+    void* tag;
+    bool ok;
+    // Next() blocks until an event is ready and returns false once the queue is shut down and drained
+    while (cq->Next(&tag, &ok)) {
+        CallTag* call_tag = static_cast<CallTag*>(tag);
+        call_tag->call->Proceed(call_tag->event, ok);
+    }
+}
+
 void FileSystem::RunServer(){
     std::string server_address = "0.0.0.0:50051";
     
     grpc::ServerBuilder builder;
     
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    builder.RegisterService(this);
+    builder.RegisterService(&service);
+    // one completion queue per thread so that all events of a call are handled by the same thread in order
+    for (int i = 0; i < num_threads; i++){
+        completion_queues.emplace_back(builder.AddCompletionQueue());
+    }
+    
+    change_log.open(state_dir, log_entries);
+    // one watcher feeds both the metadata cache and the detection of changes made outside the server
+    detector.configure(std::chrono::milliseconds(watch_settle_ms), std::chrono::seconds(reconcile_seconds));
+    if (metadata_cache_entries > 0) metadata = std::make_unique<MetadataCache>(metadata_cache_entries);
+    if (name_index) names = std::make_unique<NameIndex>();
+    if (watcher.start(root_dir, [this](const TreeWatcher::Change& change){
+            if (metadata) metadata->on_change(change);
+            if (names) names->on_change(change);
+            detector.observe(change);
+        })) {
+        std::cout << "Watching " << watcher.watch_count() << " directories under " << root_dir << " for changes" << std::endl;
+        if (metadata) std::cout << "Metadata cache: up to " << metadata_cache_entries << " entries" << std::endl;
+    } else {
+        // without a watcher nothing would tell the cache about outside changes; the scans still catch them
+        metadata.reset();
+    }
+    // without the watcher the index only learns what goes through the server, still better than no find at all
+    if (names) names->start(root_dir);
+    std::cout << "Held files are compared with the disk every " << reconcile_seconds << "s" << std::endl;
+    server = builder.BuildAndStart();
+    std::cout << "Server listening on " << server_address << " with " << num_threads << " threads" << std::endl;
+    fanout.start(fanout_threads, [this](const FanoutDispatcher::Event& event, size_t lane, size_t lanes){
+        return deliver_notification(event, lane, lanes);
+    });
+    std::cout << "Notifications fan out on " << fanout_threads << " lanes" << std::endl;
     
-    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
-    std::cout << "Server listening on " << server_address << std::endl;
+    std::thread maintenance(&FileSystem::RunMaintenance, this);
+    std::thread change_detection(&FileSystem::RunChangeDetection, this);
     
-    server->Wait();
+    std::vector<std::thread> workers;
+    for (auto& cq : completion_queues){
+        workers.emplace_back(&FileSystem::HandleRpcs, this, cq.get());
+    }
+    for (std::thread& worker : workers){
+        worker.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(maintenance_mutex);
+        maintenance_stop = true;
+    }
+    maintenance_cv.notify_one();
+    maintenance.join();
+    watcher.stop();
+    if (names) names->stop();
+    detector.stop();
+    change_detection.join();
+    change_log.sync();
 }
 
-FileSystem::FileSystem(std::string root_dir_input): root_dir(root_dir_input){
+FileSystem::FileSystem(std::string root_dir_input, int num_threads_input): root_dir(root_dir_input), num_threads(num_threads_input){
     starting_length = root_dir.size();
+    storage = std::make_unique<PosixStorage>();
+    if (num_threads <= 0){
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
 }
 
 // implement truncate. Since we may only need to truncate
@@ -693,7 +901,51 @@ int main(int argc, char** argv){
         return 1; // fail and end
     }
     std::string path(argv[1]);
-    FileSystem filesys(path);
+    // AFS_SERVER_THREADS fixes the number of threads serving RPCs, by default one per hardware thread
+    const char* env_threads = std::getenv("AFS_SERVER_THREADS");
+    int num_threads = env_threads ? std::atoi(env_threads) : 0;
+    FileSystem filesys(path, num_threads);
+    const char* env_compression = std::getenv("AFS_COMPRESSION");
+    filesys.compression = !(env_compression && std::atoi(env_compression) == 0);
+    // AFS_FANOUT_THREADS is the number of lanes delivering notifications, 0 delivers them inside the RPC as before
+    const char* env_fanout = std::getenv("AFS_FANOUT_THREADS");
+    if (env_fanout) filesys.fanout_threads = std::max(0, std::atoi(env_fanout));
+    const char* env_notify_queue = std::getenv("AFS_NOTIFY_QUEUE");
+    if (env_notify_queue) filesys.notify_queue_capacity = std::max(2, std::atoi(env_notify_queue));
+    // server state (the notification log, the dedup chunk store) lives under AFS_STATE_DIR (default ./afs_state),
+    // keep it outside the served root
+    const char* env_state = std::getenv("AFS_STATE_DIR");
+    if (env_state) filesys.state_dir = env_state;
+    // AFS_LOG_ENTRIES notifications are kept for reconnecting subscribers, which keep their registrations for
+    // AFS_RESUME_GRACE seconds after their stream breaks (0 forgets them at once, as before)
+    const char* env_log_entries = std::getenv("AFS_LOG_ENTRIES");
+    if (env_log_entries) filesys.log_entries = std::max(1, std::atoi(env_log_entries));
+    const char* env_grace = std::getenv("AFS_RESUME_GRACE");
+    if (env_grace) filesys.resume_grace = std::max(0, std::atoi(env_grace));
+    // AFS_LEASE_SECONDS is how long a callback registration lasts unless the client renews it (0: until disconnect)
+    const char* env_lease = std::getenv("AFS_LEASE_SECONDS");
+    if (env_lease) filesys.lease_seconds = std::max(0, std::atoi(env_lease));
+    // AFS_META_CACHE bounds the attributes and listings the server keeps for getattr and ls, 0 turns the cache off
+    const char* env_meta_cache = std::getenv("AFS_META_CACHE");
+    if (env_meta_cache) filesys.metadata_cache_entries = static_cast<size_t>(std::max(0, std::atoi(env_meta_cache)));
+    // changes made under the root by anything but the server are announced once they have been quiet for
+    // AFS_WATCH_SETTLE_MS, and held files are compared with the disk every AFS_RECONCILE_SECONDS for what inotify missed
+    const char* env_settle = std::getenv("AFS_WATCH_SETTLE_MS");
+    if (env_settle) filesys.watch_settle_ms = std::max(0, std::atoi(env_settle));
+    const char* env_reconcile = std::getenv("AFS_RECONCILE_SECONDS");
+    if (env_reconcile) filesys.reconcile_seconds = std::max(0, std::atoi(env_reconcile));
+    // AFS_WALK_THREADS is how many directories one walk reads at a time
+    const char* env_walk = std::getenv("AFS_WALK_THREADS");
+    if (env_walk) filesys.walk_threads = std::max(1, std::atoi(env_walk));
+    // AFS_NAME_INDEX=0 saves the memory of the name index (a few hundred bytes per entry), find then answers UNAVAILABLE
+    const char* env_name_index = std::getenv("AFS_NAME_INDEX");
+    filesys.name_index = !(env_name_index && std::atoi(env_name_index) == 0);
+    // AFS_STORAGE=dedup keeps file content in a deduplicating chunk store instead of in the files themselves
+    const char* env_storage = std::getenv("AFS_STORAGE");
+    if (env_storage && std::string(env_storage) == "dedup") {
+        filesys.storage = std::make_unique<DedupStorage>(filesys.state_dir);
+    }
+    std::cout << "Storage backend: " << filesys.storage->name() << std::endl;
     std::cout << "Running filesystem server...... Current root directory on the server is " << path << std::endl;
     filesys.RunServer();
 
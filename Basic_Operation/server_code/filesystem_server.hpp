@@ -2,7 +2,7 @@
 
 #include <string>
 #include <vector>
-#include <filesystem> 
+#include <filesystem>
 
 // gRPC and Protobuf includes
 #include <grpcpp/grpcpp.h>
@@ -14,94 +14,355 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
-#include <queue>
+#include <sys/stat.h>
+
+// mtime of path in nanoseconds, the version stamp of a file on the server
+int64_t get_file_timestamp(const std::string& path);
+// the same stamp taken from a stat that is already at hand
+int64_t stat_timestamp(const struct stat& s);
+
+#include "file_streamer.hpp"
+#include "interest_registry.hpp"
+#include "fanout_dispatcher.hpp"
+#include "mpsc_ring.hpp"
+#include "change_log.hpp"
+#include "metadata_cache.hpp"
+#include "change_detector.hpp"
+#include "name_index.hpp"
 
 // helper class used for managing the callback system
+// The queue does not block a thread: the subscriber stream installs a wake hook and is woken on its completion queue
+// when a notification arrives while it sits idle
+// Producers (the fan-out lanes) push into a bounded lock-free ring, so a stalled subscriber can hold at most
+// `capacity` notifications. When the ring is full the notification is not queued; the queue only remembers the
+// directory covering everything it had to drop and the stream then sends a single NOTIFY_RESYNC for that prefix
+// (empty: everything), after which the client revalidates whatever it caches there.
+// The stream drains the ring in one go and folds the notifications of one path into one before writing them as a
+// batch, so a burst of writes to one file (a build, a checkout) costs the client one invalidation. A rename is never
+// folded and nothing is folded across it, the client has to see the paths move in order.
 struct NotificationQueue{
-    std::queue<afs_operation::Notification> queue;
+    explicit NotificationQueue(size_t capacity) : ring(capacity) {}
+
+    MpscRing<afs_operation::Notification> ring;
+    std::atomic<bool> shutdown{true};
+    std::atomic<bool> idle{false};         // the stream found nothing to send and waits for a wake
+    std::atomic<uint64_t> coalesced{0};    // notifications folded into another one of the same batch
+    std::atomic<uint64_t> overflows{0};    // times the ring filled up and a resync had to be sent
+    std::atomic<uint64_t> dropped{0};      // notifications replaced by a resync
+
+    // slow paths only: the wake hook and the overflow state
     std::mutex mu;
-    std::condition_variable cv;
-    bool shutdown = true;
+    std::function<void()> wake; // called with mu held, set and cleared by the owning subscriber stream
+    bool overflowed = false;
+    std::string overflow_prefix;
+    uint64_t overflow_seq = 0; // the newest notification dropped, the resync stands in for it
+
+    // push for the producer (unlink/close/rename function calls) and it wakes up the subscriber stream
+    void push(const afs_operation::Notification& notif){
+        if (shutdown.load(std::memory_order_acquire)) return; // nobody is going to drain this queue anymore
+        if (!ring.push(notif)){
+            std::lock_guard<std::mutex> lock(mu);
+            dropped++;
+            overflow_seq = std::max(overflow_seq, notif.seq());
+            std::string prefix = parent_directory(notif.directory());
+            if (!notif.new_directory().empty()) prefix = common_directory(prefix, parent_directory(notif.new_directory()));
+            if (!overflowed){
+                overflowed = true;
+                overflows++;
+                overflow_prefix = prefix;
+            }else{
+                overflow_prefix = common_directory(overflow_prefix, prefix);
+            }
+        }
+        if (idle.exchange(false)){ // only the first push after the stream went idle has to wake it
+            std::lock_guard<std::mutex> lock(mu);
+            if (wake) wake();
+        }
+    }
 
-    // push for the producer (unlink/close/rename function calls) and it wakes up one thread 
-    void push(afs_operation::Notification notif){
-        std::lock_guard<std::mutex> lock(mu);
-        queue.push(notif);
-        cv.notify_one(); // notify one thread that is waiting (sleeping because the condition is false)
+    // consumer: moves everything queued into batch, false when there is nothing to send
+    bool pop_batch(afs_operation::NotificationBatch& batch){
+        std::vector<afs_operation::Notification> pending;
+        std::unordered_map<std::string, size_t> index; // path -> its notification in pending
+        afs_operation::Notification notif;
+        while (ring.pop(notif)){
+            if (notif.type() == afs_operation::NOTIFY_RENAME){
+                // a directory takes every path below it along, so nothing queued before it is folded into any more
+                index.clear();
+            }else{
+                auto it = index.find(notif.directory());
+                if (it != index.end()){
+                    fold(pending[it->second], notif);
+                    coalesced++;
+                    continue;
+                }
+                index[notif.directory()] = pending.size();
+            }
+            pending.push_back(std::move(notif));
+        }
+
+        bool resync = false;
+        std::string prefix;
+        uint64_t resync_seq = 0;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (overflowed){
+                resync = true;
+                prefix = std::move(overflow_prefix);
+                resync_seq = overflow_seq;
+                overflowed = false;
+                overflow_prefix.clear();
+            }
+        }
+        for (afs_operation::Notification& queued : pending){
+            // updates under the resync prefix are covered by it, deletes and renames still have to be applied
+            bool covered = resync && queued.directory().compare(0, prefix.size(), prefix) == 0 &&
+                           (queued.type() == afs_operation::NOTIFY_UPDATE || queued.type() == afs_operation::NOTIFY_APPEND ||
+                            queued.type() == afs_operation::NOTIFY_DIRECTORY);
+            if (!covered) *batch.add_notifications() = std::move(queued);
+        }
+        if (resync){
+            afs_operation::Notification* all = batch.add_notifications();
+            all->set_type(afs_operation::NOTIFY_RESYNC);
+            all->set_directory(prefix);
+            all->set_seq(resync_seq);
+        }
+        return batch.notifications_size() > 0;
     }
 
-    bool pop(afs_operation::Notification& notif){
-        std::unique_lock<std::mutex> lock(mu); // unique_lock is a lock management object similar to lock_guard
-        cv.wait(lock, [this](){return !queue.empty() || shutdown;});
-        // if the thread goes to sleep with cv.wait, it has to be woken up by notify_one or notify_all to check the condition again
-        if (shutdown && queue.empty()) return false; // graceful shutdown benefitting from the cancel() function
-        
-        notif = queue.front();
-        queue.pop();
-        return true;
+    // consumer: called when pop_batch found nothing. True means the stream may go idle, a producer will wake it;
+    // false means something arrived in between and the stream has to drain again
+    bool park(){
+        idle.store(true);
+        bool work;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            work = overflowed;
+        }
+        work = work || !ring.empty();
+        return !(work && idle.exchange(false));
     }
+
     void cancel(){
+        shutdown.store(true, std::memory_order_release);
         std::lock_guard<std::mutex> lock(mu);
-        shutdown = true; 
-        cv.notify_all(); // wake up all the threads and then they return false in pop() for a graceful shutdown 
+        if (wake) wake(); // let the stream notice the shutdown and finish
     }
-};
 
-// main filesystem server class 
-class FileSystem final : public afs_operation::operators::Service{
+private:
+    // queued becomes what the client should do after both events: two appends in a row stay one append covering
+    // both tails, a delete wins, anything else is a new version to revalidate
+    static void fold(afs_operation::Notification& queued, const afs_operation::Notification& newer){
+        if (newer.type() == afs_operation::NOTIFY_APPEND && queued.type() == afs_operation::NOTIFY_APPEND &&
+            newer.base_timestamp() == queued.timestamp()){
+            queued.set_new_size(newer.new_size());
+            queued.set_timestamp(newer.timestamp());
+            queued.set_seq(newer.seq());
+            return;
+        }
+        queued = newer;
+        if (queued.type() == afs_operation::NOTIFY_APPEND){
+            queued.set_type(afs_operation::NOTIFY_UPDATE);
+            queued.clear_old_size();
+            queued.clear_new_size();
+            queued.clear_base_timestamp();
+        }
+    }
+
+    // "./root/a/b.txt" -> "./root/a/", "" for an empty path
+    static std::string parent_directory(const std::string& path){
+        size_t slash = path.rfind('/');
+        return slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+    }
 
-public: 
+    // the longest directory prefix of both, "" when they only share the root
+    static std::string common_directory(const std::string& a, const std::string& b){
+        size_t n = 0;
+        while (n < a.size() && n < b.size() && a[n] == b[n]) n++;
+        size_t slash = a.rfind('/', n == 0 ? 0 : n - 1);
+        if (n == 0 || slash == std::string::npos) return std::string();
+        return a.substr(0, slash + 1);
+    }
+};
+
+class OpenCallData;
+class CloseCallData;
+class SubscribeCallData;
+class SignatureCallData;
+class DeltaCallData;
+class RangeUpdateCallData;
+class AppendCallData;
+class ListDirCallData;
+class WalkCallData;
+
+// open, compare and read_range are served raw so that file chunks go to gRPC as slices of pooled buffers instead of protobuf strings
+using AsyncService = afs_operation::operators::WithRawMethod_open<
+                     afs_operation::operators::WithRawMethod_compare<
+                     afs_operation::operators::WithRawMethod_read_range<afs_operation::operators::AsyncService>>>;
+
+// main filesystem server class
+// All RPCs are served through the asynchronous (completion queue) API so that no call pins a thread:
+// a fixed number of threads, each draining its own completion queue, drives every in-flight call
+class FileSystem final {
+
+public:
     std::string root_dir;           // "/Users/ericzhang/Documents/Filesystems/Filesystem_server";
     int starting_length;
-    std::mutex file_map_mutex;
-    std::mutex file_map_open_mutex;
-    // this file_map is basically recording the list of clients that have the specific file in cache
-    std::unordered_map<std::string, std::unordered_set<std::string>> file_map; // a map of file directories to a vector of userIDs
-    // this file_map_open is for dashboard to record the clients that actually currently have the specific file open
-    // this is different from file_map because we don't clean up in close() in file_map 
-    std::unordered_map<std::string, std::unordered_set<std::string>> file_map_open;
+    // the interest registry records the list of clients that have the specific file in cache, and for the dashboard
+    // the clients that actually currently have the specific file open (close() only clears the latter)
+    InterestRegistry interests;
     void RunServer();
-    FileSystem(std::string root_dir);
-    
-    std::mutex subscriber_mutex;
+    // num_threads is the number of completion queue threads (0 picks one per hardware thread)
+    FileSystem(std::string root_dir, int num_threads = 0);
+    bool compression = true; // offer chunk compression to clients in request_dir (AFS_COMPRESSION=0 turns it off)
+    int fanout_threads = 4;  // lanes delivering notifications to the subscriber queues (AFS_FANOUT_THREADS)
+    size_t notify_queue_capacity = 1024; // notifications a subscriber can fall behind before it gets a resync (AFS_NOTIFY_QUEUE)
+    std::string state_dir = "./afs_state"; // server state kept across restarts: the notification log, dedup chunks (AFS_STATE_DIR)
+    size_t log_entries = 65536;  // notifications kept for subscribers that reconnect (AFS_LOG_ENTRIES)
+    int resume_grace = 300;      // seconds a disconnected client keeps its registrations to resume with (AFS_RESUME_GRACE)
+    int lease_seconds = 600;     // callback lease length, clients renew the paths they still cache (AFS_LEASE_SECONDS, 0: no expiry)
+    size_t metadata_cache_entries = 1 << 20; // attributes and listings kept for getattr and ls (AFS_META_CACHE, 0: off)
+    int watch_settle_ms = 500;   // quiet time before a change made outside the server is announced (AFS_WATCH_SETTLE_MS)
+    int reconcile_seconds = 60;  // how often held files are compared with the disk (AFS_RECONCILE_SECONDS, 0: only after lost events)
+    int walk_threads = 4;        // directories a walk reads in parallel (AFS_WALK_THREADS)
+    bool name_index = true;      // keep every name in memory for find (AFS_NAME_INDEX=0 turns it off)
+    std::unique_ptr<Storage> storage; // where file content lives, plain files unless AFS_STORAGE picks another backend
+
+    std::shared_mutex subscriber_mutex; // fan-out lanes look queues up in parallel, subscribe and cleanup change the map
     // map of client ID to NotificationQueue
     std::unordered_map<std::string, std::shared_ptr<NotificationQueue>> subscribers;
 
 private:
+    friend class OpenCallData;
+    friend class CloseCallData;
+    friend class SubscribeCallData;
+    friend class SignatureCallData;
+    friend class DeltaCallData;
+    friend class RangeUpdateCallData;
+    friend class AppendCallData;
+    friend class ListDirCallData;
+    friend class WalkCallData;
+
+    // declared before the server so that it outlives any slice gRPC still holds on shutdown
+    BufferPool buffer_pool;
+    CompressedCache compressed_cache;
+    AsyncService service;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> completion_queues;
+    std::unique_ptr<grpc::Server> server;
+    int num_threads;
+
+    // the event loop of one server thread: arms one pending call of every RPC on cq and then drives them
+    void HandleRpcs(grpc::ServerCompletionQueue* cq);
 
     std::mutex client_db_mutex;
     std::unordered_set<std::string> clients_db; // A list of all the clients that is currently connected to the server (For debugging purposes)
 
-    bool file_change_callback_close(const std::string& path, const std::string& client_id, afs_operation::Notification& notif); // implement tomorrow 
+    bool file_change_callback_close(const std::string& path, const std::string& client_id, afs_operation::Notification& notif); // implement tomorrow
 
     bool file_change_callback_rename(const std::string& path, const std::string& new_path, const std::string& client_id, afs_operation::Notification& notif);
 
     bool file_change_callback_unlink(const std::string& path, const std::string& client_id, afs_operation::Notification& notif);
 
-    void cleanup_client(const std::string& client_id);
-
-    grpc::Status request_dir(grpc::ServerContext* context, const afs_operation::InitialiseRequest* request, afs_operation::InitialiseResponse* response) override;
-
-    grpc::Status open(grpc::ServerContext* context, const afs_operation::FileRequest* request, grpc::ServerWriter<afs_operation::FileResponse>* writer) override;
-
-    grpc::Status close(grpc::ServerContext* context, grpc::ServerReader<afs_operation::FileRequest>* reader, afs_operation::FileResponse* response) override;
-
-    //grpc::Status compare(grpc::ServerContext* context, const afs_operation::FileRequest* request, grpc::ServerWriter< ::afs_operation::FileResponse>* writer) override;
+    // an entry of path's directory was created, removed, renamed or rewritten: the clients that cache the listing of
+    // that directory (they registered it in ls or list_dir) get a NOTIFY_DIRECTORY, all but client_id
+    void directory_changed(const std::string& path, const std::string& client_id);
+    // a directory as its callback is registered and announced: without trailing slashes
+    static std::string directory_key(const std::string& directory);
 
-    grpc::Status ls(grpc::ServerContext* context, const afs_operation::ListDirectoryRequest* request, afs_operation::ListDirectoryResponse* response) override;
+    void notify_clients(InterestRegistry::Snapshot client_set, const std::string& client_id, const afs_operation::Notification& notif);
+    size_t deliver_notification(const FanoutDispatcher::Event& event, size_t lane, size_t lanes);
 
-    grpc::Status getattr(grpc::ServerContext* context, const afs_operation::GetAttrRequest* request, afs_operation::GetAttrResponse* response) override;
-
-    grpc::Status rename(grpc::ServerContext* context, const afs_operation::RenameRequest* request, afs_operation::RenameResponse* response) override;
-
-    grpc::Status mkdir(grpc::ServerContext* context, const afs_operation::MakeDir_request* request, afs_operation::MakeDir_response* response) override;
-
-    grpc::Status unlink(grpc::ServerContext* context, const afs_operation::Delete_request* request, afs_operation::Delete_response* response) override;
-
-    grpc::Status subscribe(grpc::ServerContext* context, const afs_operation::SubscribeRequest* request, grpc::ServerWriter<afs_operation::Notification>* writer) override;
+    void cleanup_client(const std::string& client_id);
 
-    grpc::Status GetStatus(grpc::ServerContext* context, const afs_operation::GetStatusRequest* request, afs_operation::GetStatusResponse* response) override;
+    // the published notifications, for subscribers resuming a broken stream
+    ChangeLog change_log;
+    // serializes subscribing, disconnecting and reaping so a client can't resume while its registrations are dropped
+    std::mutex session_mutex;
+    // clients whose stream broke and that may still resume, with when it broke; guarded by session_mutex
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> disconnected;
+    // the subscribe stream of client_id (queue) ended: it is unhooked, and the client is forgotten once resume_grace
+    // passes without it subscribing again
+    void disconnect_client(const std::string& client_id, const std::shared_ptr<NotificationQueue>& queue);
+
+    std::atomic<uint64_t> expired_leases{0};
+
+    // getattr and ls answers, dropped when a path changes; RunServer keeps one while the watcher runs, unless
+    // metadata_cache_entries is 0
+    std::unique_ptr<MetadataCache> metadata;
+    // every name under root_dir for find, updated like the metadata cache; RunServer keeps one unless name_index is off
+    std::unique_ptr<NameIndex> names;
+
+    // changes made under root_dir without going through the server become notifications like any other
+    ChangeDetector detector;
+    void RunChangeDetection();
+    void publish_external(const TreeWatcher::Change& reported);
+    // tells the holders of path if it is not the version they were handed; an unknown version is only recorded
+    // unless report_unknown
+    void external_update(const std::string& path, bool report_unknown);
+    void external_moved(const std::string& old_path, const std::string& new_path);
+    // compares every held path with the disk, for whatever the watcher missed
+    void reconcile();
+    // declared after what its listener feeds so that it stops first
+    TreeWatcher watcher;
+
+    // background upkeep: syncs the notification log, forgets clients that did not come back in time and ends the
+    // leases nobody renewed
+    std::mutex maintenance_mutex;
+    std::condition_variable maintenance_cv;
+    bool maintenance_stop = false;
+    void RunMaintenance();
+
+    // stamps, notifies and unregisters once a close (full, delta, ranged or append) has put the new version in place,
+    // returns the stamp. old_size >= 0 marks an append of everything past old_size onto version base_timestamp
+    int64_t publish_close(const std::string& path, const std::string& client_id, int64_t old_size = -1, int64_t base_timestamp = 0);
+
+    // paths with an append in flight, a second appender is turned away at once instead of failing at the end
+    std::mutex append_mutex;
+    std::unordered_set<std::string> appending;
+
+    // taken by every close while it makes its version current: a full close around opening (truncating) the file and
+    // around its commit and publish_close, a staged close (delta, ranged, append) around its base check, rename and
+    // publish_close. A staged close then never replaces a version it was not built on. Paths hash onto kCommitLocks
+    static const size_t kCommitLocks = 64;
+    std::mutex commit_locks[kCommitLocks];
+    std::mutex& commit_lock(const std::string& path) { return commit_locks[std::hash<std::string>{}(path) % kCommitLocks]; }
+
+    // declared last so that it stops, delivering what is still queued, before the queues it pushes to go away
+    FanoutDispatcher fanout;
+
+    // unary handlers, invoked by UnaryCallData once the request has arrived
+    // open, compare, read_range, close and subscribe are streaming calls and live in OpenCallData, CloseCallData and SubscribeCallData
+    // signatures and close_delta live in SignatureCallData and DeltaCallData, update_ranges in RangeUpdateCallData
+    // append lives in AppendCallData, list_dir in ListDirCallData, walk in WalkCallData
+
+    grpc::Status request_dir(grpc::ServerContext* context, const afs_operation::InitialiseRequest* request, afs_operation::InitialiseResponse* response);
+
+    grpc::Status ls(grpc::ServerContext* context, const afs_operation::ListDirectoryRequest* request, afs_operation::ListDirectoryResponse* response);
+
+    grpc::Status ls_plus(grpc::ServerContext* context, const afs_operation::ListDirectoryRequest* request, afs_operation::ListDirectoryPlusResponse* response);
+
+    grpc::Status getattr(grpc::ServerContext* context, const afs_operation::GetAttrRequest* request, afs_operation::GetAttrResponse* response);
+    // stat through the metadata cache when there is one, as getattr and ls_plus answer
+    bool stat_cached(const std::string& path, struct stat* s);
+    static void fill_attributes(const struct stat& s, afs_operation::GetAttrResponse* response);
+
+    grpc::Status rename(grpc::ServerContext* context, const afs_operation::RenameRequest* request, afs_operation::RenameResponse* response);
+
+    grpc::Status mkdir(grpc::ServerContext* context, const afs_operation::MakeDir_request* request, afs_operation::MakeDir_response* response);
+
+    grpc::Status unlink(grpc::ServerContext* context, const afs_operation::Delete_request* request, afs_operation::Delete_response* response);
+
+    grpc::Status find(grpc::ServerContext* context, const afs_operation::FindRequest* request, afs_operation::FindResponse* response);
+
+    grpc::Status GetStatus(grpc::ServerContext* context, const afs_operation::GetStatusRequest* request, afs_operation::GetStatusResponse* response);
+
+    grpc::Status renew_leases(grpc::ServerContext* context, const afs_operation::RenewLeasesRequest* request, afs_operation::RenewLeasesResponse* response);
 };
 
 
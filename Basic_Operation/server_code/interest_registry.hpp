@@ -0,0 +1,531 @@
+#ifndef INTEREST_REGISTRY_HPP
+#define INTEREST_REGISTRY_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Which clients hold which paths in their cache, the registry callbacks are fanned out from, and which of them have
+// the path open right now (for the dashboard)
+// Paths are spread over lock striped shards so that opens and closes of different files don't queue on one mutex.
+// Each path's client set is copy on write: a notification takes a snapshot (one shared_ptr copy under the shard lock)
+// and walks it without any lock, a registration copies the set only when the client is new to it.
+// A reverse index from client to its paths lets a disconnecting client be dropped in time proportional to what it
+// had cached, instead of a scan of every path on the server.
+// Nothing is stored as a string more than once: every path is interned in its shard's arena and gets a PathId, every
+// client gets a dense ClientId when it connects, and the sets are sorted vectors of those ids.
+// A registration is a lease: it lasts until the client has neither renewed it (renew(), or opening the path again)
+// nor had the path open across two calls of expire_leases(), which the server makes every half lease period. The
+// reverse index keeps each client's paths in two generations for this, so leases cost no memory of their own.
+// Lock order: a path shard may be held while taking a client shard or the client table, never the other way round.
+class InterestRegistry {
+public:
+    using ClientId = uint32_t;
+    using PathId = uint32_t;                  // slot * shard count + shard
+    using ClientSet = std::vector<ClientId>;  // sorted, most files are cached by a handful of clients
+    using Snapshot = std::shared_ptr<const ClientSet>;
+
+    explicit InterestRegistry(size_t shard_count = 64) : path_shards(shard_count), client_shards(shard_count) {}
+
+    // the dense id of a client, assigned the first time it is seen (request_dir)
+    ClientId register_client(const std::string& client) {
+        {
+            std::shared_lock<std::shared_mutex> lock(table.mu);
+            auto it = table.ids.find(client);
+            if (it != table.ids.end()) return it->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(table.mu);
+        auto it = table.ids.find(client);
+        if (it != table.ids.end()) return it->second;
+        ClientId id;
+        if (!table.free_ids.empty()) {
+            id = table.free_ids.back();
+            table.free_ids.pop_back();
+            table.names[id] = client;
+        } else {
+            id = static_cast<ClientId>(table.names.size());
+            table.names.push_back(client);
+        }
+        table.ids.emplace(client, id);
+        return id;
+    }
+
+    // the dense id of a client that is registered, false if it is not
+    bool lookup_client(const std::string& client, ClientId& id) { return find_client(client, id); }
+
+    // registers client as holding path in its cache
+    void add(const std::string& path, const std::string& client) {
+        ClientId id = register_client(client);
+        PathShard& shard = path_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        hold(shard, intern(shard, path), id);
+    }
+
+    // registers client as holding path and having it open
+    void opened(const std::string& path, const std::string& client) {
+        ClientId id = register_client(client);
+        PathShard& shard = path_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        uint32_t slot = intern(shard, path);
+        hold(shard, slot, id);
+        insert_sorted(shard.entries[slot].open, id);
+    }
+
+    // client closed path, it keeps holding it in its cache
+    void closed(const std::string& path, const std::string& client) {
+        ClientId id;
+        if (!find_client(client, id)) return;
+        PathShard& shard = path_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.index.find(path);
+        if (it == shard.index.end()) return;
+        erase_sorted(shard.entries[it->second].open, id);
+    }
+
+    // renews client's lease on path, false if it no longer holds it (the lease expired or the path is gone)
+    bool renew(const std::string& path, const std::string& client) {
+        ClientId id;
+        if (!find_client(client, id)) return false;
+        PathShard& shard = path_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.index.find(path);
+        if (it == shard.index.end()) return false;
+        const Entry& entry = shard.entries[it->second];
+        if (!std::binary_search(entry.holders->begin(), entry.holders->end(), id)) return false;
+        index_add(id, path_id(shard, it->second));
+        return true;
+    }
+
+    // ends every lease that was neither taken nor renewed since the previous call, unless its client has the path
+    // open, and returns how many ended. Paths nobody holds any more are forgotten
+    size_t expire_leases() {
+        size_t expired = 0;
+        for (ClientShard& client_shard : client_shards) {
+            std::vector<std::pair<ClientId, PathIdSet>> lapsed;
+            {
+                std::lock_guard<std::mutex> lock(client_shard.mu);
+                for (auto it = client_shard.clients.begin(); it != client_shard.clients.end();) {
+                    Leases& leases = it->second;
+                    if (!leases.old.empty()) lapsed.emplace_back(it->first, std::move(leases.old));
+                    leases.old = std::move(leases.young);
+                    leases.young = PathIdSet();
+                    if (leases.old.empty()) it = client_shard.clients.erase(it);
+                    else ++it;
+                }
+            }
+            for (auto& [id, paths] : lapsed) {
+                paths.for_each([&](PathId path) {
+                    PathShard& shard = path_shards[path % path_shards.size()];
+                    uint32_t slot = path / static_cast<uint32_t>(path_shards.size());
+                    std::lock_guard<std::mutex> lock(shard.mu);
+                    if (slot >= shard.entries.size() || !shard.entries[slot].holders) return;
+                    Entry& entry = shard.entries[slot];
+                    if (!std::binary_search(entry.holders->begin(), entry.holders->end(), id)) return;
+                    if (std::binary_search(entry.open.begin(), entry.open.end(), id)) {
+                        index_add(id, path); // still open, carry the lease over
+                        return;
+                    }
+                    {
+                        std::lock_guard<std::mutex> client_lock(client_shard.mu);
+                        auto it = client_shard.clients.find(id);
+                        if (it != client_shard.clients.end() && it->second.young.contains(path)) return; // renewed meanwhile
+                    }
+                    expired++;
+                    if (entry.holders->size() == 1) {
+                        release(shard, slot);
+                        return;
+                    }
+                    auto updated = std::make_shared<ClientSet>(*entry.holders);
+                    erase_sorted(*updated, id);
+                    entry.holders = std::move(updated);
+                });
+            }
+        }
+        return expired;
+    }
+
+    // the clients holding path right now, nullptr if nobody registered it
+    Snapshot interested(const std::string& path) {
+        PathShard& shard = path_shard(path);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.index.find(path);
+        return it == shard.index.end() ? nullptr : shard.entries[it->second].holders;
+    }
+
+    // forgets path (it was unlinked) and returns who held it
+    Snapshot remove_path(const std::string& path) {
+        size_t shard_index = shard_of(path);
+        PathShard& shard = path_shards[shard_index];
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.index.find(path);
+        if (it == shard.index.end()) return nullptr;
+        uint32_t slot = it->second;
+        Snapshot clients = shard.entries[slot].holders;
+        for (ClientId client : *clients) index_remove(client, path_id(shard_index, slot));
+        release(shard, slot);
+        return clients;
+    }
+
+    // moves everyone holding old_path over to new_path and returns who that was
+    // If nobody held old_path, client (the renamer) is registered for new_path instead
+    Snapshot move_path(const std::string& old_path, const std::string& new_path, const std::string& client) {
+        if (old_path == new_path) return interested(old_path);
+        ClientId renamer = register_client(client);
+        size_t from_index = shard_of(old_path);
+        size_t to_index = shard_of(new_path);
+        PathShard& from = path_shards[from_index];
+        PathShard& to = path_shards[to_index];
+        // two shards are always locked in index order so that crossing renames can't deadlock
+        std::unique_lock<std::mutex> first(path_shards[std::min(from_index, to_index)].mu);
+        std::unique_lock<std::mutex> second;
+        if (from_index != to_index) second = std::unique_lock<std::mutex>(path_shards[std::max(from_index, to_index)].mu);
+
+        auto it = from.index.find(old_path);
+        if (it == from.index.end()) {
+            hold(to, intern(to, new_path), renamer);
+            return nullptr;
+        }
+        uint32_t old_slot = it->second;
+        Snapshot clients = from.entries[old_slot].holders;
+        ClientSet open = std::move(from.entries[old_slot].open);
+        for (ClientId holder : *clients) index_remove(holder, path_id(from_index, old_slot));
+        release(from, old_slot);
+
+        uint32_t new_slot = intern(to, new_path);
+        Entry& target = to.entries[new_slot];
+        // whoever held new_path held a file that the rename just replaced, only old_path's holders carry over
+        if (target.holders) {
+            for (ClientId holder : *target.holders) index_remove(holder, path_id(to_index, new_slot));
+        }
+        target.holders = clients;
+        target.open = std::move(open);
+        for (ClientId holder : *clients) index_add(holder, path_id(to_index, new_slot));
+        return clients;
+    }
+
+    // drops a disconnecting client from every path it held and gives its id back
+    // A snapshot taken just before may still carry the id; if a new client gets it in the meantime that client sees
+    // one spurious invalidation, which only costs it a revalidation
+    void remove_client(const std::string& client) {
+        ClientId id;
+        if (!find_client(client, id)) return;
+        Leases leases;
+        {
+            ClientShard& shard = client_shards[id % client_shards.size()];
+            std::lock_guard<std::mutex> lock(shard.mu);
+            auto it = shard.clients.find(id);
+            if (it != shard.clients.end()) {
+                leases = std::move(it->second);
+                shard.clients.erase(it);
+            }
+        }
+        auto drop = [&](PathId path) {
+            PathShard& shard = path_shards[path % path_shards.size()];
+            uint32_t slot = path / static_cast<uint32_t>(path_shards.size());
+            std::lock_guard<std::mutex> lock(shard.mu);
+            if (slot >= shard.entries.size() || !shard.entries[slot].holders) return;
+            Entry& entry = shard.entries[slot];
+            erase_sorted(entry.open, id);
+            if (!std::binary_search(entry.holders->begin(), entry.holders->end(), id)) return;
+            if (entry.holders->size() == 1) {
+                release(shard, slot);
+                return;
+            }
+            auto updated = std::make_shared<ClientSet>(*entry.holders);
+            erase_sorted(*updated, id);
+            entry.holders = std::move(updated);
+        };
+        leases.young.for_each(drop);
+        leases.old.for_each(drop);
+        std::unique_lock<std::shared_mutex> lock(table.mu);
+        table.ids.erase(client);
+        table.names[id].clear();
+        table.names[id].shrink_to_fit();
+        table.free_ids.push_back(id);
+    }
+
+    // calls fn with the name of every client in clients that is still connected
+    // With lanes > 1 only the clients whose id falls in lane (id modulo lanes) are visited
+    void for_each_client(const ClientSet& clients, const std::function<void(const std::string&)>& fn, size_t lane = 0, size_t lanes = 1) {
+        std::shared_lock<std::shared_mutex> lock(table.mu);
+        for (ClientId id : clients) {
+            if (lanes > 1 && id % lanes != lane) continue;
+            if (id < table.names.size() && !table.names[id].empty()) fn(table.names[id]);
+        }
+    }
+
+    // calls fn for every path that some client has open, with the names of those clients
+    void for_each_open(const std::function<void(const std::string&, const std::vector<std::string>&)>& fn) {
+        std::vector<std::string> names;
+        for (PathShard& shard : path_shards) {
+            std::lock_guard<std::mutex> lock(shard.mu);
+            for (uint32_t slot = 0; slot < shard.entries.size(); slot++) {
+                const Entry& entry = shard.entries[slot];
+                if (!entry.holders || entry.open.empty()) continue;
+                names.clear();
+                for_each_client(entry.open, [&](const std::string& name) { names.push_back(name); });
+                fn(std::string(entry.name), names);
+            }
+        }
+    }
+
+    // calls fn with every path some client holds; the names are copied out first, so fn may call back in
+    void for_each_path(const std::function<void(const std::string&)>& fn) {
+        std::vector<std::string> paths;
+        for (PathShard& shard : path_shards) {
+            paths.clear();
+            {
+                std::lock_guard<std::mutex> lock(shard.mu);
+                for (const auto& entry : shard.index) paths.emplace_back(entry.first);
+            }
+            for (const std::string& path : paths) fn(path);
+        }
+    }
+
+    // number of paths currently interned
+    size_t path_count() {
+        size_t count = 0;
+        for (PathShard& shard : path_shards) {
+            std::lock_guard<std::mutex> lock(shard.mu);
+            count += shard.index.size();
+        }
+        return count;
+    }
+
+private:
+    static constexpr size_t kArenaBlock = 64 * 1024;
+
+    struct Entry {
+        std::string_view name; // into the shard's arena
+        Snapshot holders;      // nullptr while the slot is free
+        ClientSet open;
+    };
+
+    struct PathShard {
+        std::mutex mu;
+        std::unordered_map<std::string_view, uint32_t> index; // keys point into the arena
+        std::vector<Entry> entries;
+        std::vector<uint32_t> free_slots;
+        std::vector<std::unique_ptr<char[]>> arena;
+        size_t arena_used = 0;  // bytes used in the last block
+        size_t live_bytes = 0;  // bytes of names still interned
+        size_t dead_bytes = 0;  // bytes of released names still taking arena space
+    };
+
+    // open addressing set of path ids: about 6 bytes per id where a node based set costs 40
+    class PathIdSet {
+    public:
+        void insert(PathId id) {
+            if ((count + tombstones + 1) * 10 > slots.size() * 7) rehash(std::max<size_t>(8, count * 2 + 2));
+            size_t at = find_slot(id);
+            if (slots[at] == id) return;
+            if (slots[at] == kTombstone) tombstones--;
+            slots[at] = id;
+            count++;
+        }
+        void erase(PathId id) {
+            if (slots.empty()) return;
+            size_t at = find_slot(id);
+            if (slots[at] != id) return;
+            slots[at] = kTombstone;
+            tombstones++;
+            count--;
+        }
+        bool contains(PathId id) const { return !slots.empty() && slots[find_slot(id)] == id; }
+        bool empty() const { return count == 0; }
+        template <class Fn>
+        void for_each(Fn fn) const {
+            for (PathId id : slots) {
+                if (id != kEmpty && id != kTombstone) fn(id);
+            }
+        }
+
+    private:
+        static constexpr PathId kEmpty = 0xFFFFFFFF;
+        static constexpr PathId kTombstone = 0xFFFFFFFE;
+
+        // the slot holding id, or where it would go (the first tombstone on its probe path, else the empty slot)
+        size_t find_slot(PathId id) const {
+            size_t mask = slots.size() - 1;
+            size_t at = (id * 2654435761u) & mask;
+            size_t reuse = slots.size();
+            while (slots[at] != kEmpty) {
+                if (slots[at] == id) return at;
+                if (slots[at] == kTombstone && reuse == slots.size()) reuse = at;
+                at = (at + 1) & mask;
+            }
+            return reuse != slots.size() ? reuse : at;
+        }
+        void rehash(size_t wanted) {
+            size_t capacity = 8;
+            while (capacity < wanted) capacity *= 2;
+            std::vector<PathId> old = std::move(slots);
+            slots.assign(capacity, kEmpty);
+            count = 0;
+            tombstones = 0;
+            for (PathId id : old) {
+                if (id != kEmpty && id != kTombstone) insert(id);
+            }
+        }
+
+        std::vector<PathId> slots; // power of two sized
+        size_t count = 0;
+        size_t tombstones = 0;
+    };
+
+    // a client's paths: young were registered or renewed since the last expire_leases(), old before that
+    struct Leases {
+        PathIdSet young;
+        PathIdSet old;
+    };
+
+    struct ClientShard {
+        std::mutex mu;
+        std::unordered_map<ClientId, Leases> clients;
+    };
+
+    struct ClientTable {
+        std::shared_mutex mu;
+        std::unordered_map<std::string, ClientId> ids;
+        std::vector<std::string> names; // empty for a free id
+        std::vector<ClientId> free_ids;
+    };
+
+    static void insert_sorted(ClientSet& set, ClientId id) {
+        auto it = std::lower_bound(set.begin(), set.end(), id);
+        if (it == set.end() || *it != id) set.insert(it, id);
+    }
+
+    static void erase_sorted(ClientSet& set, ClientId id) {
+        auto it = std::lower_bound(set.begin(), set.end(), id);
+        if (it != set.end() && *it == id) set.erase(it);
+    }
+
+    size_t shard_of(std::string_view path) const {
+        return std::hash<std::string_view>()(path) % path_shards.size();
+    }
+
+    PathShard& path_shard(std::string_view path) {
+        return path_shards[shard_of(path)];
+    }
+
+    PathId path_id(size_t shard_index, uint32_t slot) const {
+        return slot * static_cast<PathId>(path_shards.size()) + static_cast<PathId>(shard_index);
+    }
+
+    PathId path_id(const PathShard& shard, uint32_t slot) const {
+        return path_id(static_cast<size_t>(&shard - path_shards.data()), slot);
+    }
+
+    bool find_client(const std::string& client, ClientId& id) {
+        std::shared_lock<std::shared_mutex> lock(table.mu);
+        auto it = table.ids.find(client);
+        if (it == table.ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+    // copies path into the shard's arena
+    std::string_view store_name(PathShard& shard, std::string_view path) {
+        if (shard.arena.empty() || shard.arena_used + path.size() > kArenaBlock) {
+            shard.arena.emplace_back(new char[std::max(kArenaBlock, path.size())]);
+            shard.arena_used = 0;
+        }
+        char* at = shard.arena.back().get() + shard.arena_used;
+        std::copy(path.begin(), path.end(), at);
+        shard.arena_used += path.size();
+        shard.live_bytes += path.size();
+        return std::string_view(at, path.size());
+    }
+
+    // the slot of path in shard, interning it if it is new; called with the shard held
+    uint32_t intern(PathShard& shard, std::string_view path) {
+        auto it = shard.index.find(path);
+        if (it != shard.index.end()) return it->second;
+        uint32_t slot;
+        if (!shard.free_slots.empty()) {
+            slot = shard.free_slots.back();
+            shard.free_slots.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(shard.entries.size());
+            shard.entries.emplace_back();
+        }
+        Entry& entry = shard.entries[slot];
+        entry.name = store_name(shard, path);
+        entry.holders = std::make_shared<ClientSet>();
+        shard.index.emplace(entry.name, slot);
+        return slot;
+    }
+
+    // adds client to the holders of slot; called with the shard held
+    void hold(PathShard& shard, uint32_t slot, ClientId client) {
+        Entry& entry = shard.entries[slot];
+        if (std::binary_search(entry.holders->begin(), entry.holders->end(), client)) {
+            index_add(client, path_id(shard, slot)); // renews the lease
+            return;
+        }
+        auto updated = std::make_shared<ClientSet>(*entry.holders);
+        insert_sorted(*updated, client);
+        entry.holders = std::move(updated);
+        index_add(client, path_id(shard, slot));
+    }
+
+    // frees slot once nobody holds its path; called with the shard held
+    void release(PathShard& shard, uint32_t slot) {
+        Entry& entry = shard.entries[slot];
+        shard.index.erase(entry.name);
+        shard.live_bytes -= entry.name.size();
+        shard.dead_bytes += entry.name.size();
+        entry = Entry();
+        shard.free_slots.push_back(slot);
+        if (shard.dead_bytes > kArenaBlock && shard.dead_bytes > shard.live_bytes) compact(shard);
+    }
+
+    // copies the live names into a fresh arena once released ones take up most of it
+    void compact(PathShard& shard) {
+        std::vector<std::unique_ptr<char[]>> old_arena = std::move(shard.arena);
+        shard.arena.clear();
+        shard.arena_used = 0;
+        shard.live_bytes = 0;
+        shard.dead_bytes = 0;
+        shard.index.clear();
+        for (uint32_t slot = 0; slot < shard.entries.size(); slot++) {
+            Entry& entry = shard.entries[slot];
+            if (!entry.holders) continue;
+            entry.name = store_name(shard, entry.name);
+            shard.index.emplace(entry.name, slot);
+        }
+    }
+
+    // reverse index upkeep, called with the path's shard held; adding a path that is there renews its lease
+    void index_add(ClientId client, PathId path) {
+        ClientShard& shard = client_shards[client % client_shards.size()];
+        std::lock_guard<std::mutex> lock(shard.mu);
+        Leases& leases = shard.clients[client];
+        leases.old.erase(path);
+        leases.young.insert(path);
+    }
+
+    void index_remove(ClientId client, PathId path) {
+        ClientShard& shard = client_shards[client % client_shards.size()];
+        std::lock_guard<std::mutex> lock(shard.mu);
+        auto it = shard.clients.find(client);
+        if (it == shard.clients.end()) return;
+        it->second.young.erase(path);
+        it->second.old.erase(path);
+        if (it->second.young.empty() && it->second.old.empty()) shard.clients.erase(it);
+    }
+
+    std::vector<PathShard> path_shards;
+    std::vector<ClientShard> client_shards;
+    ClientTable table;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef LIST_DIR_HANDLER_HPP
+#define LIST_DIR_HANDLER_HPP
+
+#include "filesystem_server.hpp"
+#include "async_call_data.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// list_dir streams a directory a page at a time straight off readdir(), the next page is only read once the previous
+// one went out, so a directory of millions of entries costs one page of memory on either side
+// Every entry carries its cookie (telldir() right after it); a listing resumed with a cookie seeks there and goes on
+// with the entries that follow. "." and ".." come through like any other entry.
+class ListDirCallData : public CallData {
+public:
+    ListDirCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), writer(&ctx) {
+        service->Requestlist_dir(&ctx, &request, &writer, cq, cq, &request_tag);
+    }
+
+    ~ListDirCallData() {
+        if (dir) closedir(dir);
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new ListDirCallData(fs, service, cq);
+                Start();
+                break;
+            }
+            case WRITE: {
+                if (!ok) { // the client stopped reading, e.g. its readdir buffer is full and the directory was closed
+                    writer.Finish(grpc::Status::CANCELLED, &finish_tag);
+                    return;
+                }
+                SendNext();
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, WRITE, FINISH };
+    static const uint32_t kDefaultPage = 512;
+    static const uint32_t kMaxPage = 4096;
+
+    void Start() {
+        path = request.directory();
+        // a client that caches the listing holds a callback on the directory, as with ls
+        if (!request.client_id().empty()) fs->interests.add(FileSystem::directory_key(path), request.client_id());
+        dir = opendir(path.c_str());
+        if (!dir) {
+            if (errno == ENOENT) {
+                writer.Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "Specified Directory not found"), &finish_tag);
+            } else if (errno == ENOTDIR) {
+                writer.Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Path is not a directory"), &finish_tag);
+            } else {
+                writer.Finish(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to open the directory"), &finish_tag);
+            }
+            return;
+        }
+        if (request.cursor() != 0) seekdir(dir, static_cast<long>(request.cursor()));
+        page_size = request.page_size() == 0 ? kDefaultPage : std::min(request.page_size(), kMaxPage);
+        prefix = path + (path.back() == '/' ? "" : "/");
+        SendNext();
+    }
+
+    void SendNext() {
+        afs_operation::DirPage page;
+        errno = 0;
+        struct dirent* entry = nullptr;
+        while (static_cast<uint32_t>(page.entries_size()) < page_size && (entry = readdir(dir)) != nullptr) {
+            afs_operation::DirEntry* out = page.add_entries();
+            out->set_name(entry->d_name);
+            out->set_inode(entry->d_ino);
+            out->set_cookie(static_cast<uint64_t>(telldir(dir)));
+            bool dot = strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0;
+            unsigned char type = entry->d_type;
+            struct stat s;
+            if (request.with_attributes() && !dot && fs->stat_cached(prefix + entry->d_name, &s)) {
+                FileSystem::fill_attributes(s, out->mutable_attr());
+                type = IFTODT(s.st_mode);
+            } else if (type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = IFTODT(s.st_mode); // the filesystem doesn't fill d_type
+            }
+            out->set_type(type);
+        }
+        if (page.entries_size() == 0) {
+            if (errno != 0) {
+                writer.Finish(grpc::Status(grpc::StatusCode::ABORTED, "Error occurred while iterating through the directory"), &finish_tag);
+            } else {
+                writer.Finish(grpc::Status::OK, &finish_tag);
+            }
+            return;
+        }
+        writer.Write(page, &write_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    afs_operation::ListDirRequest request;
+    grpc::ServerAsyncWriter<afs_operation::DirPage> writer;
+    std::string path;
+    std::string prefix;
+    DIR* dir = nullptr;
+    uint32_t page_size = kDefaultPage;
+    CallTag request_tag{this, REQUEST};
+    CallTag write_tag{this, WRITE};
+    CallTag finish_tag{this, FINISH};
+};
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef METADATA_CACHE_HPP
+#define METADATA_CACHE_HPP
+
+#include "tree_watcher.hpp"
+#include "afs_operation.pb.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+// Attributes (getattr) and directory listings (ls) of the served tree, kept in memory
+// A hit costs a hash lookup instead of a stat() or a directory walk. Lookups of missing paths are remembered too,
+// editors and macOS probe for files like ._name all the time.
+// The cache stays coherent two ways: the server drops what its own mutations touch (close, rename, unlink, mkdir)
+// before answering them, and the TreeWatcher on the root drops whatever anyone else changes (on_change). The server
+// only keeps a cache while the watcher runs, without it every call goes to the filesystem as before.
+// A fill that raced with an invalidation of its shard is not stored, so a stale answer can't outlive the event.
+class MetadataCache {
+public:
+    using Listing = afs_operation::ListDirectoryResponse;
+
+    struct Metrics {
+        uint64_t attr_hits = 0;
+        uint64_t attr_misses = 0;
+        uint64_t dir_hits = 0;
+        uint64_t dir_misses = 0;
+        uint64_t invalidations = 0;
+        uint64_t entries = 0;
+    };
+
+    explicit MetadataCache(size_t max_entries = 1 << 20, size_t shard_count = 64)
+        : shards(shard_count), shard_limit(std::max<size_t>(max_entries / shard_count, 16)) {}
+
+    // getattr: s from the cache, or from fill (a stat that sets errno on failure) which is then remembered
+    // Returns false with errno set like fill does
+    bool stat(const std::string& path, struct stat* s, const std::function<bool(const std::string&, struct stat*)>& fill) {
+        std::string key = normalize(path);
+        Shard& shard = shard_of(key);
+        uint64_t generation;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mu);
+            auto it = shard.attrs.find(key);
+            if (it != shard.attrs.end()) {
+                attr_hits++;
+                if (!it->second.exists) {
+                    errno = ENOENT;
+                    return false;
+                }
+                *s = it->second.s;
+                return true;
+            }
+            generation = shard.generation;
+        }
+        attr_misses++;
+        bool found = fill(path, s);
+        int error = errno;
+        if (found || error == ENOENT) {
+            std::unique_lock<std::shared_mutex> lock(shard.mu);
+            if (shard.generation == generation) {
+                make_room(shard);
+                Attr& attr = shard.attrs[key];
+                attr.exists = found;
+                if (found) attr.s = *s;
+            }
+        }
+        errno = error;
+        return found;
+    }
+
+    // ls: the listing of dir from the cache, or from fill which is then remembered if it succeeds
+    bool list(const std::string& dir, Listing& out, const std::function<bool(Listing&)>& fill) {
+        std::string key = normalize(dir);
+        Shard& shard = shard_of(key);
+        uint64_t generation;
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mu);
+            auto it = shard.listings.find(key);
+            if (it != shard.listings.end()) {
+                dir_hits++;
+                out.CopyFrom(*it->second);
+                return true;
+            }
+            generation = shard.generation;
+        }
+        dir_misses++;
+        if (!fill(out)) return false;
+        std::unique_lock<std::shared_mutex> lock(shard.mu);
+        if (shard.generation == generation) {
+            make_room(shard);
+            shard.listings[key] = std::make_shared<const Listing>(out);
+        }
+        return true;
+    }
+
+    // path was created, changed or removed: drops its attributes and listing and its parent's
+    void invalidate(const std::string& path) {
+        std::string key = normalize(path);
+        drop(key);
+        size_t slash = key.rfind('/');
+        drop(slash == std::string::npos ? std::string(".") : key.substr(0, slash));
+    }
+
+    // a directory moved or vanished: everything below it is wrong, and nothing is indexed by prefix
+    void invalidate_all() {
+        for (Shard& shard : shards) {
+            std::unique_lock<std::shared_mutex> lock(shard.mu);
+            shard.attrs.clear();
+            shard.listings.clear();
+            shard.generation++;
+        }
+        invalidations++;
+    }
+
+    // what the TreeWatcher saw: a directory that moved or vanished takes everything below it along
+    void on_change(const TreeWatcher::Change& reported) {
+        TreeWatcher::Change change = reported;
+        if (!TreeWatcher::strip_server_temp(change)) return;
+        if (change.kind == TreeWatcher::Change::OVERFLOW || (change.directory && change.kind != TreeWatcher::Change::CHANGED)) {
+            invalidate_all();
+            return;
+        }
+        invalidate(change.path);
+        if (change.kind == TreeWatcher::Change::MOVED) invalidate(change.new_path);
+    }
+
+    Metrics metrics() {
+        Metrics m;
+        m.attr_hits = attr_hits;
+        m.attr_misses = attr_misses;
+        m.dir_hits = dir_hits;
+        m.dir_misses = dir_misses;
+        m.invalidations = invalidations;
+        for (Shard& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mu);
+            m.entries += shard.attrs.size() + shard.listings.size();
+        }
+        return m;
+    }
+
+    // the key a path is cached under: "./root/a/../b/" and "root/b" are the same entry
+    static std::string normalize(const std::string& path) {
+        std::string key = std::filesystem::path(path).lexically_normal().string();
+        while (key.size() > 1 && key.back() == '/') key.pop_back();
+        return key.empty() ? std::string(".") : key;
+    }
+
+private:
+    struct Attr {
+        bool exists;
+        struct stat s;
+    };
+
+    struct Shard {
+        std::shared_mutex mu;
+        std::unordered_map<std::string, Attr> attrs;
+        std::unordered_map<std::string, std::shared_ptr<const Listing>> listings;
+        uint64_t generation = 0; // bumped by every invalidation, fills that started before it are dropped
+    };
+
+    Shard& shard_of(const std::string& key) { return shards[std::hash<std::string>()(key) % shards.size()]; }
+
+    void drop(const std::string& key) {
+        Shard& shard = shard_of(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mu);
+        shard.attrs.erase(key);
+        shard.listings.erase(key);
+        shard.generation++;
+        invalidations++;
+    }
+
+    // a full shard starts over rather than tracking recency on every hit; called with the shard held
+    void make_room(Shard& shard) {
+        if (shard.attrs.size() + shard.listings.size() < shard_limit) return;
+        shard.attrs.clear();
+        shard.listings.clear();
+    }
+
+    std::vector<Shard> shards;
+    size_t shard_limit;
+    std::atomic<uint64_t> attr_hits{0};
+    std::atomic<uint64_t> attr_misses{0};
+    std::atomic<uint64_t> dir_hits{0};
+    std::atomic<uint64_t> dir_misses{0};
+    std::atomic<uint64_t> invalidations{0};
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef MPSC_RING_HPP
+#define MPSC_RING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded queue for many producers and a single consumer, without locks
+// Every cell carries a sequence number telling whose turn it is: a producer claims a cell by advancing tail with a
+// CAS and publishes it by bumping the cell's sequence, the consumer takes published cells in order and hands them back
+// for the next lap. A full ring makes push() fail instead of waiting or growing, the caller decides what to do then.
+// The capacity is rounded up to a power of two and all cells are allocated up front.
+template <class T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t min_capacity) {
+        capacity_ = 2;
+        while (capacity_ < min_capacity) capacity_ <<= 1;
+        mask = capacity_ - 1;
+        cells.reset(new Cell[capacity_]);
+        for (size_t i = 0; i < capacity_; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // any thread; false when the ring is full
+    bool push(const T& value) {
+        Cell* cell;
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            intptr_t diff = static_cast<intptr_t>(cell->seq.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                return false; // the consumer has not freed this cell from the previous lap yet
+            } else {
+                pos = tail.load(std::memory_order_relaxed); // another producer took it, try the next one
+            }
+        }
+        cell->value = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only; false when the next cell is not published yet
+    bool pop(T& out) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Cell& cell = cells[pos & mask];
+        if (cell.seq.load(std::memory_order_acquire) != pos + 1) return false;
+        out = std::move(cell.value);
+        cell.seq.store(pos + capacity_, std::memory_order_release);
+        head.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // consumer only
+    bool empty() const {
+        size_t pos = head.load(std::memory_order_relaxed);
+        return cells[pos & mask].seq.load(std::memory_order_acquire) != pos + 1;
+    }
+
+    // approximate when read while producers are pushing, for metrics
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    size_t capacity_;
+    size_t mask;
+    std::unique_ptr<Cell[]> cells;
+    alignas(64) std::atomic<size_t> tail{0}; // next cell a producer claims
+    alignas(64) std::atomic<size_t> head{0}; // next cell the consumer takes
+};
+
+#endif
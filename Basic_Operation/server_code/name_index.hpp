@@ -0,0 +1,466 @@
+#ifndef NAME_INDEX_HPP
+#define NAME_INDEX_HPP
+
+#include "tree_watcher.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+// Every name under the served root, in memory, for find by pattern without walking the disk
+// The tree is kept as entries that point at their parent directory, so a path costs one name however deep it is,
+// and renaming a directory is one update however much is below it. Next to it, each three character piece of a
+// name (trigram) maps to the entries whose name contains it. A pattern like *.parquet then only looks at the
+// entries holding ".pa", "par", ..., "uet", instead of at all five million; patterns without three literal
+// characters in a row fall back to checking every name, still without touching the disk.
+// The index is read from the disk once in the background when the server starts (and again after the watcher lost
+// events), and kept up to date by the server's own close, rename, unlink and mkdir and by what the TreeWatcher
+// reports. Updates that arrive while the disk is read are replayed onto the result before it is put in place.
+class NameIndex {
+public:
+    enum Answer { ANSWERED, NOT_READY, NO_DIRECTORY };
+
+    struct Result {
+        std::vector<std::string> paths; // from the served root: "/data/a.parquet"
+        bool truncated = false;         // more matched than the limit
+        uint64_t candidates = 0;        // entries looked at
+    };
+
+    ~NameIndex() { stop(); }
+
+    // reads root_dir in the background; queries get NOT_READY until that is done
+    void start(const std::string& root_dir) {
+        root = normalize(root_dir);
+        builder = std::thread(&NameIndex::Run, this);
+        rescan();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(build_mu);
+            stopping = true;
+        }
+        build_cv.notify_all();
+        if (builder.joinable()) builder.join();
+    }
+
+    // the index may have missed changes: read the disk again, answering from the old one meanwhile
+    void rescan() {
+        {
+            std::lock_guard<std::mutex> lock(build_mu);
+            rescan_wanted = true;
+        }
+        build_cv.notify_all();
+    }
+
+    // server paths (under the root dir); anything outside the root is ignored
+    void add(const std::string& path, bool directory) { update(Op{Op::ADD, relative(path), "", directory}); }
+    void remove(const std::string& path) { update(Op{Op::REMOVE, relative(path), "", false}); }
+    void move(const std::string& old_path, const std::string& new_path, bool directory) {
+        update(Op{Op::MOVE, relative(old_path), relative(new_path), directory});
+    }
+
+    // what the TreeWatcher saw
+    void on_change(const TreeWatcher::Change& reported) {
+        TreeWatcher::Change change = reported;
+        if (!TreeWatcher::strip_server_temp(change)) return; // the server's temp files never show in the index
+        switch (change.kind) {
+            case TreeWatcher::Change::CHANGED: add(change.path, change.directory); break;
+            case TreeWatcher::Change::REMOVED: remove(change.path); break;
+            case TreeWatcher::Change::MOVED: move(change.path, change.new_path, change.directory); break;
+            case TreeWatcher::Change::OVERFLOW: rescan(); break;
+        }
+    }
+
+    // paths under directory (a server path) matching pattern, at most limit of them
+    // pattern is a glob (fnmatch) matched against names, or, when it holds a '/', against paths relative to
+    // directory with '*' stopping at slashes; with substring it is a plain piece of the name instead
+    Answer query(const std::string& directory, const std::string& pattern, bool substring, size_t limit, Result& result) {
+        std::string base_path = relative(directory);
+        std::shared_lock<std::shared_mutex> lock(mu);
+        if (!ready) return NOT_READY;
+        if (base_path == kOutside) return NO_DIRECTORY;
+        uint32_t base = tree.find(base_path);
+        if (base == kNone || !tree.entries[base].directory) return NO_DIRECTORY;
+
+        bool by_path = !substring && pattern.find('/') != std::string::npos;
+        std::string name_pattern = by_path ? pattern.substr(pattern.rfind('/') + 1) : pattern;
+        std::vector<std::string> literals = substring ? std::vector<std::string>{pattern} : literal_runs(name_pattern);
+        std::vector<uint32_t> candidates;
+        bool every_entry = !tree.candidates(literals, candidates);
+        size_t count = every_entry ? tree.entries.size() : candidates.size();
+
+        std::vector<uint32_t> chain;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t id = every_entry ? static_cast<uint32_t>(i) : candidates[i];
+            const Entry& entry = tree.entries[id];
+            if (id == 0 || !entry.alive) continue;
+            result.candidates++;
+            if (substring ? entry.name.find(pattern) == std::string::npos
+                          : fnmatch(name_pattern.c_str(), entry.name.c_str(), 0) != 0) continue;
+            // up to the root: the entry may sit below a removed directory, or outside the one asked about
+            chain.clear();
+            size_t below = std::string::npos;
+            if (!tree.chain_of(id, chain)) continue;
+            for (size_t c = 0; c < chain.size(); c++) {
+                if (chain[c] == base) below = c;
+            }
+            if (base == 0) below = chain.size();
+            if (below == std::string::npos || below == 0) continue; // elsewhere, or the directory itself
+            std::string path;
+            for (size_t c = chain.size(); c-- > 0;) path += "/" + tree.entries[chain[c]].name;
+            if (by_path) {
+                // chain[below - 1] is the first entry under directory
+                std::string under;
+                for (size_t c = below; c-- > 0;) under += (under.empty() ? "" : "/") + tree.entries[chain[c]].name;
+                if (fnmatch(pattern.c_str(), under.c_str(), FNM_PATHNAME) != 0) continue;
+            }
+            if (result.paths.size() >= limit) {
+                result.truncated = true;
+                break;
+            }
+            result.paths.push_back(std::move(path));
+        }
+        return ANSWERED;
+    }
+
+private:
+    static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+    static inline const std::string kOutside = std::string(1, '\0'); // not a path under the root
+
+    struct Entry {
+        uint32_t parent;
+        bool directory;
+        bool alive;
+        std::string name;
+        size_t below = 0; // live entries under a directory, they go with it when it is removed
+    };
+
+    struct Op {
+        enum Kind { ADD, REMOVE, MOVE };
+        Kind kind;
+        std::string path;     // relative to the root, "" for the root itself
+        std::string new_path; // MOVE only
+        bool directory;
+    };
+
+    struct Tree {
+        std::vector<Entry> entries{Entry{kNone, true, true, ""}}; // 0 is the root
+        std::unordered_map<std::string, uint32_t> children;         // child_key(parent, name) -> entry
+        std::unordered_map<uint32_t, std::vector<uint32_t>> grams;  // trigram -> entries, ascending
+        size_t live = 0;
+        size_t dead = 0; // removed entries still taking space, compacted away once they outnumber the live ones
+
+        static std::string child_key(uint32_t parent, const std::string& name) {
+            return std::string(reinterpret_cast<const char*>(&parent), sizeof(parent)) + name;
+        }
+
+        uint32_t child(uint32_t parent, const std::string& name) const {
+            auto it = children.find(child_key(parent, name));
+            return it == children.end() ? kNone : it->second;
+        }
+
+        uint32_t find(const std::string& path) const {
+            uint32_t id = 0;
+            for_each_name(path, [&](const std::string& name) {
+                if (id != kNone) id = child(id, name);
+            });
+            return id;
+        }
+
+        // the entry for path, created with its missing parents
+        uint32_t add(const std::string& path, bool directory) {
+            uint32_t id = 0;
+            for_each_name(path, [&](const std::string& name) {
+                uint32_t next = child(id, name);
+                if (next == kNone) next = create(id, name, true);
+                id = next;
+            });
+            if (id != 0) entries[id].directory = directory;
+            return id;
+        }
+
+        uint32_t add_child(uint32_t parent, const std::string& name, bool directory) {
+            uint32_t id = child(parent, name);
+            if (id == kNone) return create(parent, name, directory);
+            entries[id].directory = directory;
+            return id;
+        }
+
+        void remove(const std::string& path) {
+            uint32_t id = find(path);
+            if (id == kNone || id == 0) return;
+            unlink(id);
+        }
+
+        void move(const std::string& old_path, const std::string& new_path, bool directory) {
+            uint32_t id = find(old_path);
+            if (id == 0) return;
+            if (id == kNone) { // never seen: it is there now all the same
+                add(new_path, directory);
+                return;
+            }
+            std::string name = std::filesystem::path(new_path).filename().string();
+            uint32_t parent = add(std::filesystem::path(new_path).parent_path().string(), true);
+            uint32_t replaced = child(parent, name);
+            if (replaced == id) return;
+            if (replaced != kNone) unlink(replaced);
+            children.erase(child_key(entries[id].parent, entries[id].name));
+            // the trigrams of the old name stay behind, a query checks every candidate's name anyway
+            if (name != entries[id].name) index(id, name);
+            int64_t moving = 1 + static_cast<int64_t>(entries[id].below);
+            count_above(id, -moving);
+            entries[id].parent = parent;
+            entries[id].name = name;
+            count_above(id, moving);
+            children[child_key(parent, name)] = id;
+        }
+
+        // entries whose name may contain every literal, false if the literals say nothing (no three characters
+        // in a row), when every entry is a candidate
+        bool candidates(const std::vector<std::string>& literals, std::vector<uint32_t>& out) const {
+            std::vector<const std::vector<uint32_t>*> lists;
+            static const std::vector<uint32_t> none;
+            for (const std::string& literal : literals) {
+                for (size_t i = 0; i + 3 <= literal.size(); i++) {
+                    auto it = grams.find(gram(literal, i));
+                    lists.push_back(it == grams.end() ? &none : &it->second);
+                }
+            }
+            if (lists.empty()) return false;
+            std::sort(lists.begin(), lists.end(), [](auto* a, auto* b) { return a->size() < b->size(); });
+            out = *lists[0];
+            for (size_t l = 1; l < lists.size() && !out.empty(); l++) {
+                std::vector<uint32_t> both;
+                std::set_intersection(out.begin(), out.end(), lists[l]->begin(), lists[l]->end(), std::back_inserter(both));
+                out.swap(both);
+            }
+            return true;
+        }
+
+        // id and its directories up to (not including) the root, false if one of them was removed
+        bool chain_of(uint32_t id, std::vector<uint32_t>& chain) const {
+            for (; id != 0; id = entries[id].parent) {
+                if (!entries[id].alive) return false;
+                chain.push_back(id);
+            }
+            return true;
+        }
+
+        // the same tree without the removed entries
+        Tree compacted() const {
+            Tree fresh;
+            std::vector<uint32_t> chain;
+            for (uint32_t id = 1; id < entries.size(); id++) {
+                chain.clear();
+                if (!chain_of(id, chain)) continue;
+                std::string path;
+                for (size_t c = chain.size(); c-- > 0;) path += (path.empty() ? "" : "/") + entries[chain[c]].name;
+                fresh.add(path, entries[id].directory);
+            }
+            return fresh;
+        }
+
+    private:
+        uint32_t create(uint32_t parent, const std::string& name, bool directory) {
+            uint32_t id = static_cast<uint32_t>(entries.size());
+            entries.push_back(Entry{parent, directory, true, name});
+            children[child_key(parent, name)] = id;
+            index(id, name);
+            count_above(id, 1);
+            live++;
+            return id;
+        }
+
+        // entries below id go with it: they can no longer be reached, and count as dead from now on
+        void unlink(uint32_t id) {
+            children.erase(child_key(entries[id].parent, entries[id].name));
+            entries[id].alive = false;
+            size_t gone = 1 + entries[id].below;
+            count_above(id, -static_cast<int64_t>(gone));
+            live -= gone;
+            dead += gone;
+        }
+
+        // adds delta to the live count of every directory above id
+        void count_above(uint32_t id, int64_t delta) {
+            for (uint32_t up = entries[id].parent; up != kNone; up = entries[up].parent) {
+                entries[up].below = static_cast<size_t>(static_cast<int64_t>(entries[up].below) + delta);
+            }
+        }
+
+        void index(uint32_t id, const std::string& name) {
+            for (size_t i = 0; i + 3 <= name.size(); i++) {
+                std::vector<uint32_t>& list = grams[gram(name, i)];
+                if (list.empty() || list.back() < id) {
+                    list.push_back(id);
+                } else { // a renamed entry is older than the ones listed already
+                    auto at = std::lower_bound(list.begin(), list.end(), id);
+                    if (at == list.end() || *at != id) list.insert(at, id);
+                }
+            }
+        }
+
+        static uint32_t gram(const std::string& s, size_t i) {
+            return (static_cast<uint32_t>(static_cast<unsigned char>(s[i])) << 16) |
+                   (static_cast<uint32_t>(static_cast<unsigned char>(s[i + 1])) << 8) |
+                   static_cast<uint32_t>(static_cast<unsigned char>(s[i + 2]));
+        }
+
+        static void for_each_name(const std::string& path, const std::function<void(const std::string&)>& fn) {
+            size_t start = 0;
+            while (start <= path.size()) {
+                size_t end = path.find('/', start);
+                if (end == std::string::npos) end = path.size();
+                if (end > start) fn(path.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+    };
+
+    // the parts of a glob that have to appear in a matching name as they are
+    static std::vector<std::string> literal_runs(const std::string& pattern) {
+        std::vector<std::string> runs(1);
+        for (size_t i = 0; i < pattern.size(); i++) {
+            char c = pattern[i];
+            if (c == '\\' && i + 1 < pattern.size()) {
+                runs.back() += pattern[++i];
+            } else if (c == '*' || c == '?' || c == '[') {
+                if (c == '[') { // skip the class, a ']' right after the '[' (or "[!") belongs to it
+                    size_t j = i + 1;
+                    if (j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^')) j++;
+                    if (j < pattern.size() && pattern[j] == ']') j++;
+                    while (j < pattern.size() && pattern[j] != ']') j++;
+                    i = j;
+                }
+                if (!runs.back().empty()) runs.emplace_back();
+            } else {
+                runs.back() += c;
+            }
+        }
+        return runs;
+    }
+
+    // "./root/a/../b/" and "root/b" are the same path; the root itself is ""
+    static std::string normalize(const std::string& path) {
+        std::string key = std::filesystem::path(path).lexically_normal().string();
+        while (key.size() > 1 && key.back() == '/') key.pop_back();
+        return key == "." ? std::string() : key;
+    }
+
+    std::string relative(const std::string& path) const {
+        std::string key = normalize(path);
+        if (key == root) return "";
+        if (root.empty()) return key.front() == '/' || key.compare(0, 3, "../") == 0 ? kOutside : key;
+        if (key.size() > root.size() && key.compare(0, root.size(), root) == 0 && key[root.size()] == '/') {
+            return key.substr(root.size() + 1);
+        }
+        return kOutside;
+    }
+
+    void apply(Tree& target, const Op& op) {
+        if (op.path == kOutside && (op.kind != Op::MOVE || op.new_path == kOutside)) return;
+        switch (op.kind) {
+            case Op::ADD: target.add(op.path, op.directory); break;
+            case Op::REMOVE: target.remove(op.path); break;
+            case Op::MOVE:
+                if (op.new_path == kOutside) target.remove(op.path);
+                else if (op.path == kOutside) target.add(op.new_path, op.directory);
+                else target.move(op.path, op.new_path, op.directory);
+                break;
+        }
+    }
+
+    void update(Op op) {
+        std::unique_lock<std::shared_mutex> lock(mu);
+        apply(tree, op);
+        if (building) journal.push_back(std::move(op));
+        if (tree.dead > 4096 && tree.dead > tree.live) tree = tree.compacted();
+    }
+
+    void Run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(build_mu);
+                build_cv.wait(lock, [this] { return stopping || rescan_wanted; });
+                if (stopping) return;
+                rescan_wanted = false;
+            }
+            {
+                std::unique_lock<std::shared_mutex> lock(mu);
+                building = true;
+                journal.clear();
+            }
+            auto started = std::chrono::steady_clock::now();
+            Tree fresh;
+            if (!scan(fresh)) return;
+            std::unique_lock<std::shared_mutex> lock(mu);
+            for (const Op& op : journal) apply(fresh, op);
+            journal.clear();
+            tree = std::move(fresh);
+            building = false;
+            ready = true;
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+            std::cout << "Name index: " << tree.live << " entries under " << (root.empty() ? "." : root) << " in "
+                      << elapsed.count() << " ms" << std::endl;
+        }
+    }
+
+    // reads the whole tree into fresh, false if the index is stopping
+    bool scan(Tree& fresh) {
+        std::vector<std::pair<std::string, uint32_t>> pending{{root.empty() ? "." : root, 0}};
+        while (!pending.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(build_mu);
+                if (stopping) return false;
+            }
+            auto [path, id] = std::move(pending.back());
+            pending.pop_back();
+            DIR* dir = opendir(path.c_str());
+            if (!dir) continue;
+            struct dirent* entry;
+            while ((entry = readdir(dir)) != nullptr) {
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+                struct stat s;
+                bool directory = entry->d_type == DT_DIR ||
+                    (entry->d_type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(s.st_mode));
+                uint32_t child = fresh.add_child(id, entry->d_name, directory);
+                if (directory) pending.emplace_back(path + "/" + entry->d_name, child);
+            }
+            closedir(dir);
+        }
+        return true;
+    }
+
+    std::string root; // normalized, "" when the root is the working directory
+
+    std::shared_mutex mu; // guards the fields below
+    Tree tree;
+    bool ready = false;       // the disk was read once
+    bool building = false;    // a scan runs, updates go to journal as well
+    std::vector<Op> journal;
+
+    std::mutex build_mu;
+    std::condition_variable build_cv;
+    bool rescan_wanted = false;
+    bool stopping = false;
+    std::thread builder;
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef RANGE_HANDLER_HPP
+#define RANGE_HANDLER_HPP
+
+#include "filesystem_server.hpp"
+#include "async_call_data.hpp"
+#include <iostream>
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// update_ranges applies the byte ranges a client wrote (its dirty extents) onto the server's file
+// The extents go into a copy of the base version next to the original (copy_file_range, which shares the blocks on
+// filesystems that can), and the copy replaces the file only once every extent arrived and the size checks out,
+// as close_delta does. A stream that is cut short or cancelled leaves the served file as it was. The client uploads
+// only the extents, so a small record update in a large file still costs a few bytes on the wire.
+// It is only accepted on top of the version the client started from.
+class RangeUpdateCallData : public CallData {
+public:
+    RangeUpdateCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), reader(&ctx) {
+        service->Requestupdate_ranges(&ctx, &reader, cq, cq, &request_tag);
+    }
+
+    ~RangeUpdateCallData() {
+        if (fd >= 0) ::close(fd);
+        if (!temp_path.empty()) ::unlink(temp_path.c_str()); // only still set if the update was not applied
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new RangeUpdateCallData(fs, service, cq);
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case READ: {
+                if (!ok) { // the client called WritesDone, every extent has arrived
+                    Complete();
+                    return;
+                }
+                grpc::Status status = path.empty() ? Begin() : grpc::Status::OK;
+                if (status.ok()) status = Apply();
+                if (!status.ok()) {
+                    std::cerr << "Ranged close of " << path << " failed: " << status.error_message() << std::endl;
+                    reader.FinishWithError(status, &finish_tag);
+                    return;
+                }
+                reader.Read(&request, &read_tag);
+                break;
+            }
+            case FINISH: {
+                delete this;
+                break;
+            }
+        }
+    }
+
+private:
+    enum Event { REQUEST, READ, FINISH };
+
+    grpc::Status Begin() {
+        std::string directory = request.directory();
+        filename = request.filename();
+        path = directory + (directory.back()=='/'? "" : "/") + filename;
+        client_id = request.client_id();
+        file_size = request.file_size();
+        expected_bytes = request.patch_bytes();
+        base_timestamp = request.base_timestamp();
+        std::cout << "[SERVER] update_ranges() called for " << path << std::endl;
+        if (file_size < 0 || (request.truncated() && request.truncate_to() < 0)) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Negative file size.");
+        }
+
+        // the copy is taken from the file itself, so it has to hold its bytes rather than a storage placeholder
+        if (!fs->storage->prepare_update(path)) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version is not available for an in place update, send the whole file.");
+        }
+        int base_fd = ::open(path.c_str(), O_RDONLY);
+        struct stat s;
+        if (base_fd < 0 || fstat(base_fd, &s) != 0) {
+            if (base_fd >= 0) ::close(base_fd);
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "Base version not found on the server.");
+        }
+        if (stat_timestamp(s) != base_timestamp) {
+            ::close(base_fd);
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version changed, send the whole file.");
+        }
+        base_mode = s.st_mode;
+
+        std::filesystem::path file_path(path);
+        std::string temp = (file_path.parent_path() / ("." + filename + ".afs_range.XXXXXX")).string();
+        std::vector<char> temp_name(temp.begin(), temp.end());
+        temp_name.push_back('\0');
+        fd = mkstemp(temp_name.data());
+        if (fd < 0) {
+            ::close(base_fd);
+            return grpc::Status(grpc::StatusCode::PERMISSION_DENIED, "cant open file to write");
+        }
+        temp_path = temp_name.data();
+        // bytes past a truncation point are gone on the client, anything it wrote there afterwards comes as extents
+        int64_t keep = request.truncated() ? std::min<int64_t>(request.truncate_to(), s.st_size) : s.st_size;
+        bool copied = copy_prefix(base_fd, fd, keep);
+        ::close(base_fd);
+        if (!copied) {
+            return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to copy the base version.");
+        }
+        return grpc::Status::OK;
+    }
+
+    grpc::Status Apply() {
+        for (const afs_operation::Extent& extent : request.extents()) {
+            const char* data = extent.data().data();
+            size_t len = extent.data().size();
+            int64_t offset = extent.offset();
+            if (offset < 0 || offset > file_size || static_cast<int64_t>(len) > file_size - offset) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Extent outside the new version.");
+            }
+            while (len > 0) {
+                ssize_t n = pwrite(fd, data, len, offset);
+                if (n <= 0) {
+                    return grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write an extent.");
+                }
+                data += n;
+                len -= static_cast<size_t>(n);
+                offset += n;
+            }
+            patched_bytes += extent.data().size();
+        }
+        return grpc::Status::OK;
+    }
+
+    void Complete() {
+        std::cout << "ranged close is in progress" << std::endl;
+        if (path.empty()) {
+            std::cerr << "Ranged close received no data." << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "No file data received."), &finish_tag);
+            return;
+        }
+        if (patched_bytes != expected_bytes) {
+            std::cerr << "Ranged close of " << path << " was cut short" << std::endl;
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::DATA_LOSS, "Not every extent arrived."), &finish_tag);
+            return;
+        }
+        if (ftruncate(fd, file_size) != 0) {
+            reader.FinishWithError(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to set the file size."), &finish_tag);
+            return;
+        }
+        fchmod(fd, base_mode & 07777);
+        ::close(fd);
+        fd = -1;
+        {
+            // someone else may have closed the file while the extents arrived, their version must not be lost silently
+            std::lock_guard<std::mutex> commit(fs->commit_lock(path));
+            if (get_file_timestamp(path) != base_timestamp) {
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "Base version changed, send the whole file."), &finish_tag);
+                return;
+            }
+            if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+                reader.FinishWithError(grpc::Status(grpc::StatusCode::INTERNAL, "Failed to replace the file."), &finish_tag);
+                return;
+            }
+            temp_path.clear();
+            std::cout << "[SERVER] Patched " << path << ": " << patched_bytes << " bytes written, final size " << file_size << std::endl;
+            response.set_timestamp(fs->publish_close(path, client_id));
+        }
+        reader.Finish(response, grpc::Status::OK, &finish_tag);
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    grpc::ServerAsyncReader<afs_operation::FileResponse, afs_operation::RangeUpdate> reader;
+    afs_operation::RangeUpdate request;
+    afs_operation::FileResponse response;
+    std::string filename;
+    std::string path;
+    std::string temp_path; // the staging copy the extents go into
+    std::string client_id;
+    int fd = -1;
+    int64_t base_timestamp = 0;
+    mode_t base_mode = 0644;
+    int64_t file_size = 0;
+    int64_t patched_bytes = 0;
+    int64_t expected_bytes = 0;
+    CallTag request_tag{this, REQUEST};
+    CallTag read_tag{this, READ};
+    CallTag finish_tag{this, FINISH};
+};
+
+#endif
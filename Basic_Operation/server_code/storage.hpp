@@ -0,0 +1,157 @@
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// How the server keeps file content on disk
+// Every path is still a regular file under root_dir with the size and mtime clients see, so ls, getattr, rename,
+// unlink and mkdir never need to know the backend. What differs is where the bytes live: PosixStorage keeps them in
+// the file itself, DedupStorage (dedup_storage.hpp) in a shared chunk store with the file holding only a placeholder.
+
+int64_t stat_timestamp(const struct stat& s);
+
+// the first length bytes of from into to, for the closes that stage a new version in a copy of the base
+// copy_file_range shares the blocks on filesystems that can, anything else is copied by hand
+inline bool copy_prefix(int from, int to, int64_t length) {
+#ifdef __linux__
+    loff_t in = 0, out = 0;
+    while (in < length) {
+        ssize_t n = copy_file_range(from, &in, to, &out, static_cast<size_t>(length - in), 0);
+        if (n > 0) continue;
+        if (n == 0) return false; // the base shrank underneath us
+        break; // not supported between these files, copy by hand
+    }
+#else
+    int64_t in = 0, out = 0;
+#endif
+    std::vector<char> buffer(1024 * 1024);
+    while (in < length) {
+        ssize_t n = pread(from, buffer.data(), static_cast<size_t>(std::min<int64_t>(buffer.size(), length - in)), in);
+        if (n <= 0) return false;
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = pwrite(to, buffer.data() + done, static_cast<size_t>(n - done), out);
+            if (w <= 0) return false;
+            done += w;
+            out += w;
+        }
+        in += n;
+    }
+    return true;
+}
+
+// one version of a stored file, opened for reading; size and version stay fixed for as long as it is open
+class StoredFile {
+public:
+    virtual ~StoredFile() = default;
+    virtual int64_t size() const = 0;
+    virtual int64_t version() const = 0; // the stamp clients see (mtime in ns)
+    virtual mode_t mode() const = 0;
+    // reads up to len bytes at offset like pread, 0 at the end of the file and -1 on error
+    virtual ssize_t read(char* out, size_t len, int64_t offset) = 0;
+};
+
+// a new version of a file written front to back by a full close; commit() makes it the current version
+class StoredWriter {
+public:
+    virtual ~StoredWriter() = default;
+    virtual bool write(const char* data, size_t len) = 0;
+    virtual bool commit() = 0;
+};
+
+class Storage {
+public:
+    virtual ~Storage() = default;
+    virtual const char* name() const = 0;
+    // nullptr if path is missing or not a regular file
+    virtual std::unique_ptr<StoredFile> open(const std::string& path) = 0;
+    // nullptr if the file can't be created
+    virtual std::unique_ptr<StoredWriter> create(const std::string& path) = 0;
+    // the POSIX view of path (size, mode and mtime of the logical file)
+    virtual bool stat(const std::string& path, struct stat* s) {
+        return ::stat(path.c_str(), s) == 0;
+    }
+    // ranged closes and appends patch the file in place: make sure path holds its real bytes first
+    virtual bool prepare_update(const std::string& path) { return true; }
+    // a new version was put in place at path as a plain file (delta, ranged or append close), take it in
+    // The file's mtime is left exactly as it is, it is the version stamp that gets published
+    virtual void ingest(const std::string& path) {}
+};
+
+// a plain file read with pread, also what DedupStorage hands out for files it has not taken in
+class PosixStoredFile : public StoredFile {
+public:
+    ~PosixStoredFile() override {
+        if (fd >= 0) ::close(fd);
+    }
+
+    static std::unique_ptr<StoredFile> open(const std::string& path) {
+        std::unique_ptr<PosixStoredFile> file(new PosixStoredFile());
+        file->fd = ::open(path.c_str(), O_RDONLY);
+        if (file->fd < 0 || fstat(file->fd, &file->s) != 0 || !S_ISREG(file->s.st_mode)) return nullptr;
+    #ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    #endif
+        return file;
+    }
+
+    int64_t size() const override { return s.st_size; }
+    int64_t version() const override { return stat_timestamp(s); }
+    mode_t mode() const override { return s.st_mode; }
+    ssize_t read(char* out, size_t len, int64_t offset) override { return pread(fd, out, len, offset); }
+
+private:
+    PosixStoredFile() = default;
+    int fd = -1;
+    struct stat s {};
+};
+
+// the default backend: every file holds its own bytes, a full close rewrites it in place
+class PosixStorage : public Storage {
+public:
+    const char* name() const override { return "posix"; }
+
+    std::unique_ptr<StoredFile> open(const std::string& path) override { return PosixStoredFile::open(path); }
+
+    std::unique_ptr<StoredWriter> create(const std::string& path) override {
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) return nullptr;
+        return std::unique_ptr<StoredWriter>(new Writer(fd));
+    }
+
+private:
+    class Writer : public StoredWriter {
+    public:
+        explicit Writer(int fd) : fd(fd) {}
+        ~Writer() override {
+            if (fd >= 0) ::close(fd);
+        }
+        bool write(const char* data, size_t len) override {
+            while (len > 0) {
+                ssize_t n = ::write(fd, data, len);
+                if (n <= 0) return false;
+                data += n;
+                len -= static_cast<size_t>(n);
+            }
+            return true;
+        }
+        bool commit() override {
+            int result = ::close(fd);
+            fd = -1;
+            return result == 0;
+        }
+
+    private:
+        int fd;
+    };
+};
+
+#endif
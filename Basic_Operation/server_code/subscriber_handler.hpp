@@ -2,55 +2,219 @@
 #define SUBSCRIBER_HANDLER_HPP
 
 #include "filesystem_server.hpp"
+#include "async_call_data.hpp"
+#include <grpcpp/alarm.h>
 
-grpc::Status FileSystem::subscribe(grpc::ServerContext* context, 
-                                   const afs_operation::SubscribeRequest* request, 
-                                   grpc::ServerWriter<afs_operation::Notification>* writer) {
-    
-    std::string client_id = request->client_id();
-    std::cout << "Client subscribed: " << client_id << std::endl;
-    
-
-    // Create a queue for this client
-    std::shared_ptr<NotificationQueue> queue = std::make_shared<NotificationQueue>(); // a notification queue shared pointer
-    queue -> shutdown = false;
-    // when we call make_shared, we create a new object on the heap and then a pointer on the stack that points to the object
-    {
-        std::lock_guard<std::mutex> lock(subscriber_mutex);
-        subscribers[client_id] = queue;
+// One long-lived notification stream per client.
+// The stream is purely event driven: while its queue is empty nothing is pending on its behalf except
+// the done-notification, so an idle subscriber costs no thread. The first producer pushing after the stream
+// went idle fires an alarm on this stream's completion queue, and that wakes the stream up to start writing.
+class SubscribeCallData : public CallData {
+public:
+    SubscribeCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), writer(&ctx) {
+        // the done tag replaces the old monitor thread that polled IsCancelled() every 5 seconds
+        ctx.AsyncNotifyWhenDone(&done_tag);
+        service->Requestsubscribe(&ctx, &request, &writer, cq, cq, &request_tag);
     }
 
-    std::cout << "Client " << client_id << " subscribed for notifications" << std::endl;
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) { // server shutdown, the call never started so no done tag will arrive
+                    delete this;
+                    return;
+                }
+                new SubscribeCallData(fs, service, cq);
+                Start();
+                break;
+            }
+            case WRITE: {
+                writing = false;
+                if (!ok) {
+                    // If Write fails (client disconnected), we stop streaming
+                    std::cout << "Client disconnected: " << client_id << std::endl;
+                    BeginFinish();
+                    break;
+                }
+                SendNext();
+                break;
+            }
+            case WAKE: {
+                {
+                    std::lock_guard<std::mutex> lock(queue->mu);
+                    wake_pending = false;
+                }
+                SendNext();
+                break;
+            }
+            case DONE: {
+                done = true;
+                if (ctx.IsCancelled()) { // the client disconnects or crashes
+                    std::cout << "Client " << client_id << " context cancelled, shutting down queue" << std::endl;
+                }
+                BeginFinish();
+                break;
+            }
+            case FINISH: {
+                finished = true;
+                break;
+            }
+        }
+        MaybeDelete();
+    }
+
+private:
+    enum Event { REQUEST, WRITE, WAKE, DONE, FINISH };
+
+    void Start() {
+        client_id = request.client_id();
+        std::cout << "Client subscribed: " << client_id << std::endl;
+
+        // Create a queue for this client
+        queue = std::make_shared<NotificationQueue>(fs->notify_queue_capacity); // a notification queue shared pointer
+        queue->shutdown = false; // not idle: the stream drains it right after the first batch
+
+        {
+            std::lock_guard<std::mutex> lock(queue->mu);
+            // runs on the producer's thread with queue->mu held: just hand the work over to our completion queue
+            queue->wake = [this]() {
+                if (wake_pending) return;
+                wake_pending = true;
+                wake_alarm.Set(cq, gpr_now(GPR_CLOCK_MONOTONIC), &wake_tag);
+            };
+        }
+        Resume();
+        std::cout << "Client " << client_id << " subscribed for notifications" << std::endl;
+        SendNext();
+    }
+
+    // puts the queue in place and prepares the first batch: what the client missed since request.from_seq
+    // A client that broke off within the grace period still has its registrations, it is sent just the entries it
+    // was a recipient of. One the server no longer knows (it was reaped, or the server restarted) registers its
+    // cached paths again and is sent every entry since then. If the log can't cover the gap it gets a full resync.
+    void Resume() {
+        std::lock_guard<std::mutex> session(fs->session_mutex);
+        bool known = fs->disconnected.erase(client_id) > 0;
+        {
+            std::lock_guard<std::mutex> lock(fs->client_db_mutex);
+            known = known || fs->clients_db.count(client_id) > 0;
+            fs->clients_db.insert(client_id);
+        }
+        fs->interests.register_client(client_id);
+        for (const std::string& path : request.cached_paths()) fs->interests.add(path, client_id);
 
-   
+        InterestRegistry::ClientId id = 0;
+        bool filter = known && fs->interests.lookup_client(client_id, id);
+        // the log lock keeps anything from being published between the replay and the queue going live, what was
+        // published before but is still on its way through the fan-out may arrive twice, which is harmless
+        std::lock_guard<std::mutex> log_lock(fs->change_log.mu);
+        if (request.epoch() != 0) {
+            size_t replayed = 0;
+            bool exact = fs->change_log.replay(request.epoch(), request.from_seq(), [&](const ChangeLog::Entry& entry) {
+                if (entry.origin == client_id) return;
+                if (filter && entry.clients && !std::binary_search(entry.clients->begin(), entry.clients->end(), id)) return;
+                if (++replayed > fs->notify_queue_capacity) return;
+                *first_batch.add_notifications() = entry.notif;
+            });
+            if (!exact || replayed > fs->notify_queue_capacity) {
+                first_batch.clear_notifications();
+                afs_operation::Notification* all = first_batch.add_notifications();
+                all->set_type(afs_operation::NOTIFY_RESYNC);
+                all->set_seq(fs->change_log.head());
+            }
+            std::cout << "Client " << client_id << " resumes after " << request.from_seq() << ": "
+                      << (exact ? std::to_string(first_batch.notifications_size()) + " notification(s) replayed" : "resync") << std::endl;
+        }
+        first_batch.set_epoch(fs->change_log.epoch());
+        first_batch.set_head_seq(fs->change_log.head());
+        std::lock_guard<std::shared_mutex> lock(fs->subscriber_mutex);
+        fs->subscribers[client_id] = queue;
+    }
 
-    std::thread monitor([context, queue, client_id]() {
-        while (!context->IsCancelled()) { // constantly checking whether context is cancelled, the context may be cancelled when the client disconnects or crashes
-            std::this_thread::sleep_for(std::chrono::seconds(5)); // check every 5s
+    // write everything queued as one batch, at most one write is in flight per stream
+    // Whatever arrives while a write is in flight waits in the ring for the next batch, where repeats for a path fold
+    // into one; if it overflows meanwhile the next batch ends with a resync
+    void SendNext() {
+        if (writing || finishing) return;
+        if (!first_sent) { // always written, it tells the client where the log stands
+            first_sent = true;
+            writing = true;
+            writer.Write(first_batch, &write_tag);
+            return;
         }
-        std::cout << "Client " << client_id << " context cancelled, shutting down queue" << std::endl;
-        queue->cancel();
-    });
-    monitor.detach();
-    // when the thread function completes it is automatically handled by the OS
-    // it completely detaches from this current thread and becomes a daemon thread 
+        while (true) {
+            bool shutdown = queue->shutdown.load(std::memory_order_acquire);
+            batch.Clear();
+            if (queue->pop_batch(batch)) {
+                std::cout << "sending " << batch.notifications_size() << " notification(s) to " << client_id << std::endl;
+                writing = true;
+                writer.Write(batch, &write_tag);
+                return;
+            }
+            if (shutdown) { // graceful shutdown benefitting from the cancel() function
+                BeginFinish();
+                return;
+            }
+            if (queue->park()) return; // idle until a producer wakes us
+        }
+    }
+
+    void BeginFinish() {
+        if (!finishing) {
+            finishing = true;
+            {
+                // producers must not touch this stream anymore
+                std::lock_guard<std::mutex> lock(queue->mu);
+                queue->wake = nullptr;
+            }
+            // unhook from subscribers; the interest registry and client_db entries stay for a while in case the
+            // client resumes
+            fs->disconnect_client(client_id, queue);
+        }
+        // Finish can only be issued once the outstanding write (if any) has come back
+        if (!writing && !finish_sent) {
+            finish_sent = true;
+            writer.Finish(grpc::Status::OK, &finish_tag);
+        }
+    }
 
-     // This thread will now "sleep" inside queue->pop() until an event happens
-    afs_operation::Notification note;
-    while(queue->pop(note)){                           // this keeps returning true unless shutdown + queue empty
-        // If Write fails (client disconnected), we break the loop
-        std::cout << "popping: " << note.directory() << " " << note.message() << std::endl;
-        if (!writer->Write(note)) {
-            std::cout << "Client disconnected: " << client_id << std::endl;
-            break; 
+    void MaybeDelete() {
+        if (!finished || !done) return;
+        {
+            std::lock_guard<std::mutex> lock(queue->mu);
+            if (wake_pending) { // the alarm still holds our tag, wait for it to come back
+                wake_alarm.Cancel();
+                return;
+            }
         }
+        delete this;
     }
 
-    // clean up the three maps: file_map, client_db, subscribers
-    cleanup_client(client_id);
-    
-    return grpc::Status::OK;
-}
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    afs_operation::SubscribeRequest request;
+    grpc::ServerAsyncWriter<afs_operation::NotificationBatch> writer;
+    std::string client_id;
+    std::shared_ptr<NotificationQueue> queue;
+    afs_operation::NotificationBatch batch;
+    afs_operation::NotificationBatch first_batch; // replayed notifications, epoch and head_seq
+    bool first_sent = false;
+    grpc::Alarm wake_alarm;
+    bool wake_pending = false; // guarded by queue->mu
+    bool writing = false;
+    bool finishing = false;
+    bool finish_sent = false;
+    bool finished = false;
+    bool done = false;
+    CallTag request_tag{this, REQUEST};
+    CallTag write_tag{this, WRITE};
+    CallTag wake_tag{this, WAKE};
+    CallTag done_tag{this, DONE};
+    CallTag finish_tag{this, FINISH};
+};
 
 
-#endif 
\ No newline at end of file
+#endif
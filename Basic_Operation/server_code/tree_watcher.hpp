@@ -0,0 +1,242 @@
+#ifndef TREE_WATCHER_HPP
+#define TREE_WATCHER_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Reports changes to the tree under a root directory, whoever makes them, through inotify
+// Every directory gets a watch, directories created or moved in later get theirs as they show up. The two halves of
+// a rename inside the tree are paired into one MOVED change; a file moved out of the tree is REMOVED, one moved in
+// is CHANGED. OVERFLOW means changes were lost (the kernel queue overflowed, or the root itself went away) and
+// whoever listens has to assume anything may have changed. Paths are reported as root + "/" + relative path, the
+// way clients spell them. Only available on Linux, start() fails elsewhere.
+class TreeWatcher {
+public:
+    struct Change {
+        enum Kind { CHANGED, REMOVED, MOVED, OVERFLOW };
+        Kind kind;
+        std::string path;
+        std::string new_path; // MOVED only
+        bool directory = false;
+    };
+
+    using Listener = std::function<void(const Change&)>;
+
+    ~TreeWatcher() { stop(); }
+
+    // watches root and calls listener from the watcher thread; false if root can't be watched completely
+    bool start(const std::string& root_dir, Listener listener_fn) {
+#ifdef __linux__
+        root = root_dir;
+        while (root.size() > 1 && root.back() == '/') root.pop_back();
+        listener = std::move(listener_fn);
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) return false;
+        if (!watch_tree(root)) {
+            std::cerr << "Can't watch every directory under " << root << " (fs.inotify.max_user_watches?)" << std::endl;
+            close(fd);
+            fd = -1;
+            std::lock_guard<std::mutex> lock(mu);
+            watches.clear();
+            return false;
+        }
+        running = true;
+        watcher = std::thread(&TreeWatcher::Watch, this);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void stop() {
+        running = false;
+        if (watcher.joinable()) watcher.join();
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+        fd = -1;
+#endif
+    }
+
+    size_t watch_count() {
+        std::lock_guard<std::mutex> lock(mu);
+        return watches.size();
+    }
+
+    // the server writes a new version of a file next to it as .<name>.afs_<kind>.XXXXXX (kind: delta, chunks,
+    // plain, range, append) and renames it in place, no client ever sees that name
+    static bool server_temp(const std::string& path) {
+        static const char* const kinds[] = {"delta", "chunks", "plain", "range", "append"};
+        size_t slash = path.rfind('/');
+        std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+        size_t mark = name.rfind(".afs_");
+        if (name.empty() || name[0] != '.' || mark == std::string::npos || mark == 0) return false;
+        std::string rest = name.substr(mark + 5); // <kind>.XXXXXX
+        for (const char* kind : kinds) {
+            size_t len = std::strlen(kind);
+            if (rest.size() == len + 7 && rest.compare(0, len, kind) == 0 && rest[len] == '.') return true;
+        }
+        return false;
+    }
+
+    // change as a listener should take it: the rename of a server temp file in place is a change of the file
+    // itself, anything else about one is nothing to report (false)
+    static bool strip_server_temp(Change& change) {
+        if (change.kind == Change::OVERFLOW || change.directory || !server_temp(change.path)) return true;
+        if (change.kind != Change::MOVED || server_temp(change.new_path)) return false;
+        change = Change{Change::CHANGED, change.new_path, "", false};
+        return true;
+    }
+
+private:
+#ifdef __linux__
+    static constexpr uint32_t kMask = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                      IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    // watches dir and every directory below it, false if the kernel refuses one (usually out of watches)
+    // With report, whatever is already inside is reported as CHANGED: it was moved in, or created before the watch
+    bool watch_tree(const std::string& dir, bool report = false) {
+        if (!add_watch(dir)) return false;
+        std::error_code ec;
+        for (std::filesystem::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            bool directory = it->is_directory(ec) && !it->is_symlink(ec);
+            if (directory && !add_watch(it->path().string())) return false;
+            if (report) listener(Change{Change::CHANGED, it->path().string(), "", directory});
+        }
+        return true;
+    }
+
+    bool add_watch(const std::string& dir) {
+        int wd = inotify_add_watch(fd, dir.c_str(), kMask);
+        if (wd < 0) return errno == ENOENT || errno == ENOTDIR; // gone already, nothing to watch
+        std::lock_guard<std::mutex> lock(mu);
+        watches[wd] = dir;
+        return true;
+    }
+
+    // a directory moved inside the tree keeps its watches, only the paths they stand for change
+    void rename_watches(const std::string& from, const std::string& to) {
+        std::lock_guard<std::mutex> lock(mu);
+        for (auto& [wd, dir] : watches) {
+            if (dir == from) {
+                dir = to;
+            } else if (dir.size() > from.size() && dir.compare(0, from.size(), from) == 0 && dir[from.size()] == '/') {
+                dir = to + dir.substr(from.size());
+            }
+        }
+    }
+
+    // a directory moved out of the tree is none of our business any more
+    void drop_watches(const std::string& gone) {
+        std::lock_guard<std::mutex> lock(mu);
+        for (auto it = watches.begin(); it != watches.end();) {
+            const std::string& dir = it->second;
+            if (dir == gone || (dir.size() > gone.size() && dir.compare(0, gone.size(), gone) == 0 && dir[gone.size()] == '/')) {
+                inotify_rm_watch(fd, it->first);
+                it = watches.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void Watch() {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        while (running) {
+            struct pollfd p{fd, POLLIN, 0};
+            if (poll(&p, 1, 200) <= 0) {
+                flush_move(); // its other half never came, it left the tree
+                continue;
+            }
+            ssize_t n;
+            while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* at = buffer; at < buffer + n;) {
+                    const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(at);
+                    Handle(*event);
+                    at += sizeof(struct inotify_event) + event->len;
+                }
+            }
+        }
+    }
+
+    void Handle(const struct inotify_event& event) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            flush_move();
+            listener(Change{Change::OVERFLOW, root, "", false});
+            return;
+        }
+        std::string dir;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            auto it = watches.find(event.wd);
+            if (it == watches.end()) return;
+            dir = it->second;
+            if (event.mask & IN_IGNORED) { // the watch went away with its directory
+                watches.erase(it);
+                return;
+            }
+        }
+        if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            // below the root the parent's watch reports it; the root itself has no parent under watch
+            if (dir == root) listener(Change{Change::OVERFLOW, root, "", false});
+            return;
+        }
+        std::string path = event.len > 0 ? dir + "/" + event.name : dir;
+        bool directory = event.mask & IN_ISDIR;
+        if (event.mask & IN_MOVED_TO && moving && moving_cookie == event.cookie) {
+            Change change{Change::MOVED, moving_path, path, directory};
+            moving = false;
+            if (directory) rename_watches(change.path, change.new_path);
+            listener(change);
+            return;
+        }
+        flush_move();
+        if (event.mask & IN_MOVED_FROM) {
+            moving = true;
+            moving_cookie = event.cookie;
+            moving_path = path;
+            moving_directory = directory;
+            return;
+        }
+        listener(Change{event.mask & IN_DELETE ? Change::REMOVED : Change::CHANGED, path, "", directory});
+        if (directory && event.mask & (IN_CREATE | IN_MOVED_TO)) watch_tree(path, true);
+    }
+
+    void flush_move() {
+        if (!moving) return;
+        moving = false;
+        if (moving_directory) drop_watches(moving_path);
+        listener(Change{Change::REMOVED, moving_path, "", moving_directory});
+    }
+
+    int fd = -1;
+#endif
+
+    std::string root;
+    Listener listener;
+    std::atomic<bool> running{false};
+    std::thread watcher;
+    std::mutex mu;
+    std::unordered_map<int, std::string> watches; // watch descriptor -> directory
+    // the first half of a rename, waiting for the second (watcher thread only)
+    bool moving = false;
+    uint32_t moving_cookie = 0;
+    std::string moving_path;
+    bool moving_directory = false;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef WALK_HANDLER_HPP
+#define WALK_HANDLER_HPP
+
+#include "filesystem_server.hpp"
+#include "async_call_data.hpp"
+#include <grpcpp/alarm.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// walk reads a subtree with a pool of walk_threads workers, each taking the next directory off a shared stack,
+// listing it with the attributes of its entries and putting the directories it finds back on the stack
+// What they read waits in a bounded queue (a few batches worth) until the stream writes it, workers stall while it
+// is full, so a slow client never makes the server hold the whole tree. The stream itself never blocks its
+// completion queue thread: when the queue is empty it goes idle, and the next worker that has something fires an
+// alarm to wake it, as the subscriber streams do.
+// With a client id every directory is registered for the client before it is read, as ls does for a cached listing.
+class WalkCallData : public CallData {
+public:
+    WalkCallData(FileSystem* fs, AsyncService* service, grpc::ServerCompletionQueue* cq)
+        : fs(fs), service(service), cq(cq), writer(&ctx) {
+        service->Requestwalk(&ctx, &request, &writer, cq, cq, &request_tag);
+    }
+
+    ~WalkCallData() {
+        Stop();
+    }
+
+    void Proceed(int event, bool ok) override {
+        switch (event) {
+            case REQUEST: {
+                if (!ok) {
+                    delete this;
+                    return;
+                }
+                new WalkCallData(fs, service, cq);
+                Start();
+                break;
+            }
+            case WRITE: {
+                writing = false;
+                if (!ok) { // the client went away, no point reading the rest of the tree
+                    Stop();
+                    Finish(grpc::Status::CANCELLED);
+                    break;
+                }
+                SendNext();
+                break;
+            }
+            case WAKE: {
+                {
+                    std::lock_guard<std::mutex> lock(mu);
+                    wake_pending = false;
+                }
+                SendNext();
+                break;
+            }
+            case FINISH: {
+                finished = true;
+                break;
+            }
+        }
+        MaybeDelete();
+    }
+
+private:
+    enum Event { REQUEST, WRITE, WAKE, FINISH };
+    static const uint32_t kDefaultBatch = 1024;
+    static const uint32_t kMaxBatch = 8192;
+    static const size_t kQueuedBatches = 8; // read ahead of the stream
+
+    struct Pending {
+        std::string path;
+        uint32_t depth; // 0 for the directory the walk started at
+    };
+
+    void Start() {
+        std::string root = request.directory();
+        struct stat s;
+        if (::stat(root.c_str(), &s) != 0) {
+            Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "Specified Directory not found"));
+            return;
+        }
+        if (!S_ISDIR(s.st_mode)) {
+            Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "Path is not a directory"));
+            return;
+        }
+        batch_size = request.batch_size() == 0 ? kDefaultBatch : std::min(request.batch_size(), kMaxBatch);
+        started = std::chrono::steady_clock::now();
+        pending.push_back(Pending{root, 0});
+        size_t threads = static_cast<size_t>(std::max(1, fs->walk_threads));
+        running = threads;
+        for (size_t i = 0; i < threads; i++) workers.emplace_back(&WalkCallData::Work, this);
+        SendNext();
+    }
+
+    // worker: lists directories until the stack is empty and nobody is reading one that could add more
+    void Work() {
+        std::unique_lock<std::mutex> lock(mu);
+        while (true) {
+            work_cv.wait(lock, [this] { return cancelled || !pending.empty() || busy == 0; });
+            if (cancelled || pending.empty()) break;
+            Pending next = std::move(pending.back());
+            pending.pop_back();
+            busy++;
+            lock.unlock();
+            ReadDirectory(next);
+            lock.lock();
+            busy--;
+            if (busy == 0 && pending.empty()) work_cv.notify_all(); // the walk is over, let the others go
+        }
+        if (--running == 0) Wake(); // the stream may be waiting for the end
+    }
+
+    void ReadDirectory(const Pending& next) {
+        std::string key = FileSystem::directory_key(next.path);
+        if (!request.client_id().empty()) fs->interests.add(key, request.client_id());
+        DIR* dir = opendir(next.path.c_str());
+        if (!dir) return; // removed or unreadable since its parent was read
+        std::string prefix = next.path + (next.path.back() == '/' ? "" : "/");
+        bool descend = request.max_depth() == 0 || next.depth + 1 < request.max_depth();
+        std::vector<Pending> children;
+        afs_operation::WalkDirectory part;
+        part.set_directory(key);
+        struct dirent* entry;
+        while (!cancelled && (entry = readdir(dir)) != nullptr) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            struct stat s;
+            if (!fs->stat_cached(prefix + entry->d_name, &s)) continue; // removed since it was listed
+            // only real directories are entered, a symlink to one is listed but could lead in circles
+            struct stat own;
+            bool directory = entry->d_type == DT_DIR ||
+                (entry->d_type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &own, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(own.st_mode));
+            if (directory && descend) children.push_back(Pending{prefix + entry->d_name, next.depth + 1});
+            afs_operation::DirectoryEntryPlus* out = part.add_entries();
+            out->set_name(entry->d_name);
+            FileSystem::fill_attributes(s, out->mutable_attr());
+            if (static_cast<uint32_t>(part.entries_size()) >= batch_size) {
+                Emit(std::move(part));
+                part = afs_operation::WalkDirectory();
+                part.set_directory(key);
+            }
+        }
+        closedir(dir);
+        if (!children.empty()) {
+            std::lock_guard<std::mutex> lock(mu);
+            for (Pending& child : children) pending.push_back(std::move(child));
+            work_cv.notify_all();
+        }
+        part.set_complete(true);
+        Emit(std::move(part));
+        directories++;
+    }
+
+    // hands a part to the stream, waiting while the stream is behind
+    void Emit(afs_operation::WalkDirectory&& part) {
+        size_t entries = std::max(1, part.entries_size());
+        std::unique_lock<std::mutex> lock(mu);
+        space_cv.wait(lock, [&] { return cancelled || queued < batch_size * kQueuedBatches; });
+        if (cancelled) return;
+        queued += entries;
+        total_entries += part.entries_size();
+        out.push_back(std::move(part));
+        Wake();
+    }
+
+    // called with mu held: gets an idle stream going again on its completion queue
+    void Wake() {
+        if (!idle || wake_pending) return;
+        idle = false;
+        wake_pending = true;
+        wake_alarm.Set(cq, gpr_now(GPR_CLOCK_MONOTONIC), &wake_tag);
+    }
+
+    // writes the next batch, one write in flight at a time
+    void SendNext() {
+        if (writing || finishing) return;
+        afs_operation::WalkBatch batch;
+        bool over;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            size_t entries = 0;
+            while (!out.empty()) {
+                size_t next = std::max(1, out.front().entries_size());
+                if (entries > 0 && entries + next > batch_size) break;
+                entries += next;
+                *batch.add_directories() = std::move(out.front());
+                out.pop_front();
+            }
+            queued -= entries;
+            space_cv.notify_all();
+            over = out.empty() && running == 0;
+            if (batch.directories_size() == 0 && !over) {
+                idle = true; // a worker wakes us
+                return;
+            }
+        }
+        if (batch.directories_size() > 0) {
+            writing = true;
+            writer.Write(batch, &write_tag);
+            return;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        std::cout << "Walked " << request.directory() << ": " << directories << " directories, " << total_entries
+                  << " entries in " << elapsed.count() << " ms" << std::endl;
+        Finish(grpc::Status::OK);
+    }
+
+    // stops the workers and waits for them
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            cancelled = true;
+        }
+        work_cv.notify_all();
+        space_cv.notify_all();
+        for (std::thread& worker : workers) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+
+    void Finish(const grpc::Status& status) {
+        if (finishing) return;
+        finishing = true;
+        writer.Finish(status, &finish_tag);
+    }
+
+    void MaybeDelete() {
+        if (!finished) return;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (wake_pending) { // the alarm still holds our tag, wait for it to come back
+                wake_alarm.Cancel();
+                return;
+            }
+        }
+        delete this;
+    }
+
+    FileSystem* fs;
+    AsyncService* service;
+    grpc::ServerCompletionQueue* cq;
+    grpc::ServerContext ctx;
+    afs_operation::WalkRequest request;
+    grpc::ServerAsyncWriter<afs_operation::WalkBatch> writer;
+    uint32_t batch_size = kDefaultBatch;
+    std::chrono::steady_clock::time_point started;
+
+    // shared with the workers, guarded by mu
+    std::mutex mu;
+    std::condition_variable work_cv;  // directories to read, or the walk is over
+    std::condition_variable space_cv; // room in out
+    std::vector<Pending> pending;     // directories found and not read yet, a stack so the walk goes deep first
+    size_t busy = 0;                  // workers reading a directory
+    size_t running = 0;               // workers not exited
+    std::deque<afs_operation::WalkDirectory> out;
+    size_t queued = 0;                // entries in out
+    std::atomic<bool> cancelled{false};
+    bool idle = false;                // the stream waits for a worker to wake it
+    bool wake_pending = false;
+    std::atomic<uint64_t> directories{0};
+    uint64_t total_entries = 0;
+
+    std::vector<std::thread> workers;
+    grpc::Alarm wake_alarm;
+    bool writing = false;
+    bool finishing = false;
+    bool finished = false;
+    CallTag request_tag{this, REQUEST};
+    CallTag write_tag{this, WRITE};
+    CallTag wake_tag{this, WAKE};
+    CallTag finish_tag{this, FINISH};
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef CHUNK_CODEC_HPP
+#define CHUNK_CODEC_HPP
+
+#include <zlib.h>
+#ifdef AFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef AFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Per chunk compression of file content, shared by the client and the server
+// The codec is agreed once per connection in request_dir: the client lists what it can decode, the server picks
+// the best one it has too. Every chunk then says which codec it was compressed with (0 = sent as is), so a sender
+// can leave out any chunk that does not shrink. zlib is always built in, LZ4 and Zstd when their libraries are found.
+namespace chunk_codec {
+
+enum Codec : int32_t { NONE = 0, ZLIB = 1, LZ4 = 2, ZSTD = 3 };
+
+// the codecs this build can encode and decode, best first
+inline std::vector<int32_t> supported() {
+    std::vector<int32_t> codecs;
+#ifdef AFS_HAVE_ZSTD
+    codecs.push_back(ZSTD);
+#endif
+#ifdef AFS_HAVE_LZ4
+    codecs.push_back(LZ4);
+#endif
+    codecs.push_back(ZLIB);
+    return codecs;
+}
+
+// the first codec of ours (best first) that the peer also offers, NONE if there is none
+template <class Offered>
+int32_t choose(const Offered& offered) {
+    for (int32_t codec : supported()) {
+        for (int32_t theirs : offered) {
+            if (theirs == codec) return codec;
+        }
+    }
+    return NONE;
+}
+
+inline const char* name(int32_t codec) {
+    switch (codec) {
+        case ZLIB: return "zlib";
+        case LZ4: return "lz4";
+        case ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+// largest possible output of compress() for len input bytes
+inline size_t bound(int32_t codec, size_t len) {
+    switch (codec) {
+#ifdef AFS_HAVE_LZ4
+        case LZ4: return static_cast<size_t>(LZ4_compressBound(static_cast<int>(len)));
+#endif
+#ifdef AFS_HAVE_ZSTD
+        case ZSTD: return ZSTD_compressBound(len);
+#endif
+        default: return compressBound(static_cast<uLong>(len));
+    }
+}
+
+// compresses in into out (room for bound() bytes), returns the compressed size or 0 on failure
+// The fastest level of each codec: chunks are compressed on the fly and the CPU must not become the bottleneck
+inline size_t compress(int32_t codec, const char* in, size_t len, char* out, size_t capacity) {
+    switch (codec) {
+        case ZLIB: {
+            uLongf out_len = static_cast<uLongf>(capacity);
+            if (compress2(reinterpret_cast<Bytef*>(out), &out_len, reinterpret_cast<const Bytef*>(in), static_cast<uLong>(len), 1) != Z_OK) return 0;
+            return static_cast<size_t>(out_len);
+        }
+#ifdef AFS_HAVE_LZ4
+        case LZ4: {
+            int n = LZ4_compress_default(in, out, static_cast<int>(len), static_cast<int>(capacity));
+            return n > 0 ? static_cast<size_t>(n) : 0;
+        }
+#endif
+#ifdef AFS_HAVE_ZSTD
+        case ZSTD: {
+            size_t n = ZSTD_compress(out, capacity, in, len, 1);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+// decompresses exactly raw_len bytes into out, false if the data is corrupt or of another size
+inline bool decompress(int32_t codec, const char* in, size_t len, char* out, size_t raw_len) {
+    switch (codec) {
+        case ZLIB: {
+            uLongf out_len = static_cast<uLongf>(raw_len);
+            return uncompress(reinterpret_cast<Bytef*>(out), &out_len, reinterpret_cast<const Bytef*>(in), static_cast<uLong>(len)) == Z_OK &&
+                   out_len == raw_len;
+        }
+#ifdef AFS_HAVE_LZ4
+        case LZ4:
+            return LZ4_decompress_safe(in, out, static_cast<int>(len), static_cast<int>(raw_len)) == static_cast<int>(raw_len);
+#endif
+#ifdef AFS_HAVE_ZSTD
+        case ZSTD:
+            return ZSTD_decompress(out, raw_len, in, len) == raw_len;
+#endif
+        default:
+            return false;
+    }
+}
+
+// the most a compressed chunk may claim to decode to; chunks are at most a few MiB, a bigger (or negative) raw
+// length comes from a broken or hostile peer and must not decide how much memory we allocate
+const int64_t kMaxRawLength = 64 * 1024 * 1024;
+
+inline bool valid_raw_length(int32_t codec, int64_t raw_len) {
+    return codec == NONE || (raw_len > 0 && raw_len <= kMaxRawLength);
+}
+
+// the content of a chunk as the file's bytes: content itself when it was sent as is, otherwise decoded into scratch
+// Returns nullptr if the chunk can't be decoded or claims an impossible raw length
+inline const std::string* plain_content(int32_t codec, const std::string& content, int64_t raw_len, std::string& scratch) {
+    if (codec == NONE) return &content;
+    if (!valid_raw_length(codec, raw_len)) return nullptr;
+    scratch.resize(static_cast<size_t>(raw_len));
+    if (!decompress(codec, content.data(), content.size(), scratch.data(), scratch.size())) return nullptr;
+    return &scratch;
+}
+
+// Decides chunk by chunk whether compressing is worth it for one transfer
+// The first chunk is the sample: if it does not shrink by at least 10% the data is taken to be compressed already
+// (media, archives) and the rest of the transfer goes out as is without spending CPU on it
+class Sampler {
+public:
+    explicit Sampler(int32_t codec = NONE) : codec(codec) {}
+
+    // compresses len bytes into out (room for bound()), returns the compressed size or 0 to send the chunk as is
+    size_t compress(const char* in, size_t len, char* out, size_t capacity) {
+        if (codec == NONE || len < kMinChunk) return 0;
+        size_t n = chunk_codec::compress(codec, in, len, out, capacity);
+        bool worth_it = n > 0 && n <= len - len / 10;
+        if (sampling && !worth_it) codec = NONE;
+        sampling = false;
+        return worth_it ? n : 0;
+    }
+
+    int32_t active() const { return codec; }
+
+private:
+    static const size_t kMinChunk = 512; // smaller chunks hardly shrink and are cheap to send anyway
+    int32_t codec;
+    bool sampling = true;
+};
+
+} // namespace chunk_codec
+
+#endif
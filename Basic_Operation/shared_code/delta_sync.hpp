@@ -0,0 +1,187 @@
+#ifndef DELTA_SYNC_HPP
+#define DELTA_SYNC_HPP
+
+#include <openssl/evp.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// rsync-style delta transfer shared by the client (close_file) and the server (signatures / close_delta)
+// The server describes the version it holds as a list of fixed size blocks, each with a cheap rolling checksum
+// and a strong hash. The client slides a window over its new version and every position whose rolling checksum
+// and strong hash both match a block is sent as a reference to that block; everything else goes as literal bytes.
+namespace delta_sync {
+
+const size_t kMinBlock = 2 * 1024;
+const size_t kMaxBlock = 64 * 1024;
+const size_t kStrongBytes = 16;                 // truncated SHA-256, plenty to tell blocks with the same weak sum apart
+const int64_t kMinDeltaFile = 16 * 1024;         // below this a plain upload is cheaper than a signature round trip
+const size_t kMaxLiteral = 1024 * 1024;          // literal runs are split so that no message grows unbounded
+
+// block size grows with the square root of the file like rsync's, so the signature stays small for big files
+inline size_t choose_block_size(int64_t file_size) {
+    size_t block = kMinBlock;
+    while (block < kMaxBlock && static_cast<int64_t>(block) * static_cast<int64_t>(block) < file_size) {
+        block *= 2;
+    }
+    return block;
+}
+
+// rsync's weak checksum: two 16 bit sums that can be slid one byte at a time
+class RollingChecksum {
+public:
+    void init(const char* data, size_t len) {
+        a = b = 0;
+        count = len;
+        for (size_t i = 0; i < len; i++) {
+            uint8_t c = static_cast<uint8_t>(data[i]);
+            a += c;
+            b += static_cast<uint32_t>(len - i) * c;
+        }
+    }
+
+    // drop `out` from the front of the window and take `in` at its back
+    void roll(char out, char in) {
+        uint8_t o = static_cast<uint8_t>(out);
+        uint8_t n = static_cast<uint8_t>(in);
+        a += n - o;
+        b += a - static_cast<uint32_t>(count) * o;
+    }
+
+    uint32_t value() const { return (a & 0xffff) | (b << 16); }
+
+private:
+    uint32_t a = 0;
+    uint32_t b = 0;
+    size_t count = 0;
+};
+
+inline std::string strong_hash(const char* data, size_t len) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    EVP_Digest(data, len, digest, &digest_len, EVP_sha256(), nullptr);
+    return std::string(reinterpret_cast<char*>(digest), kStrongBytes);
+}
+
+// incremental SHA-256 over a whole file, used to check the rebuilt version end to end
+class Sha256 {
+public:
+    Sha256() : ctx(EVP_MD_CTX_new()) { EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr); }
+    ~Sha256() { EVP_MD_CTX_free(ctx); }
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const char* data, size_t len) { EVP_DigestUpdate(ctx, data, len); }
+
+    std::string final() {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len = 0;
+        EVP_DigestFinal_ex(ctx, digest, &digest_len);
+        return std::string(reinterpret_cast<char*>(digest), digest_len);
+    }
+
+private:
+    EVP_MD_CTX* ctx;
+};
+
+struct BlockSignature {
+    uint32_t weak;
+    std::string strong;
+};
+
+// signature of one block of the server's version; the last block may be shorter than block_size
+inline BlockSignature sign_block(const char* data, size_t len) {
+    RollingChecksum sum;
+    sum.init(data, len);
+    return BlockSignature{sum.value(), strong_hash(data, len)};
+}
+
+// Walks data against the server's signatures and reports the delta in order through two callbacks:
+//   literal(const char* bytes, size_t len)            bytes the server does not have
+//   copy(int64_t first_block, int64_t block_count)     a run of consecutive server blocks to reuse
+// Only full blocks are looked up while sliding; a short last block is only matched against the tail of data.
+template <class LiteralFn, class CopyFn>
+void compute_delta(const char* data, size_t len, const std::vector<BlockSignature>& blocks, size_t block_size,
+                   int64_t base_size, LiteralFn literal, CopyFn copy) {
+    int64_t full_blocks = base_size / static_cast<int64_t>(block_size);
+    std::unordered_map<uint32_t, std::vector<int64_t>> lookup;
+    lookup.reserve(static_cast<size_t>(full_blocks));
+    for (int64_t i = 0; i < full_blocks; i++) {
+        lookup[blocks[i].weak].push_back(i);
+    }
+
+    int64_t run_start = -1, run_length = 0;
+    auto flush_run = [&]() {
+        if (run_length > 0) copy(run_start, run_length);
+        run_start = -1;
+        run_length = 0;
+    };
+    auto add_block = [&](int64_t index) {
+        if (run_length > 0 && run_start + run_length == index) {
+            run_length++;
+            return;
+        }
+        flush_run();
+        run_start = index;
+        run_length = 1;
+    };
+    size_t literal_start = 0;
+    auto flush_literal = [&](size_t end) {
+        if (end > literal_start) flush_run();
+        while (literal_start < end) {
+            size_t n = std::min(end - literal_start, kMaxLiteral);
+            literal(data + literal_start, n);
+            literal_start += n;
+        }
+    };
+
+    size_t pos = 0;
+    RollingChecksum sum;
+    if (full_blocks > 0 && len >= block_size) sum.init(data, block_size);
+    while (full_blocks > 0 && pos + block_size <= len) {
+        int64_t matched = -1;
+        auto it = lookup.find(sum.value());
+        if (it != lookup.end()) {
+            std::string strong = strong_hash(data + pos, block_size);
+            for (int64_t index : it->second) {
+                if (blocks[index].strong == strong) {
+                    matched = index;
+                    break;
+                }
+            }
+        }
+        if (matched >= 0) {
+            flush_literal(pos);
+            add_block(matched);
+            pos += block_size;
+            literal_start = pos;
+            if (pos + block_size <= len) sum.init(data + pos, block_size);
+            continue;
+        }
+        // a long literal run is sent as it grows instead of being held back until the next match
+        if (pos - literal_start >= kMaxLiteral) flush_literal(pos);
+        if (pos + block_size < len) sum.roll(data[pos], data[pos + block_size]);
+        pos++;
+    }
+
+    // the short last block of the server's version can only line up with the end of ours
+    size_t tail = static_cast<size_t>(base_size % static_cast<int64_t>(block_size));
+    if (tail > 0 && len - literal_start >= tail) {
+        const BlockSignature& last = blocks[full_blocks];
+        size_t at = len - tail;
+        if (sign_block(data + at, tail).strong == last.strong) {
+            flush_literal(at);
+            add_block(full_blocks);
+            literal_start = len;
+        }
+    }
+    flush_literal(len);
+    flush_run();
+}
+
+} // namespace delta_sync
+
+#endif
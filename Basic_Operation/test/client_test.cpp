@@ -6,6 +6,8 @@
 #include <thread>
 #include <chrono>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <fstream>
 
 // ANSI Color codes for pretty output
 #define GREEN "\033[32m"
@@ -95,4 +97,41 @@ int main(){
     bool comp_1 = std::string("This is my testHi") == buffer_1_str;
     std::cout << "The read value by client_1 is: " << buffer_1_str << std::endl;
     assert_true(comp_1, "The register callback worked and client is now reading the value that client 2 wrote to the server");
+    client_1 -> close_file(filename, directory);
+
+    // a restarted client finds its old copy on disk and revalidates it with compare() instead of downloading it
+    delete client_1;
+    std::string server_dir = client_2 -> resolve_server_path(directory);
+    std::string cached_copy = "./tmp1/cache" + std::string(server_dir.front() == '/' ? "" : "/") + server_dir + "/" + filename;
+    struct stat before;
+    assert_true(stat(cached_copy.c_str(), &before) == 0, "client_1 left its cached copy on disk");
+    {
+        // scribble over the copy but keep its version stamp: only a copy that was not downloaded again still shows it
+        std::fstream scribble(cached_copy, std::ios::binary | std::ios::in | std::ios::out);
+        scribble.write("XXXX", 4);
+    }
+    #ifdef __APPLE__
+        struct timespec stamp[2] = {before.st_mtimespec, before.st_mtimespec};
+    #else
+        struct timespec stamp[2] = {before.st_mtim, before.st_mtim};
+    #endif
+    utimensat(AT_FDCWD, cached_copy.c_str(), stamp, 0);
+
+    FileSystemClient* client_3 = new FileSystemClient(channel, "./tmp1/cache");
+    std::vector<char> buffer_3;
+    assert_true(client_3 -> open_file(filename, directory), "restarted client opened its cached copy");
+    client_3 -> read_file(filename, directory, 17, 0, buffer_3);
+    assert_true(std::string(buffer_3.begin(), buffer_3.end()) == "XXXX is my testHi", "server answered not modified and the copy was kept");
+    client_3 -> close_file(filename, directory);
+    delete client_3;
+
+    // a copy whose stamp no longer matches the server's version is replaced
+    struct timespec old_stamp[2] = {{1, 0}, {1, 0}};
+    utimensat(AT_FDCWD, cached_copy.c_str(), old_stamp, 0);
+    FileSystemClient* client_4 = new FileSystemClient(channel, "./tmp1/cache");
+    std::vector<char> buffer_4;
+    assert_true(client_4 -> open_file(filename, directory), "restarted client reopened the outdated copy");
+    client_4 -> read_file(filename, directory, 17, 0, buffer_4);
+    assert_true(std::string(buffer_4.begin(), buffer_4.end()) == "This is my testHi", "outdated copy was refreshed from the server");
+    client_4 -> close_file(filename, directory);
 }
\ No newline at end of file
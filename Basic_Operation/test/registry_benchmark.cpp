@@ -0,0 +1,98 @@
+#include "interest_registry.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <malloc.h>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Memory scaling of the server's interest registry
+// Registers paths × holders (path, client) pairs, like clients caching files after an open, and reports the heap it
+// takes against the layout the server used before the registry interned ids: a map of full path strings to sets of
+// full client id strings. Heap usage comes from glibc's mallinfo2, so this benchmark is Linux only.
+// Usage: registry_benchmark [max_paths] [clients] [holders_per_path]
+
+static size_t heap_in_use() {
+    return mallinfo2().uordblks;
+}
+
+// paths shaped like the server's: the root, a few directory levels, a file name
+static std::string make_path(size_t i) {
+    return "./server_test/project_" + std::to_string(i % 97) + "/src/module_" + std::to_string(i % 1013) +
+           "/file_" + std::to_string(i) + ".txt";
+}
+
+// 36 characters, like the uuids clients identify themselves with
+static std::string make_client(size_t i) {
+    char id[64];
+    std::snprintf(id, sizeof(id), "%08x-4b1c-4e2a-9f3d-%012zx", static_cast<unsigned>(i * 2654435761u), i);
+    return id;
+}
+
+struct Result {
+    size_t bytes;
+    double seconds;
+};
+
+template <class Fn>
+static Result measure(Fn fn) {
+    size_t before = heap_in_use();
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+    return Result{heap_in_use() - before, std::chrono::duration<double>(end - start).count()};
+}
+
+int main(int argc, char** argv) {
+    size_t max_paths = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t client_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000;
+    size_t holders = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 4;
+
+    std::vector<std::string> clients;
+    for (size_t i = 0; i < client_count; i++) clients.push_back(make_client(i));
+
+    std::cout << "clients: " << client_count << ", holders per path: " << holders << std::endl;
+    std::cout << "paths      string map (MB)  registry (MB)  bytes/pair before  bytes/pair after  registry adds/s" << std::endl;
+    for (size_t paths = 10000; paths <= max_paths; paths *= 10) {
+        std::mt19937 random(42);
+        std::vector<std::pair<size_t, size_t>> pairs;
+        pairs.reserve(paths * holders);
+        for (size_t p = 0; p < paths; p++) {
+            for (size_t h = 0; h < holders; h++) pairs.emplace_back(p, random() % client_count);
+        }
+
+        Result before;
+        {
+            std::unordered_map<std::string, std::unordered_set<std::string>> file_map;
+            before = measure([&] {
+                for (const auto& [p, c] : pairs) file_map[make_path(p)].insert(clients[c]);
+            });
+        }
+        Result after;
+        {
+            InterestRegistry registry;
+            for (const std::string& client : clients) registry.register_client(client);
+            after = measure([&] {
+                for (const auto& [p, c] : pairs) registry.add(make_path(p), clients[c]);
+            });
+            if (registry.path_count() != paths) {
+                std::cerr << "registry lost paths: " << registry.path_count() << " of " << paths << std::endl;
+                return 1;
+            }
+            // a disconnect only walks the paths that client held
+            auto start = std::chrono::steady_clock::now();
+            registry.remove_client(clients[0]);
+            double cleanup = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::printf("           cleanup of one client: %.3f ms\n", cleanup * 1000);
+        }
+
+        double pair_count = static_cast<double>(pairs.size());
+        std::printf("%-10zu %-16.1f %-14.1f %-18.1f %-17.1f %.0f\n", paths, before.bytes / 1048576.0, after.bytes / 1048576.0,
+                    before.bytes / pair_count, after.bytes / pair_count, pair_count / after.seconds);
+    }
+    return 0;
+}
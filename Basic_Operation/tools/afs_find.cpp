@@ -0,0 +1,54 @@
+#include "filesystem_client.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// afs_find: find by name over the served tree, answered by the server's name index in one round trip
+// Usage: afs_find [-s] [-n limit] <directory> <pattern>
+//   afs_find / '*.parquet'          every .parquet file
+//   afs_find /data 'raw/*/*.csv'    csv files two levels down under /data/raw
+//   afs_find -s / report            names containing "report"
+// Paths go to stdout one per line, as the client names them; the server is SERVER_ADDRESS (localhost:50051).
+
+static int usage(const char* program) {
+    std::fprintf(stderr, "Usage: %s [-s] [-n limit] <directory> <pattern>\n"
+                         "  -s        pattern is a plain substring of the name instead of a glob\n"
+                         "  -n limit  print at most limit paths (default: the server's, 10000)\n", program);
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    bool substring = false;
+    uint32_t limit = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (std::strcmp(argv[arg], "-s") == 0) {
+            substring = true;
+        } else if (std::strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+            limit = static_cast<uint32_t>(std::max(0, std::atoi(argv[++arg])));
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (argc - arg != 2) return usage(argv[0]);
+    std::string directory = argv[arg];
+    std::string pattern = argv[arg + 1];
+
+    const char* env_addr = std::getenv("SERVER_ADDRESS");
+    std::string address = env_addr ? std::string(env_addr) : "localhost:50051";
+    auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
+    // the client library talks on std::cout, stdout is for the paths
+    std::cout.setstate(std::ios::failbit);
+    ClientOptions options;
+    options.listing_cache_entries = 0; // nothing here lives long enough to use a cache, don't ask for callbacks
+    options.negative_cache_entries = 0;
+    FileSystemClient client(channel, "./tmp/cache_find", options);
+
+    auto paths = client.find_paths(directory, pattern, substring, limit);
+    if (!paths) return 1;
+    for (const std::string& path : *paths) std::printf("%s\n", path.c_str());
+    return 0;
+}
@@ -17,6 +17,11 @@ class Dashboard:
         self.stub = None #afs_operation_pb2_grpc.operatorStub(self.channel)
         self.connected_clients: List[str] = []
         self.file_to_clients: Dict[str, List[str]] = {}
+        self.fanout: Dict[str, int] = {}
+        self.subscriber_queues: Dict[str, Dict[str, int]] = {}
+        self.leases: Dict[str, int] = {}
+        self.metadata_cache: Dict[str, int] = {}
+        self.external_changes: Dict[str, int] = {}
         self.server_base_dir: str
 
     def __enter__(self):
@@ -95,6 +100,56 @@ class Dashboard:
 
         self.file_to_clients = file_to_clients_dict
 
+        # how long the server takes to push a notification to every subscriber queue
+        fanout = response.fanout
+        self.fanout = {
+            "events": fanout.events,
+            "pending": fanout.pending,
+            "deliveries": fanout.deliveries,
+            "last_us": fanout.last_us,
+            "avg_us": fanout.avg_us,
+            "max_us": fanout.max_us,
+        }
+
+        # how far behind every subscriber is, and how often one fell so far behind that it got a resync
+        self.subscriber_queues = {
+            client: {
+                "depth": queue.depth,
+                "capacity": queue.capacity,
+                "overflows": queue.overflows,
+                "dropped": queue.dropped,
+                "coalesced": queue.coalesced,
+            }
+            for client, queue in response.subscriber_queues.items()
+        }
+
+        # callback leases: how many paths are registered, and how many leases lapsed without renewal
+        self.leases = {
+            "registered_paths": response.registered_paths,
+            "expired": response.expired_leases,
+        }
+
+        # getattr and ls answered from the server's metadata cache, and how often changes dropped entries from it
+        cache = response.metadata_cache
+        self.metadata_cache = {
+            "attr_hits": cache.attr_hits,
+            "attr_misses": cache.attr_misses,
+            "dir_hits": cache.dir_hits,
+            "dir_misses": cache.dir_misses,
+            "invalidations": cache.invalidations,
+            "entries": cache.entries,
+            "watches": cache.watches,
+        }
+
+        # changes made under the root without going through the server, and what became of them
+        external = response.external_changes
+        self.external_changes = {
+            "events": external.events,
+            "notifications": external.notifications,
+            "scans": external.scans,
+            "watches": external.watches,
+        }
+
 # this FastAPI is like a API for the frontend and backend 
 app = FastAPI()
 dashboard = Dashboard()
@@ -119,6 +174,11 @@ def get_status():
         data = {
             "connected_clients": dashboard.connected_clients,
             "file_to_clients": dashboard.file_to_clients,
+            "fanout": dashboard.fanout,
+            "subscriber_queues": dashboard.subscriber_queues,
+            "leases": dashboard.leases,
+            "metadata_cache": dashboard.metadata_cache,
+            "external_changes": dashboard.external_changes,
             "process": process_metric  # Will be None if server not found
         }
         return data
@@ -3,6 +3,8 @@
 // /usr/local/lib/*fuse*.dylib, where the libraries are installed 
 #include <string.h>
 #include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <memory>
 #include "filesystem_client.hpp"
@@ -15,24 +17,59 @@ static FileSystemClient* get_client(){
 
 
 // 1. Read Directory
+// The listing is streamed a page at a time (list_dir): FUSE calls readdir again and again with the offset of the last
+// entry it kept until the directory is exhausted, and the stream opened in opendir picks up right there
+// A directory streamed in full is cached by the client, the next readdir of it is answered locally until it changes
+static int afs_opendir(const char* path, struct fuse_file_info *fi){
+    fi->fh = reinterpret_cast<uint64_t>(get_client() -> open_directory(path).release());
+    return 0;
+}
+
 static int afs_readdir(const char* path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
-    (void) offset; (void) fi; // avoid "unused parameter" warnings
-    std::string s_path(path); // std::string is type safe, meaning it checks type matching at compile time
+    // a listing the client caches is still what the server has, it goes out in one piece without a round trip
+    if (offset == 0){
+        auto listing = get_client() -> cached_listing(path);
+        if (listing){
+            filler(buf, ".", NULL, 0);
+            filler(buf, "..", NULL, 0);
+            for (const auto& [name, type] : *listing){
+                struct stat st;
+                memset(&st, 0, sizeof(st));
+                st.st_mode = DTTOIF(type); // the type list_dir, ls_plus or walk reported, as the stream would
+                filler(buf, name.c_str(), &st, 0);
+            }
+            return 0;
+        }
+    }
 
-    auto contents = get_client() -> ls_contents(s_path);
-    if (!contents){
-        return -ENOENT;
+    auto* stream = reinterpret_cast<FileSystemClient::DirectoryStream*>(fi->fh);
+    std::unique_ptr<FileSystemClient::DirectoryStream> temporary; // readdir without opendir
+    if (!stream){
+        temporary = get_client() -> open_directory(path);
+        stream = temporary.get();
     }
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    for (const auto& [name, type] : *contents) {   
-        //*contents is dereferencing the optional! going from std::optional<std::map<std::string, std::string>> to std::map<std::string, std::string>
-        filler(buf, name.c_str(), NULL, 0);
+    // the attributes come along, the getattr FUSE issues for every entry next is answered from the client's cache
+    bool ok = stream -> read(static_cast<uint64_t>(offset), [&](const afs_operation::DirEntry& entry){
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_ino = entry.inode();
+        st.st_mode = DTTOIF(entry.type());
+        return filler(buf, entry.name().c_str(), &st, static_cast<off_t>(entry.cookie())) == 0; // 1: the buffer is full
+    });
+    if (!ok){
+        return stream -> not_found ? -ENOENT : -EIO;
     }
     return 0;
 }
 
+static int afs_releasedir(const char* path, struct fuse_file_info *fi){
+    (void) path;
+    delete reinterpret_cast<FileSystemClient::DirectoryStream*>(fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
 // 2. Open File
 static int afs_open(const char* path, struct fuse_file_info *fi){
 
@@ -285,6 +322,13 @@ static int afs_setxattr(const char *path, const char *name, const char *value, s
     
     // On macOS, the function signature might differ slightly depending on FUSE version.
     // If you get a compile error, check if your version adds a 'uint32_t position' arg.
+
+    // the kernel never says a find or du is about to run, so the user does instead:
+    // setfattr -n user.afs.prefetch <dir> brings the whole subtree into the caches in one walk
+    if (strcmp(name, "user.afs.prefetch") == 0) {
+        std::cout << "FUSE: prefetching the subtree under " << path << std::endl;
+        return get_client() -> walk_subtree(path) ? 0 : -EIO;
+    }
     std::cout << "FUSE: setxattr " << name << " (Ignored)" << std::endl;
     return 0;
 }
@@ -371,7 +415,9 @@ static fuse_operations afs_oper = {
     .setxattr   = afs_setxattr,
     .getxattr   = afs_getxattr,
     .listxattr  = afs_listxattr,
+    .opendir    = afs_opendir,
     .readdir    = afs_readdir,
+    .releasedir = afs_releasedir,
     .create     = afs_create,
     .utimens    = afs_utimens,
 };
@@ -383,7 +429,12 @@ int main(int argc, char *argv[]){
     //std::string address = "192.168.0.31:50051";
     auto channel = grpc::CreateChannel(address, grpc::InsecureChannelCredentials());
 
-    FileSystemClient* client = new FileSystemClient(channel);
+    // files above AFS_LAZY_THRESHOLD bytes are opened lazily and fetched block by block as they are read
+    ClientOptions options;
+    const char* env_lazy = std::getenv("AFS_LAZY_THRESHOLD");
+    if (env_lazy) options.lazy_threshold = std::atoll(env_lazy);
+
+    FileSystemClient* client = new FileSystemClient(channel, "./tmp/cache", options);
 
     return fuse_main(argc, argv, &afs_oper, client);
 }